@@ -40,6 +40,11 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <math.h>
+
+#include "ChESS.h"
+#include "cancel.h"
+#include "decimate.hh"
 
 /**
  * Perform the ChESS corner detection algorithm with a 5 px sampling radius
@@ -106,3 +111,362 @@ void mrgingham_ChESS_response_5(      int16_t* WPI_RESTRICT response,
             response[offset_response] = sum_response - diff_response - abs(mean - local_mean);
         }
 }
+
+// Reflects out-of-bounds indices back into [0,n), without repeating the edge
+// pixel. This is OpenCV's default BORDER_REFLECT_101, used by cv::blur()
+static inline int reflect_101(int i, int n)
+{
+    if(n == 1) return 0;
+    while(i < 0 || i >= n)
+    {
+        if(i < 0)  i = -i;
+        if(i >= n) i = 2*n - 2 - i;
+    }
+    return i;
+}
+
+/*
+  Turns a box-filter sum of n pixels into the blurred pixel, rounding exactly
+  the way cv::blur() does on 8-bit images. For kernels of up to 256 pixels
+  (blur_radius <= 7), OpenCV accumulates in 16 bits, and divides with a 16-bit
+  fixed-point multiply: ((s + divDelta) * divScale) >> 16. This isn't always
+  round(s/n): for blur_radius in [2,7] some sums come out 1 lower or higher. For
+  larger kernels OpenCV computes cvRound(s/n). n is odd, so there are no ties,
+  and that's round(s/n) exactly, which I compute as a multiply and shift. I
+  checked exhaustively that this is exact for every blur_radius up to
+  MRGINGHAM_CHESS_BLUR_RADIUS_MAX (it isn't for radii past 34)
+*/
+typedef struct
+{
+    int      n;
+    bool     fixed16;
+    uint32_t divScale, divDelta; // if fixed16
+    uint64_t reciprocal;         // if !fixed16
+} box_normalizer_t;
+
+static box_normalizer_t box_normalizer(int blur_radius)
+{
+    box_normalizer_t b = {};
+    b.n = (1 + 2*blur_radius)*(1 + 2*blur_radius);
+    if (b.n <= 256)
+    {
+        // Same as OpenCV's ColumnSum<ushort,uchar>
+        b.fixed16 = true;
+        double scalef = (double)(1 << 16) / (double)b.n;
+        b.divScale = (uint32_t)floor(scalef);
+        scalef -= b.divScale;
+        b.divDelta = b.n/2;
+        if (scalef < 0.5) b.divDelta++;
+        else              b.divScale++;
+    }
+    else
+        b.reciprocal = ((uint64_t)1 << 32) / b.n + 1;
+    return b;
+}
+
+static inline uint8_t box_normalize(const box_normalizer_t* b, uint32_t sum)
+{
+    if (b->fixed16)
+        return (uint8_t)(((sum + b->divDelta) * b->divScale) >> 16);
+    return (uint8_t)(((uint64_t)(sum + b->n/2) * b->reciprocal) >> 32);
+}
+
+/**
+ * One pixel of the image blurred with a (1+2*blur_radius)^2 box filter. Same
+ * result as mrgingham_ChESS_response_5_blurred() uses internally, and as
+ * cv::blur()
+ */
+uint8_t mrgingham_box_blurred_pixel( const uint8_t* WPI_RESTRICT image,
+                                     int w, int h, int stride,
+                                     int x, int y, int blur_radius )
+{
+    const int r = blur_radius;
+    const box_normalizer_t normalizer = box_normalizer(r);
+    uint32_t sum = 0;
+    int dx, dy;
+    for (dy = -r; dy <= r; dy++)
+    {
+        const uint8_t* row = &image[reflect_101(y+dy, h) * stride];
+        for (dx = -r; dx <= r; dx++)
+            sum += row[reflect_101(x+dx, w)];
+    }
+    return box_normalize(&normalizer, sum);
+}
+
+// One row of the ChESS response, at x in [x_begin,x_end), computed from the 11
+// rows of the image around it: rows[5] is the row of the response. Used by the
+// kernels that produce the image rows on the fly, or only compute some of them.
+// Same arithmetic as mrgingham_ChESS_response_5()
+static void ChESS_response_5_row(      int16_t* WPI_RESTRICT response_row,
+                                 const uint8_t* const*      rows,
+                                 int x_begin, int x_end )
+{
+    int x;
+#define S(dx,dy) rows[5+(dy)][x+(dx)]
+    for (x = x_begin; x < x_end; x++) {
+        uint8_t circular_sample[16];
+
+        circular_sample[2]  = S(-2,-5);
+        circular_sample[1]  = S( 0,-5);
+        circular_sample[0]  = S( 2,-5);
+        circular_sample[8]  = S(-2, 5);
+        circular_sample[9]  = S( 0, 5);
+        circular_sample[10] = S( 2, 5);
+        circular_sample[3]  = S(-4,-4);
+        circular_sample[15] = S( 4,-4);
+        circular_sample[7]  = S(-4, 4);
+        circular_sample[11] = S( 4, 4);
+        circular_sample[4]  = S(-5,-2);
+        circular_sample[14] = S( 5,-2);
+        circular_sample[6]  = S(-5, 2);
+        circular_sample[12] = S( 5, 2);
+        circular_sample[5]  = S(-5, 0);
+        circular_sample[13] = S( 5, 0);
+
+        // purely horizontal local_mean samples
+        uint16_t local_mean = (S(-1,0) + S(0,0) + S(1,0)) * 16 / 3;
+
+        uint16_t sum_response = 0;
+        uint16_t diff_response = 0;
+        uint16_t mean = 0;
+
+        int sub_idx;
+        for (sub_idx = 0; sub_idx < 4; ++sub_idx) {
+            uint8_t a = circular_sample[sub_idx];
+            uint8_t b = circular_sample[sub_idx + 4];
+            uint8_t c = circular_sample[sub_idx + 8];
+            uint8_t d = circular_sample[sub_idx + 12];
+
+            sum_response += abs(a - b + c - d);
+            diff_response += abs(a - c) + abs(b - d);
+            mean += a + b + c + d;
+        }
+
+        response_row[x] = sum_response - diff_response - abs(mean - local_mean);
+    }
+#undef S
+}
+
+/**
+ * Same as mrgingham_ChESS_response_5(), but computed on the image blurred with
+ * a (1+2*blur_radius)^2 box filter. The result is identical to cv::blur()
+ * followed by mrgingham_ChESS_response_5() (box_normalize() rounds the way
+ * OpenCV does), but the blurred image is never materialized. I blur the rows
+ * as they're needed, into a ring of the 11 rows that the ChESS sampling ring
+ * touches. Each blurred row comes from running sums: a horizontal one along
+ * each source row, and a vertical one of those down each column. Only the
+ * columns the ChESS kernel reads are blurred.
+ *
+ * blur_radius must be in [1,MRGINGHAM_CHESS_BLUR_RADIUS_MAX]. Returns false if
+ * I couldn't allocate the row buffers
+ */
+bool mrgingham_ChESS_response_5_blurred(      int16_t* WPI_RESTRICT response,
+                                        const uint8_t* WPI_RESTRICT image,
+                                        int w, int h, int stride,
+                                        int blur_radius,
+                                        mrgingham_cancel_t* cancel )
+{
+    // The ChESS kernel reads the blurred pixels at x in [x0,x1], y in [2,h-3]
+    const int x0 = 2;
+    const int x1 = w - 3;
+    if (w < 15 || h < 15)
+        return true;
+    const int nx = x1 - x0 + 1;
+
+    const int r       = blur_radius;
+    const int Nwindow = 1 + 2*r;
+    const box_normalizer_t normalizer = box_normalizer(r);
+
+    // hsum: ring of the horizontal sums of the source rows in the vertical
+    // window. colsum: the vertical sum of hsum. blurred: ring of the blurred
+    // rows, indexed by x, so the ChESS sampling offsets apply as is
+    uint32_t* hsum    = (uint32_t*)malloc(sizeof(uint32_t) * Nwindow * nx);
+    uint32_t* colsum  = (uint32_t*)calloc(nx, sizeof(uint32_t));
+    uint8_t*  blurred = (uint8_t* )malloc(11 * w);
+    if (hsum == NULL || colsum == NULL || blurred == NULL)
+    {
+        free(hsum);
+        free(colsum);
+        free(blurred);
+        return false;
+    }
+
+    int x, y, i;
+
+// The slot of window row y (not reflected: may be <0 or >=h)
+#define HSUM_ROW(y) (&hsum[ (((y) % Nwindow) + Nwindow) % Nwindow * nx ])
+
+    // Horizontal running sum of source row y into dst
+    #define COMPUTE_HSUM(dst, y)                                            \
+    do {                                                                    \
+        const uint8_t* src = &image[reflect_101((y), h) * stride];          \
+        uint32_t s = 0;                                                     \
+        int dx;                                                             \
+        for (dx = -r; dx <= r; dx++)                                        \
+            s += src[reflect_101(x0+dx, w)];                                \
+        (dst)[0] = s;                                                       \
+        for (x = x0+1; x <= x1; x++) {                                      \
+            s += src[reflect_101(x+r,   w)];                                \
+            s -= src[reflect_101(x-r-1, w)];                                \
+            (dst)[x-x0] = s;                                                \
+        }                                                                   \
+    } while(0)
+
+    // The window for blurred row 2
+    for (y = 2-r; y <= 2+r; y++)
+    {
+        uint32_t* dst = HSUM_ROW(y);
+        COMPUTE_HSUM(dst, y);
+        for (i = 0; i < nx; i++)
+            colsum[i] += dst[i];
+    }
+
+    int yb;
+    for (yb = 2; yb <= h-3; yb++)
+    {
+        if (mrgingham_is_cancelled(cancel))
+            break;
+
+        if (yb > 2)
+        {
+            // Slide the window down: row yb+r replaces row yb-r-1, in the same
+            // slot
+            uint32_t* slot = HSUM_ROW(yb+r);
+            for (i = 0; i < nx; i++)
+                colsum[i] -= slot[i];
+            COMPUTE_HSUM(slot, yb+r);
+            for (i = 0; i < nx; i++)
+                colsum[i] += slot[i];
+        }
+
+        uint8_t* row_blurred = &blurred[(yb % 11) * w];
+        for (i = 0; i < nx; i++)
+            row_blurred[x0+i] = box_normalize(&normalizer, colsum[i]);
+
+        // I have rows yb-10..yb. That's what the ChESS kernel needs at y = yb-5
+        y = yb - 5;
+        if (y < 7 || y >= h - 7)
+            continue;
+
+        const uint8_t* rows[11];
+        for (i = 0; i < 11; i++)
+            rows[i] = &blurred[((y - 5 + i) % 11) * w];
+        ChESS_response_5_row(&response[y*w], rows, 7, w-7);
+    }
+
+#undef COMPUTE_HSUM
+#undef HSUM_ROW
+
+    free(hsum);
+    free(colsum);
+    free(blurred);
+    return true;
+}
+
+/**
+ * Same as mrgingham_ChESS_response_5(), but computed on the image downsampled
+ * by 2^level, as done by mrgingham::decimate(). The downsampled image is never
+ * materialized: I downsample the rows as they're needed, into a ring of the 11
+ * rows that the ChESS sampling ring touches. The response is of the
+ * downsampled size, as reported by mrgingham::decimate_size(). w,h,stride
+ * describe the full-resolution image.
+ *
+ * Returns false if I couldn't allocate the row buffer
+ */
+bool mrgingham_ChESS_response_5_decimated(      int16_t* WPI_RESTRICT response,
+                                          const uint8_t* WPI_RESTRICT image,
+                                          int w, int h, int stride,
+                                          int level,
+                                          mrgingham_cancel_t* cancel )
+{
+    int w_level, h_level;
+    mrgingham::decimate_size(&w_level, &h_level, w, h, level);
+    if (w_level < 15 || h_level < 15)
+        return true;
+
+    uint8_t* decimated = (uint8_t*)malloc(11 * w_level);
+    if (decimated == NULL)
+        return false;
+
+    int y, i;
+
+    // The ChESS kernel reads rows [2,h_level-3]
+    for (i = 2; i <= h_level-3; i++)
+    {
+        if (mrgingham_is_cancelled(cancel))
+            break;
+
+        mrgingham::decimate_row(&decimated[(i % 11) * w_level],
+                                image, w, h, stride, level, i);
+
+        // I have rows i-10..i. That's what the ChESS kernel needs at y = i-5
+        y = i - 5;
+        if (y < 7 || y >= h_level - 7)
+            continue;
+
+        const uint8_t* rows[11];
+        int j;
+        for (j = 0; j < 11; j++)
+            rows[j] = &decimated[((y - 5 + j) % 11) * w_level];
+        ChESS_response_5_row(&response[y*w_level], rows, 7, w_level-7);
+    }
+
+    free(decimated);
+    return true;
+}
+
+/**
+ * Same as mrgingham_ChESS_response_5(), but computed only in some tiles of the
+ * image. The image is split into tile_size x tile_size tiles, Ntiles_x of them
+ * per row. The response is computed in tile (i,j) if tile_active[i + j*Ntiles_x]
+ * is non-zero. The response in the other tiles isn't touched
+ */
+void mrgingham_ChESS_response_5_masked(      int16_t* WPI_RESTRICT response,
+                                       const uint8_t* WPI_RESTRICT image,
+                                       int w, int h, int stride,
+                                       int tile_size, int Ntiles_x,
+                                       const uint8_t* tile_active,
+                                       mrgingham_cancel_t* cancel )
+{
+    int y, i, tx, ty;
+    const int Ntiles_y = (h + tile_size - 1) / tile_size;
+
+    for (ty = 0; ty < Ntiles_y; ty++)
+    {
+        const uint8_t* active_row = &tile_active[ty*Ntiles_x];
+
+        int y0 = ty*tile_size;
+        int y1 = y0 + tile_size;
+        if (y0 < 7)     y0 = 7;
+        if (y1 > h - 7) y1 = h - 7;
+
+        for (y = y0; y < y1; y++)
+        {
+            if (mrgingham_is_cancelled(cancel))
+                return;
+
+            const uint8_t* rows[11];
+            for (i = 0; i < 11; i++)
+                rows[i] = &image[(y - 5 + i) * stride];
+
+            // Each run of adjacent active tiles is one span of the row
+            for (tx = 0; tx < Ntiles_x; tx++)
+            {
+                if (!active_row[tx])
+                    continue;
+                int tx_end = tx+1;
+                while (tx_end < Ntiles_x && active_row[tx_end])
+                    tx_end++;
+
+                int x0 = tx*tile_size;
+                int x1 = tx_end*tile_size;
+                if (x0 < 7)     x0 = 7;
+                if (x1 > w - 7) x1 = w - 7;
+                if (x0 < x1)
+                    ChESS_response_5_row(&response[y*w], rows, x0, x1);
+
+                tx = tx_end;
+            }
+        }
+    }
+}
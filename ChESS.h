@@ -2,6 +2,14 @@
 
 #include "windows_defines.h"
 
+#include <stdbool.h>
+#include <stdint.h>
+
+// The cancellation token. It's defined in cancel.h, which is C++-only. This
+// header is also used from C (the Python extension), which doesn't need the
+// definition
+typedef struct mrgingham_cancel_t mrgingham_cancel_t;
+
 /*
   This is the reference implementation from this paper:
 
@@ -34,3 +42,73 @@ void mrgingham_ChESS_response_5(      int16_t* WPI_RESTRICT response,
                                 const uint8_t* WPI_RESTRICT image,
                                 int w, int h,
                                 int stride);
+
+// The kernels sample the image at most this many pixels away from each pixel
+// of the response, in each direction
+#define MRGINGHAM_CHESS_RADIUS 5
+
+// The largest blur_radius mrgingham_ChESS_response_5_blurred() accepts
+#define MRGINGHAM_CHESS_BLUR_RADIUS_MAX 31
+
+/*
+  The _blurred, _decimated and _masked kernels below take a cancellation token
+  (see cancel.h). It's checked at each row, and if it has been cancelled, the
+  kernel stops early, leaving the rest of the response unwritten. The caller
+  should then throw the response away. NULL means "never cancel"
+*/
+
+/**
+ * Same as mrgingham_ChESS_response_5(), but on the image blurred with a
+ * (1+2*blur_radius)^2 box filter, without materializing the blurred image. The
+ * output is identical to cv::blur() followed by mrgingham_ChESS_response_5():
+ * the blurred pixels are rounded the way OpenCV's 8-bit box filter rounds them
+ * (a 16-bit fixed-point division for blur_radius <= 7, exact rounding past
+ * that). test-ChESS-blurred checks this against cv::blur(). blur_radius must
+ * be in [1,MRGINGHAM_CHESS_BLUR_RADIUS_MAX]. Returns false if the row buffers
+ * couldn't be allocated
+ */
+bool mrgingham_ChESS_response_5_blurred(      int16_t* WPI_RESTRICT response,
+                                        const uint8_t* WPI_RESTRICT image,
+                                        int w, int h,
+                                        int stride,
+                                        int blur_radius,
+                                        mrgingham_cancel_t* cancel);
+
+/**
+ * Pixel (x,y) of the image blurred with a (1+2*blur_radius)^2 box filter,
+ * exactly as mrgingham_ChESS_response_5_blurred() and cv::blur() see it
+ */
+uint8_t mrgingham_box_blurred_pixel(const uint8_t* WPI_RESTRICT image,
+                                    int w, int h,
+                                    int stride,
+                                    int x, int y,
+                                    int blur_radius);
+
+/**
+ * Same as mrgingham_ChESS_response_5(), but on the image downsampled by
+ * 2^level (as done by mrgingham::decimate(), the same as
+ * cv::resize(INTER_LINEAR)), without materializing the downsampled image.
+ * w,h,stride describe the full-resolution image; the response is densely
+ * packed, of the downsampled size. Returns false if the row buffer couldn't be
+ * allocated
+ */
+bool mrgingham_ChESS_response_5_decimated(      int16_t* WPI_RESTRICT response,
+                                          const uint8_t* WPI_RESTRICT image,
+                                          int w, int h,
+                                          int stride,
+                                          int level,
+                                          mrgingham_cancel_t* cancel);
+
+/**
+ * Same as mrgingham_ChESS_response_5(), but computed only in the active tiles.
+ * The image is split into tile_size x tile_size tiles, Ntiles_x of them per
+ * row; tile (i,j) is active if tile_active[i + j*Ntiles_x] is non-zero. The
+ * response outside the active tiles isn't written
+ */
+void mrgingham_ChESS_response_5_masked(      int16_t* WPI_RESTRICT response,
+                                       const uint8_t* WPI_RESTRICT image,
+                                       int w, int h,
+                                       int stride,
+                                       int tile_size, int Ntiles_x,
+                                       const uint8_t* tile_active,
+                                       mrgingham_cancel_t* cancel);
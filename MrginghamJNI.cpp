@@ -94,13 +94,31 @@ extern "C"
         return ret;
     }
 
-    JNIEXPORT jobjectArray JNICALL Java_org_mrgingham_MrginghamJNI_detectChessboardNative(JNIEnv *env, jclass, jlong matPtr, jboolean doclahe, jint blur_radius, jboolean do_refine, jint gridn)
+    // With adaptive_level the pyramid levels are searched in the order given
+    // by this policy, which learns from the previous calls. The Java side
+    // usually calls us from one thread per camera, so I keep one per thread
+    static thread_local mrgingham::level_policy_t level_policy;
+
+    JNIEXPORT jobjectArray JNICALL Java_org_mrgingham_MrginghamJNI_detectChessboardNative(JNIEnv *env, jclass, jlong matPtr, jboolean doclahe, jint blur_radius, jboolean do_refine, jint gridn, jboolean pyramid_preprocess, jboolean adaptive_level)
     {
         static cv::Ptr<cv::CLAHE> clahe;
 
         cv::Mat &image = *(reinterpret_cast<cv::Mat *>(matPtr));
 
-        if (doclahe && !clahe)
+        // With pyramid_preprocess the library applies the CLAHE and blur to
+        // each downsampled pyramid level, and the caller's image isn't touched.
+        // Otherwise I preprocess the full-resolution image in place
+        mrgingham::preprocess_options_t preprocess;
+        mrgingham::search_options_t     search;
+        if (pyramid_preprocess)
+        {
+            preprocess.doclahe     = doclahe;
+            preprocess.blur_radius = blur_radius;
+        }
+        if (adaptive_level)
+            search.level_policy = &level_policy;
+
+        if (!pyramid_preprocess && doclahe && !clahe)
         {
             clahe = cv::createCLAHE();
             clahe->setClipLimit(8);
@@ -109,14 +127,14 @@ extern "C"
         // The buffer. I'll realloc() this as I go. MUST free at the end
         signed char *refinement_level = NULL;
 
-        if (doclahe)
+        if (!pyramid_preprocess && doclahe)
         {
             // CLAHE doesn't by itself use the full dynamic range all the time.
             // I explicitly apply histogram equalization and then CLAHE
             cv::equalizeHist(image, image);
             clahe->apply(image, image);
         }
-        if (blur_radius > 0)
+        if (!pyramid_preprocess && blur_radius > 0)
         {
             cv::blur(image, image,
                      cv::Size(1 + 2 * blur_radius,
@@ -134,6 +152,16 @@ extern "C"
         const char *debug_image_filename = nullptr;
 
         found_pyramid_level =
+            (pyramid_preprocess || adaptive_level) ?
+            mrgingham::find_chessboard_from_image_array(points_out,
+                                                        do_refine ? &refinement_level : NULL,
+                                                        gridn,
+                                                        image,
+                                                        preprocess,
+                                                        search,
+                                                        image_pyramid_level,
+                                                        debug, debug_sequence,
+                                                        debug_image_filename) :
             mrgingham::find_chessboard_from_image_array(points_out,
                                                         do_refine ? &refinement_level : NULL,
                                                         gridn,
@@ -165,4 +193,18 @@ extern "C"
 
         return jarr;
     }
+
+    // The level the most recent adaptive_level search on this thread started
+    // at, or -1 if there wasn't one
+    JNIEXPORT jint JNICALL Java_org_mrgingham_MrginghamJNI_getLevelPolicyStartLevelNative(JNIEnv *, jclass)
+    {
+        return level_policy.start_level;
+    }
+
+    // The fraction of the adaptive_level searches on this thread that found the
+    // board at the level they started at
+    JNIEXPORT jdouble JNICALL Java_org_mrgingham_MrginghamJNI_getLevelPolicyHitRateNative(JNIEnv *, jclass)
+    {
+        return mrgingham::level_policy_hit_rate(&level_policy);
+    }
 }
\ No newline at end of file
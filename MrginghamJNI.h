@@ -10,10 +10,26 @@ extern "C" {
 /*
  * Class:     org_mrgingham_MrginghamJNI
  * Method:    detectChessboardNative
- * Signature: (JZIZI)[Ljava/lang/Object;
+ * Signature: (JZIZIZZ)[Ljava/lang/Object;
  */
 JNIEXPORT jobjectArray JNICALL Java_org_mrgingham_MrginghamJNI_detectChessboardNative
-  (JNIEnv *, jclass, jlong, jboolean, jint, jboolean, jint);
+  (JNIEnv *, jclass, jlong, jboolean, jint, jboolean, jint, jboolean, jboolean);
+
+/*
+ * Class:     org_mrgingham_MrginghamJNI
+ * Method:    getLevelPolicyStartLevelNative
+ * Signature: ()I
+ */
+JNIEXPORT jint JNICALL Java_org_mrgingham_MrginghamJNI_getLevelPolicyStartLevelNative
+  (JNIEnv *, jclass);
+
+/*
+ * Class:     org_mrgingham_MrginghamJNI
+ * Method:    getLevelPolicyHitRateNative
+ * Signature: ()D
+ */
+JNIEXPORT jdouble JNICALL Java_org_mrgingham_MrginghamJNI_getLevelPolicyHitRateNative
+  (JNIEnv *, jclass);
 
 #ifdef __cplusplus
 }
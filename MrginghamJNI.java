@@ -9,16 +9,53 @@ class MrginghamJNI {
         long imageNativeObj,
         boolean doClAHE,
         int blurRadius,
-        boolean do_refine
+        boolean do_refine,
+        int gridn,
+        boolean pyramidPreprocess,
+        boolean adaptiveLevel
     );
 
+    private static native int getLevelPolicyStartLevelNative();
+    private static native double getLevelPolicyHitRateNative();
+
+    // Looks for a 10x10 board, with the preprocessing applied to the
+    // full-resolution image, and no adaptive level search
     public static PointDouble[] detectChessboard(
         long imageNativeObj,
         boolean doClAHE,
         int blurRadius,
         boolean do_refine
     ) {
-        return (PointDouble[]) detectChessboardNative(imageNativeObj, doClAHE, blurRadius, do_refine);
+        return detectChessboard(imageNativeObj, doClAHE, blurRadius, do_refine, 10, false, false);
+    }
+
+    // If pyramidPreprocess, the CLAHE and blur are applied to each downsampled
+    // pyramid level instead of to the full-resolution image, which is then
+    // left untouched. If adaptiveLevel, the search through the pyramid levels
+    // starts at the level where the previous calls on this thread found the
+    // board
+    public static PointDouble[] detectChessboard(
+        long imageNativeObj,
+        boolean doClAHE,
+        int blurRadius,
+        boolean do_refine,
+        int gridn,
+        boolean pyramidPreprocess,
+        boolean adaptiveLevel
+    ) {
+        return (PointDouble[]) detectChessboardNative(imageNativeObj, doClAHE, blurRadius, do_refine, gridn, pyramidPreprocess, adaptiveLevel);
+    }
+
+    // The pyramid level the last adaptiveLevel search on this thread started
+    // at, or -1 if there wasn't one
+    public static int getLevelPolicyStartLevel() {
+        return getLevelPolicyStartLevelNative();
+    }
+
+    // The fraction of the adaptiveLevel searches on this thread that found the
+    // board at their starting level
+    public static double getLevelPolicyHitRate() {
+        return getLevelPolicyHitRateNative();
     }
 
     public static void main(String[] args) {
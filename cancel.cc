@@ -0,0 +1,44 @@
+#include <stddef.h>
+#include <chrono>
+
+#include "cancel.h"
+
+int64_t mrgingham_now_ns(void)
+{
+    return (int64_t)
+        std::chrono::duration_cast<std::chrono::nanoseconds>
+        (std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void mrgingham_cancel_init(mrgingham_cancel_t* cancel, int64_t deadline_ns)
+{
+    cancel->cancelled.store(0, std::memory_order_relaxed);
+    cancel->deadline_ns = deadline_ns;
+    cancel->timed_out.store(0, std::memory_order_relaxed);
+    cancel->stage       = 0;
+}
+
+bool mrgingham_is_cancelled(mrgingham_cancel_t* cancel)
+{
+    if(cancel == NULL)
+        return false;
+    if(cancel->cancelled.load(std::memory_order_relaxed))
+        return true;
+    if(cancel->deadline_ns > 0 && mrgingham_now_ns() >= cancel->deadline_ns)
+    {
+        cancel->timed_out.store(1, std::memory_order_relaxed);
+        cancel->cancelled.store(1, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+void mrgingham_cancel(mrgingham_cancel_t* cancel)
+{
+    cancel->cancelled.store(1, std::memory_order_relaxed);
+}
+
+bool mrgingham_cancel_timed_out(const mrgingham_cancel_t* cancel)
+{
+    return cancel != NULL && cancel->timed_out.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include "windows_defines.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <atomic>
+
+/*
+  Cooperative cancellation of a chessboard search. The search checks the
+  token at safe points (each row of the ChESS response and of the
+  connected-component scan, each Voronoi cell in the grid search, each refined
+  point), and gives up if it's been cancelled. A token is cancelled either by
+  another thread setting "cancelled", or by the clock passing its deadline.
+
+  The flags are read and written from different threads, so they're atomic.
+  The accesses are relaxed: a flag says only "stop now", and doesn't publish
+  any other data. So this header is C++-only. ChESS.h is also used from C, so it
+  only forward-declares the token. A NULL token is never cancelled
+*/
+typedef struct mrgingham_cancel_t
+{
+    // Set to non-zero by mrgingham_cancel() from another thread to stop the
+    // search. I set it too, when the deadline passes
+    std::atomic<int> cancelled;
+
+    // If > 0, the search is cancelled once mrgingham_now_ns() reaches this.
+    // timed_out is then set. Read it with mrgingham_cancel_timed_out()
+    int64_t          deadline_ns;
+    std::atomic<int> timed_out;
+
+    // The mrgingham::search_stage_t the search is in. The search updates this
+    // as it goes, so that a timeout can report where it happened
+    int              stage;
+} mrgingham_cancel_t;
+
+// A monotonic clock, in nanoseconds
+int64_t mrgingham_now_ns(void);
+
+// Sets up a token that hasn't been cancelled yet. deadline_ns <= 0 means "no
+// deadline"
+void mrgingham_cancel_init(mrgingham_cancel_t* cancel, int64_t deadline_ns);
+
+// Returns true if the search should give up now
+bool mrgingham_is_cancelled(mrgingham_cancel_t* cancel);
+
+// Tells the search using this token to give up. May be called from any thread
+void mrgingham_cancel(mrgingham_cancel_t* cancel);
+
+// Whether the search gave up because its deadline passed
+bool mrgingham_cancel_timed_out(const mrgingham_cancel_t* cancel);
@@ -0,0 +1,119 @@
+#include <math.h>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define DECIMATE_SSE2 1
+#endif
+
+#include "decimate.hh"
+
+namespace mrgingham
+{
+
+void decimate_size( int* w_out, int* h_out,
+                    int w, int h, int level )
+{
+    // cv::resize() rounds to the nearest integer, with ties going to even
+    const double scale = 1.0 / (double)(1 << level);
+    *w_out = (int)lrint((double)w * scale);
+    *h_out = (int)lrint((double)h * scale);
+}
+
+// The first of the two source pixels used for output pixel i. The second one
+// is the next one. Past the edge, both are the last pixel
+static inline int source_index( int i, int level, int n )
+{
+    int j = (i << level) + (1 << (level-1)) - 1;
+    return j < n-1 ? j : n-1;
+}
+
+#ifdef DECIMATE_SSE2
+// Sums of adjacent pixel pairs in 16 bytes from each of two rows: 8 sums of 4
+// pixels each, in 16-bit lanes
+static inline __m128i sum_2x2( const uint8_t* r0, const uint8_t* r1 )
+{
+    const __m128i mask_even = _mm_set1_epi16(0x00ff);
+    __m128i a = _mm_loadu_si128((const __m128i*)r0);
+    __m128i b = _mm_loadu_si128((const __m128i*)r1);
+    return _mm_add_epi16( _mm_add_epi16(_mm_and_si128(a, mask_even), _mm_srli_epi16(a, 8)),
+                          _mm_add_epi16(_mm_and_si128(b, mask_even), _mm_srli_epi16(b, 8)) );
+}
+static inline __m128i mean_2x2( const uint8_t* r0, const uint8_t* r1 )
+{
+    return _mm_srli_epi16( _mm_add_epi16(sum_2x2(r0, r1), _mm_set1_epi16(2)), 2 );
+}
+#endif
+
+void decimate_row( uint8_t* row_out,
+                   const uint8_t* image, int w, int h, int stride,
+                   int level, int y )
+{
+    int w_out, h_out;
+    decimate_size(&w_out, &h_out, w, h, level);
+
+    const int      y0   = source_index(y, level, h);
+    const uint8_t* row0 = &image[y0*stride];
+    const uint8_t* row1 = (y0 < h-1) ? &row0[stride] : row0;
+
+    int x = 0;
+
+#ifdef DECIMATE_SSE2
+    // I vectorize the two finest levels. The coarser ones touch few enough
+    // pixels that it doesn't matter. Each iteration reads 32 bytes of each
+    // row, and these must be in bounds
+    if(level == 1)
+    {
+        for(; 2*x + 32 <= w && x + 16 <= w_out; x += 16)
+        {
+            __m128i m0 = mean_2x2(&row0[2*x],      &row1[2*x]);
+            __m128i m1 = mean_2x2(&row0[2*x + 16], &row1[2*x + 16]);
+            _mm_storeu_si128((__m128i*)&row_out[x], _mm_packus_epi16(m0, m1));
+        }
+    }
+    else if(level == 2)
+    {
+        // I start reading at the first source pixel of each block: the pair
+        // sums I need are in every other 16-bit lane
+        const __m128i mask_even32 = _mm_set1_epi32(0x0000ffff);
+        for(; 4*x + 1 + 32 <= w && x + 8 <= w_out; x += 8)
+        {
+            __m128i m0 = _mm_and_si128(mean_2x2(&row0[4*x + 1],      &row1[4*x + 1]),      mask_even32);
+            __m128i m1 = _mm_and_si128(mean_2x2(&row0[4*x + 1 + 16], &row1[4*x + 1 + 16]), mask_even32);
+            __m128i m  = _mm_packs_epi32(m0, m1);
+            _mm_storel_epi64((__m128i*)&row_out[x], _mm_packus_epi16(m, m));
+        }
+    }
+#endif
+
+    for(; x<w_out; x++)
+    {
+        const int x0 = source_index(x, level, w);
+        const int x1 = (x0 < w-1) ? x0+1 : x0;
+        row_out[x] = (uint8_t)((row0[x0] + row0[x1] +
+                                row1[x0] + row1[x1] + 2) >> 2);
+    }
+}
+
+void decimate( uint8_t* out, int out_stride,
+               const uint8_t* image, int w, int h, int stride,
+               int level )
+{
+    int w_out, h_out;
+    decimate_size(&w_out, &h_out, w, h, level);
+
+    for(int y=0; y<h_out; y++)
+        decimate_row(&out[y*out_stride], image, w, h, stride, level, y);
+}
+
+uint8_t decimated_pixel( const uint8_t* image, int w, int h, int stride,
+                         int level, int x, int y )
+{
+    const int x0 = source_index(x, level, w);
+    const int x1 = (x0 < w-1) ? x0+1 : x0;
+    const int y0 = source_index(y, level, h);
+    const int y1 = (y0 < h-1) ? y0+1 : y0;
+    return (uint8_t)((image[x0 + y0*stride] + image[x1 + y0*stride] +
+                      image[x0 + y1*stride] + image[x1 + y1*stride] + 2) >> 2);
+}
+
+}
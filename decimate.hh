@@ -0,0 +1,46 @@
+#pragma once
+
+#include <stdint.h>
+
+// Downsampling of the image pyramid levels. Reducing by 2^level with
+// cv::resize(..., INTER_LINEAR) samples each output pixel halfway between the
+// two central pixels of its 2^level x 2^level block, in each direction. So
+// each output pixel is the rounded mean of the central 2x2 pixels of its block.
+// I compute exactly that here, with SIMD where available, without going through
+// the general bilinear path
+
+
+// Each output pixel reads only the full-resolution pixels of its own
+// 2^level x 2^level block (the last block in each direction is clamped to the
+// image). So a change in the full-resolution image reaches this many output
+// pixels beyond the ones over it
+#define MRGINGHAM_DECIMATE_REACH 0
+
+namespace mrgingham
+{
+
+// The size of the image produced by decimate(). Same as the size produced by
+// cv::resize() with a scale of 1/2^level
+void decimate_size( int* w_out, int* h_out,
+                    int w, int h, int level );
+
+// Reduces the 8-bit image by 2^level. The output must be of the size reported
+// by decimate_size(). The result is identical to cv::resize() with a scale of
+// 1/2^level and INTER_LINEAR. The one exception is at level 1, when a
+// dimension is odd and gets rounded up. Then the last column (or row) runs past
+// the edge of the image. cv::resize() then uses its area-averaging path, and
+// may round that column differently. level must be >= 1
+void decimate( uint8_t* out, int out_stride,
+               const uint8_t* image, int w, int h, int stride,
+               int level );
+
+// Row y of the output of decimate(), written to out
+void decimate_row( uint8_t* out,
+                   const uint8_t* image, int w, int h, int stride,
+                   int level, int y );
+
+// Pixel (x,y) of the output of decimate()
+uint8_t decimated_pixel( const uint8_t* image, int w, int h, int stride,
+                         int level, int x, int y );
+
+}
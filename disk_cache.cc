@@ -0,0 +1,332 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <algorithm>
+#include <string>
+
+#include "disk_cache.hh"
+
+namespace mrgingham
+{
+
+// MurmurHash3_x64_128, by Austin Appleby. Placed into the public domain
+static inline uint64_t rotl64(uint64_t x, int r)
+{
+    return (x << r) | (x >> (64 - r));
+}
+static inline uint64_t fmix64(uint64_t k)
+{
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+}
+hash128_t hash128( const void* data, size_t len, hash128_t seed )
+{
+    const uint8_t* bytes   = (const uint8_t*)data;
+    const size_t   nblocks = len / 16;
+
+    uint64_t h1 = seed.a;
+    uint64_t h2 = seed.b;
+
+    const uint64_t c1 = 0x87c37b91114253d5ULL;
+    const uint64_t c2 = 0x4cf5ad432745937fULL;
+
+    for(size_t i = 0; i < nblocks; i++)
+    {
+        uint64_t k1, k2;
+        memcpy(&k1, &bytes[i*16 + 0], 8);
+        memcpy(&k2, &bytes[i*16 + 8], 8);
+
+        k1 *= c1; k1 = rotl64(k1,31); k1 *= c2; h1 ^= k1;
+        h1 = rotl64(h1,27); h1 += h2; h1 = h1*5+0x52dce729;
+        k2 *= c2; k2 = rotl64(k2,33); k2 *= c1; h2 ^= k2;
+        h2 = rotl64(h2,31); h2 += h1; h2 = h2*5+0x38495ab5;
+    }
+
+    const uint8_t* tail = &bytes[nblocks*16];
+    uint64_t k1 = 0;
+    uint64_t k2 = 0;
+    switch(len & 15)
+    {
+    case 15: k2 ^= ((uint64_t)tail[14]) << 48; // fallthrough
+    case 14: k2 ^= ((uint64_t)tail[13]) << 40; // fallthrough
+    case 13: k2 ^= ((uint64_t)tail[12]) << 32; // fallthrough
+    case 12: k2 ^= ((uint64_t)tail[11]) << 24; // fallthrough
+    case 11: k2 ^= ((uint64_t)tail[10]) << 16; // fallthrough
+    case 10: k2 ^= ((uint64_t)tail[ 9]) << 8;  // fallthrough
+    case  9: k2 ^= ((uint64_t)tail[ 8]) << 0;
+        k2 *= c2; k2 = rotl64(k2,33); k2 *= c1; h2 ^= k2;
+        // fallthrough
+    case  8: k1 ^= ((uint64_t)tail[ 7]) << 56; // fallthrough
+    case  7: k1 ^= ((uint64_t)tail[ 6]) << 48; // fallthrough
+    case  6: k1 ^= ((uint64_t)tail[ 5]) << 40; // fallthrough
+    case  5: k1 ^= ((uint64_t)tail[ 4]) << 32; // fallthrough
+    case  4: k1 ^= ((uint64_t)tail[ 3]) << 24; // fallthrough
+    case  3: k1 ^= ((uint64_t)tail[ 2]) << 16; // fallthrough
+    case  2: k1 ^= ((uint64_t)tail[ 1]) << 8;  // fallthrough
+    case  1: k1 ^= ((uint64_t)tail[ 0]) << 0;
+        k1 *= c1; k1 = rotl64(k1,31); k1 *= c2; h1 ^= k1;
+    }
+
+    h1 ^= (uint64_t)len; h2 ^= (uint64_t)len;
+    h1 += h2; h2 += h1;
+    h1 = fmix64(h1);
+    h2 = fmix64(h2);
+    h1 += h2; h2 += h1;
+
+    return hash128_t{h1, h2};
+}
+
+// Entries live in DIR/xx/xxxxxxxx...: the first byte of the hash selects a
+// subdirectory, so that no single directory gets too large
+static bool entry_path( char* path, int pathsize,
+                        const disk_cache_t* cache, hash128_t key )
+{
+    return
+        snprintf(path, pathsize, "%s/%02x/%016llx%016llx",
+                 cache->dir,
+                 (unsigned)(key.a >> 56),
+                 (unsigned long long)key.a,
+                 (unsigned long long)key.b) < pathsize;
+}
+
+bool disk_cache_init( disk_cache_t* cache,
+                      const char* dir, uint64_t max_bytes )
+{
+    if( snprintf(cache->dir, sizeof(cache->dir), "%s", dir) >= (int)sizeof(cache->dir) )
+    {
+        fprintf(stderr, "Cache directory path '%s' is too long\n", dir);
+        return false;
+    }
+    cache->max_bytes                 = max_bytes;
+    cache->bytes_written_since_sweep = 0;
+
+    if( mkdir(dir, 0777) != 0 && errno != EEXIST )
+    {
+        fprintf(stderr, "Couldn't create cache directory '%s': %s\n",
+                dir, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool disk_cache_get( const disk_cache_t* cache,
+                     hash128_t key,
+                     std::vector<uint8_t>* data )
+{
+    char path[1100];
+    if(!entry_path(path, sizeof(path), cache, key))
+        return false;
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    bool result = false;
+    struct stat sb;
+    if( fstat(fd, &sb) == 0 )
+    {
+        data->resize(sb.st_size);
+        size_t Nread = 0;
+        while(Nread < data->size())
+        {
+            ssize_t n = read(fd, &(*data)[Nread], data->size() - Nread);
+            if(n <= 0) break;
+            Nread += n;
+        }
+        result = (Nread == data->size());
+    }
+
+    // Mark as recently-used. The eviction throws out the oldest mtime first
+    if(result)
+        futimens(fd, NULL);
+
+    close(fd);
+    return result;
+}
+
+bool disk_cache_get_path( const disk_cache_t* cache,
+                          hash128_t key,
+                          char* path, int pathsize )
+{
+    if( !entry_path(path, pathsize, cache, key) ||
+        access(path, R_OK) != 0 )
+        return false;
+
+    // Mark as recently-used
+    utimensat(AT_FDCWD, path, NULL, 0);
+    return true;
+}
+
+bool disk_cache_put( disk_cache_t* cache,
+                     hash128_t key,
+                     const void* data, size_t len )
+{
+    char path[1100];
+    if(!entry_path(path, sizeof(path), cache, key))
+        return false;
+
+    // the subdirectory
+    char* last_slash = strrchr(path, '/');
+    *last_slash = '\0';
+    if( mkdir(path, 0777) != 0 && errno != EEXIST )
+        return false;
+
+    char path_tmp[1200];
+    if( snprintf(path_tmp, sizeof(path_tmp), "%s/.tmp-XXXXXX", path) >= (int)sizeof(path_tmp) )
+        return false;
+    *last_slash = '/';
+
+    int fd = mkstemp(path_tmp);
+    if(fd < 0)
+        return false;
+
+    size_t Nwritten = 0;
+    while(Nwritten < len)
+    {
+        ssize_t n = write(fd, &((const uint8_t*)data)[Nwritten], len - Nwritten);
+        if(n <= 0) break;
+        Nwritten += n;
+    }
+    fchmod(fd, 0666 & ~0022);
+    if( close(fd) != 0 || Nwritten != len ||
+        // rename() is atomic: readers see either nothing or the full entry
+        rename(path_tmp, path) != 0 )
+    {
+        unlink(path_tmp);
+        return false;
+    }
+
+    // I sweep whenever this process writes some fraction of the cache size.
+    // Other processes sharing this cache do the same
+    uint64_t written =
+        __atomic_add_fetch(&cache->bytes_written_since_sweep, (uint64_t)len, __ATOMIC_RELAXED);
+    if( written > cache->max_bytes / 16 &&
+        __atomic_exchange_n(&cache->bytes_written_since_sweep, (uint64_t)0, __ATOMIC_RELAXED) > 0 )
+        disk_cache_evict(cache);
+
+    return true;
+}
+
+void disk_cache_evict( disk_cache_t* cache )
+{
+    char path[1200];
+    if( snprintf(path, sizeof(path), "%s/lock", cache->dir) >= (int)sizeof(path) )
+        return;
+
+    // Only one sweeper at a time. If somebody else is sweeping, I let them
+    int fd_lock = open(path, O_RDWR | O_CREAT, 0666);
+    if(fd_lock < 0)
+        return;
+    if( flock(fd_lock, LOCK_EX | LOCK_NB) != 0 )
+    {
+        close(fd_lock);
+        return;
+    }
+
+    struct entry_t
+    {
+        time_t      mtime;
+        off_t       size;
+        std::string path;
+    };
+    std::vector<entry_t> entries;
+    uint64_t total = 0;
+
+    const time_t now = time(NULL);
+
+    DIR* dp = opendir(cache->dir);
+    if(dp != NULL)
+    {
+        struct dirent* de;
+        while( NULL != (de = readdir(dp)) )
+        {
+            if( strlen(de->d_name) != 2 )
+                continue;
+
+            // Paths that don't fit aren't cache entries: those have short
+            // names, and disk_cache_init() limits the length of the directory
+            char subdir[1100];
+            if( snprintf(subdir, sizeof(subdir), "%s/%s", cache->dir, de->d_name) >= (int)sizeof(subdir) )
+                continue;
+            DIR* dp_sub = opendir(subdir);
+            if(dp_sub == NULL)
+                continue;
+
+            struct dirent* de_sub;
+            while( NULL != (de_sub = readdir(dp_sub)) )
+            {
+                if( snprintf(path, sizeof(path), "%s/%s", subdir, de_sub->d_name) >= (int)sizeof(path) )
+                    continue;
+                struct stat sb;
+                if( stat(path, &sb) != 0 || !S_ISREG(sb.st_mode) )
+                    continue;
+
+                if( de_sub->d_name[0] == '.' )
+                {
+                    // Temporary file. If it's old, its writer died, and I clean
+                    // it up
+                    if( now - sb.st_mtime > 3600 )
+                        unlink(path);
+                    continue;
+                }
+
+                entries.push_back(entry_t{sb.st_mtime, sb.st_size, std::string(path)});
+                total += sb.st_size;
+            }
+            closedir(dp_sub);
+        }
+        closedir(dp);
+    }
+
+    if( total > cache->max_bytes )
+    {
+        std::sort(entries.begin(), entries.end(),
+                  [](const entry_t& a, const entry_t& b) { return a.mtime < b.mtime; });
+
+        // I go a bit below the limit, to not be constantly sweeping
+        const uint64_t target = cache->max_bytes - cache->max_bytes/8;
+        for(auto it = entries.begin(); it != entries.end() && total > target; it++)
+            if( unlink(it->path.c_str()) == 0 )
+                total -= it->size;
+    }
+
+    flock(fd_lock, LOCK_UN);
+    close(fd_lock);
+}
+
+bool parse_size( uint64_t* size, const char* str )
+{
+    char* end;
+    errno = 0;
+    unsigned long long x = strtoull(str, &end, 10);
+    if( errno != 0 || end == str )
+        return false;
+
+    switch(*end)
+    {
+    case '\0':           break;
+    case 'k': case 'K':  x <<= 10; end++; break;
+    case 'm': case 'M':  x <<= 20; end++; break;
+    case 'g': case 'G':  x <<= 30; end++; break;
+    case 't': case 'T':  x <<= 40; end++; break;
+    default: return false;
+    }
+    if(*end != '\0')
+        return false;
+
+    *size = x;
+    return true;
+}
+
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+
+// A simple content-addressed on-disk cache used by the mrgingham tool. Each
+// entry is a file in a directory tree, named by the hash of its key. Entries
+// are written atomically (write to a temporary file, then rename()), so any
+// number of threads and processes can share a cache directory. The total size
+// is bounded: when it gets too big I throw out the least-recently-used entries
+
+
+namespace mrgingham
+{
+
+struct hash128_t
+{
+    uint64_t a, b;
+};
+
+// Not a cryptographic hash. This is a fast 128-bit hash that's good-enough to
+// make accidental collisions a non-issue. Pass the result of a previous call
+// as the seed to hash several pieces of data together
+hash128_t hash128( const void* data, size_t len,
+                   hash128_t seed = hash128_t{0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL} );
+
+struct disk_cache_t
+{
+    char     dir[1024];
+
+    // Evict old entries when the cache is larger than this
+    uint64_t max_bytes;
+
+    // How much this process wrote since the last eviction sweep. Updated
+    // atomically; this structure is shared between all the worker threads
+    uint64_t bytes_written_since_sweep;
+};
+
+bool disk_cache_init( disk_cache_t* cache,
+                      const char* dir, uint64_t max_bytes );
+
+// Returns true on a hit, and fills in data. A hit marks the entry as
+// recently-used
+bool disk_cache_get( const disk_cache_t* cache,
+                     hash128_t key,
+                     std::vector<uint8_t>* data );
+
+// Like disk_cache_get(), but instead of reading the entry, I return its path,
+// for callers that want to mmap() it. The entry may be evicted at any time, so
+// the caller must handle it disappearing before it's opened. Once it's open,
+// it stays valid
+bool disk_cache_get_path( const disk_cache_t* cache,
+                          hash128_t key,
+                          char* path, int pathsize );
+
+bool disk_cache_put( disk_cache_t* cache,
+                     hash128_t key,
+                     const void* data, size_t len );
+
+// Throws out the least-recently-used entries until the cache fits into
+// max_bytes. If another process is already doing this, I do nothing.
+// disk_cache_put() calls this periodically
+void disk_cache_evict( disk_cache_t* cache );
+
+// Parses a size such as "100000", "500M" or "2G"
+bool parse_size( uint64_t* size, const char* str );
+
+}
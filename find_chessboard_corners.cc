@@ -1,13 +1,17 @@
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
 #include <assert.h>
+#include <math.h>
 #include <sys/stat.h>
 
 #include "point.hh"
+#include "mrgingham.hh"
 #include "mrgingham-internal.h"
+#include "find_chessboard_corners.hh"
 #include "windows_defines.h"
 
 #include "ChESS.h"
+#include "decimate.hh"
 
 // The various tunable parameters
 
@@ -36,6 +40,13 @@
 #define CONSTANCY_WINDOW_R                  10
 #define STDEV_THRESHOLD                     20
 
+// The tile mask (see tile_mask_t). The coarse levels mark the tiles where the
+// ChESS response reaches this threshold anywhere. This is the threshold for
+// being included into a connected component at all, so it's very
+// conservative. Level 0 then looks at the marked tiles and their neighbors
+#define TILE_MASK_SIZE                      32
+#define TILE_MASK_RESPONSE_THRESHOLD        RESPONSE_MIN_THRESHOLD
+
 
 
 
@@ -45,7 +56,38 @@
 using namespace mrgingham;
 namespace mrgingham {
 
-static bool high_variance( int16_t x, int16_t y, int16_t w, int16_t h, const uint8_t* image )
+// The image the ChESS response was computed from, as seen by the corner
+// validation. It isn't necessarily stored as such: the ChESS kernels can blur
+// or downsample it on the fly, and I then do the same to the pixels I look at
+struct chess_image_t
+{
+    const uint8_t* data;
+    int            stride;
+
+    // If > 0, data hasn't been blurred yet. I blur the pixels with a
+    // (1+2*blur_radius)^2 box filter
+    int            blur_radius;
+
+    // If > 0, data is the full-resolution image, of size (w_full,h_full). I
+    // downsample the pixels from it by 2^decimation_level
+    int            decimation_level;
+    int            w_full, h_full;
+};
+
+static uint8_t chess_image_pixel( const chess_image_t* image,
+                                  int x, int y, int w, int h )
+{
+    if(image->decimation_level > 0)
+        return decimated_pixel(image->data, image->w_full, image->h_full, image->stride,
+                               image->decimation_level, x, y);
+    if(image->blur_radius > 0)
+        return mrgingham_box_blurred_pixel(image->data, w, h, image->stride,
+                                           x, y, image->blur_radius);
+    return image->data[ x + y*image->stride ];
+}
+
+static bool high_variance( int16_t x, int16_t y, int16_t w, int16_t h,
+                           const chess_image_t* image )
 {
     if(x-CONSTANCY_WINDOW_R < 0 || x+CONSTANCY_WINDOW_R >= w ||
        y-CONSTANCY_WINDOW_R < 0 || y+CONSTANCY_WINDOW_R >= h )
@@ -56,24 +98,25 @@ static bool high_variance( int16_t x, int16_t y, int16_t w, int16_t h, const uin
 
     // I should be able to do this with opencv, but it's way too much of a pain
     // in my ass, so I do it myself
+    uint8_t window[(1 + 2*CONSTANCY_WINDOW_R)*(1 + 2*CONSTANCY_WINDOW_R)];
     int32_t sum = 0;
+    int     i   = 0;
     for(int dy = -CONSTANCY_WINDOW_R; dy <=CONSTANCY_WINDOW_R; dy++)
         for(int dx = -CONSTANCY_WINDOW_R; dx <=CONSTANCY_WINDOW_R; dx++)
         {
-            uint8_t val = image[ x+dx + (y+dy)*w ];
+            uint8_t val = chess_image_pixel(image, x+dx, y+dy, w, h);
+            window[i++] = val;
             sum += (int32_t)val;
         }
 
     int32_t mean = sum / ((1 + 2*CONSTANCY_WINDOW_R)*
                           (1 + 2*CONSTANCY_WINDOW_R));
     int32_t sum_deviation_sq = 0;
-    for(int dy = -CONSTANCY_WINDOW_R; dy <=CONSTANCY_WINDOW_R; dy++)
-        for(int dx = -CONSTANCY_WINDOW_R; dx <=CONSTANCY_WINDOW_R; dx++)
-        {
-            uint8_t val = image[ x+dx + (y+dy)*w ];
-            int32_t deviation = (int32_t)val - mean;
-            sum_deviation_sq += deviation*deviation;
-        }
+    for(i = 0; i < (int)sizeof(window); i++)
+    {
+        int32_t deviation = (int32_t)window[i] - mean;
+        sum_deviation_sq += deviation*deviation;
+    }
 
     int32_t var = sum_deviation_sq / ((1 + 2*CONSTANCY_WINDOW_R)*
                                       (1 + 2*CONSTANCY_WINDOW_R));
@@ -191,7 +234,7 @@ static void accumulate(int16_t x, int16_t y, int16_t w, int16_t h, const int16_t
 static bool connected_component_is_valid(const connected_component_t* c,
 
                                          int16_t w, int16_t h,
-                                         const uint8_t* image)
+                                         const chess_image_t* image)
 {
     // We're looking at a candidate peak. I don't want to find anything
     // inside a chessboard square, which the detector does sometimes. I
@@ -228,16 +271,24 @@ static bool follow_connected_component(PointDouble* out,
                                        struct xylist_t* l,
                                        int16_t w, int16_t h, int16_t* d,
 
-                                       const uint8_t* image,
-                                       int margin)
+                                       const chess_image_t* image,
+                                       int margin,
+                                       mrgingham_cancel_t* cancel)
 {
     connected_component_t c = {};
 
     bool touched_margin = false;
 
+    // A component can cover much of the image, so I look at the clock
+    // periodically while following it
+    int Npopped = 0;
+
     int16_t x, y;
     while( xylist_pop(l, &x, &y))
     {
+        if( (++Npopped & 4095) == 0 && mrgingham_is_cancelled(cancel) )
+            return false;
+
         if(!is_valid(x,y,w,h,d, &c))
         {
             d[x + y*w] = 0; // mark invalid; just in case
@@ -277,17 +328,104 @@ static PointDouble scale_image_coord(const PointDouble* pt, double scale)
                         (pt->y + 0.5) * scale - 0.5 );
 }
 
+// Marks each tile within r tiles of a marked one
+static void dilate_tiles(std::vector<uint8_t>* out, const std::vector<uint8_t>& in,
+                         int Ntiles_x, int Ntiles_y, int r)
+{
+    out->assign(in.size(), 0);
+    for(int ty=0; ty<Ntiles_y; ty++)
+        for(int tx=0; tx<Ntiles_x; tx++)
+        {
+            if(!in[tx + ty*Ntiles_x])
+                continue;
+            for(int y=std::max(ty-r,0); y<=std::min(ty+r,Ntiles_y-1); y++)
+                for(int x=std::max(tx-r,0); x<=std::min(tx+r,Ntiles_x-1); x++)
+                    (*out)[x + y*Ntiles_x] = 1;
+        }
+}
+
+// The parts of a pyramid level the frame cache must recompute, in tiles of
+// *tile_size pixels of that level. The ChESS response at a pixel depends on
+// the level pixels up to MRGINGHAM_CHESS_RADIUS away, the blur widens that by
+// blur_radius, and each level pixel depends on the full-resolution pixels up
+// to MRGINGHAM_DECIMATE_REACH level pixels away. So the response is recomputed
+// that far from each changed tile (active_response). A connected component is
+// smaller than a tile, so one reaching into a recomputed tile has its centroid
+// at most one tile further out: the corner candidates there are re-found
+// (active_points). And the components with those centroids start at most one
+// tile further out still (active_seeds)
+static void frame_cache_level_tiles(std::vector<uint8_t>* active_response,
+                                    std::vector<uint8_t>* active_points,
+                                    std::vector<uint8_t>* active_seeds,
+                                    int* tile_size, int* Ntiles_x, int* Ntiles_y,
+                                    const frame_cache_t* cache,
+                                    int image_pyramid_level, int w, int h,
+                                    int blur_radius)
+{
+    const int L = image_pyramid_level;
+    const int T = std::max(MRGINGHAM_FRAME_CACHE_TILE_SIZE >> L, 8);
+    *tile_size = T;
+    *Ntiles_x  = (w + T - 1) / T;
+    *Ntiles_y  = (h + T - 1) / T;
+
+    std::vector<uint8_t> changed(*Ntiles_x * *Ntiles_y, 0);
+    for(int ty=0; ty<*Ntiles_y; ty++)
+        for(int tx=0; tx<*Ntiles_x; tx++)
+        {
+            // The full-resolution tiles under this level tile
+            const int tx0 = std::min(((tx*T) << L)         / MRGINGHAM_FRAME_CACHE_TILE_SIZE, cache->Ntiles_x-1);
+            const int tx1 = std::min((((tx+1)*T << L) - 1) / MRGINGHAM_FRAME_CACHE_TILE_SIZE, cache->Ntiles_x-1);
+            const int ty0 = std::min(((ty*T) << L)         / MRGINGHAM_FRAME_CACHE_TILE_SIZE, cache->Ntiles_y-1);
+            const int ty1 = std::min((((ty+1)*T << L) - 1) / MRGINGHAM_FRAME_CACHE_TILE_SIZE, cache->Ntiles_y-1);
+            for(int y=ty0; y<=ty1 && !changed[tx + ty*(*Ntiles_x)]; y++)
+                for(int x=tx0; x<=tx1; x++)
+                    if(cache->tile_changed[x + y*cache->Ntiles_x])
+                    {
+                        changed[tx + ty*(*Ntiles_x)] = 1;
+                        break;
+                    }
+        }
+
+    const int reach =
+        MRGINGHAM_CHESS_RADIUS + std::max(blur_radius,0) + MRGINGHAM_DECIMATE_REACH;
+    dilate_tiles(active_response, changed, *Ntiles_x, *Ntiles_y, (reach + T - 1) / T);
+    dilate_tiles(active_points, *active_response, *Ntiles_x, *Ntiles_y, 1);
+    dilate_tiles(active_seeds,  *active_points,   *Ntiles_x, *Ntiles_y, 1);
+}
+
+// The tile of the frame cache's level tiles that contains a corner candidate
+static int frame_cache_point_tile(const PointInt& p,
+                                  int image_pyramid_level,
+                                  int tile_size, int Ntiles_x, int Ntiles_y)
+{
+    PointDouble pt((double)p.x / FIND_GRID_SCALE, (double)p.y / FIND_GRID_SCALE);
+    pt = scale_image_coord(&pt, 1.0 / (double)(1 << image_pyramid_level));
+
+    int tx = (int)floor(pt.x) / tile_size;
+    int ty = (int)floor(pt.y) / tile_size;
+    tx = std::max(0, std::min(tx, Ntiles_x-1));
+    ty = std::max(0, std::min(ty, Ntiles_y-1));
+    return tx + ty*Ntiles_x;
+}
+
 #define DUMP_FILENAME_CORNERS_BASE   "/tmp/mrgingham-1-corners"
 #define DUMP_FILENAME_CORNERS        DUMP_FILENAME_CORNERS_BASE ".vnl"
 static int process_connected_components(int w, int h, int16_t* d,
 
-                                        const uint8_t* image,
+                                        const chess_image_t* image,
                                         std::vector<PointInt>* points_scaled_out,
                                         std::vector<mrgingham::PointDouble>* points_refinement,
                                         signed char*                         level_refinement,
                                         bool debug, const char* debug_image_filename,
                                         int image_pyramid_level,
-                                        int margin)
+                                        int margin,
+                                        mrgingham_cancel_t* cancel,
+
+                                        // If non-NULL, I only start connected
+                                        // components in the tiles marked here
+                                        const uint8_t* seed_tiles = NULL,
+                                        int seed_tile_size = 0,
+                                        int seed_Ntiles_x = 0)
 {
     FILE* debugfp = NULL;
     const char* debug_filename = NULL;
@@ -327,9 +465,12 @@ static int process_connected_components(int w, int h, int16_t* d,
     // for the connected component around the points I'm interested in
     if(points_scaled_out != NULL)
     {
-        for(int16_t y = margin+1; y<h-margin-1; y++)
+        for(int16_t y = margin+1; y<h-margin-1 && !mrgingham_is_cancelled(cancel); y++)
             for(int16_t x = margin+1; x<w-margin-1; x++)
             {
+                if( seed_tiles != NULL &&
+                    !seed_tiles[x/seed_tile_size + (y/seed_tile_size)*seed_Ntiles_x] )
+                    continue;
                 if( !is_valid(x,y,w,h,d, NULL) )
                     continue;
 
@@ -339,7 +480,7 @@ static int process_connected_components(int w, int h, int16_t* d,
                 if( follow_connected_component(&pt,
                                                &l, w,h,d,
                                                image,
-                                               margin) )
+                                               margin, cancel) )
                 {
                     pt = scale_image_coord(&pt, (double)coord_scale);
                     if( debugfp )
@@ -353,7 +494,7 @@ static int process_connected_components(int w, int h, int16_t* d,
     }
     else if(points_refinement != NULL)
     {
-        for(unsigned i=0; i<points_refinement->size(); i++)
+        for(unsigned i=0; i<points_refinement->size() && !mrgingham_is_cancelled(cancel); i++)
         {
             // I can only refine the current estimate if it was computed at one
             // level higher than what I'm at now
@@ -383,7 +524,7 @@ static int process_connected_components(int w, int h, int16_t* d,
             if(follow_connected_component(&pt,
                                           &l, w,h,d,
                                           image,
-                                          margin))
+                                          margin, cancel))
             {
                 pt_full = scale_image_coord(&pt, (double)coord_scale);
                 if( debugfp )
@@ -428,7 +569,14 @@ apply_image_pyramid_scaling(// out
 
                             // set to 0 to just use the image
                             int image_pyramid_level,
-                            bool debug )
+                            bool debug,
+
+                            // If non-NULL, applied after the downsampling
+                            const preprocess_options_t* preprocess,
+
+                            // If true, I skip the blur in preprocess: the
+                            // caller fuses it into the ChESS computation
+                            bool defer_blur )
 {
     if( image_pyramid_level < 0 ||
 
@@ -446,10 +594,63 @@ apply_image_pyramid_scaling(// out
         image = &image_input;
     else
     {
-        double scale = 1.0 / ((double)(1 << image_pyramid_level));
-        cv::resize( image_input, image_buffer_output, cv::Size(), scale, scale, cv::INTER_LINEAR );
+        if( image_input.type() == CV_8U )
+        {
+            // Same result as cv::resize(INTER_LINEAR), but faster
+            int w, h;
+            decimate_size(&w, &h, image_input.cols, image_input.rows, image_pyramid_level);
+            image_buffer_output.create(h, w, CV_8U);
+            decimate( image_buffer_output.data, (int)image_buffer_output.step[0],
+                      image_input.data, image_input.cols, image_input.rows,
+                      (int)image_input.step[0],
+                      image_pyramid_level );
+        }
+        else
+        {
+            double scale = 1.0 / ((double)(1 << image_pyramid_level));
+            cv::resize( image_input, image_buffer_output, cv::Size(), scale, scale, cv::INTER_LINEAR );
+        }
         image = &image_buffer_output;
     }
+
+    if( preprocess != NULL &&
+        (preprocess->doclahe || (preprocess->blur_radius > 0 && !defer_blur)) )
+    {
+        if( image->type() != CV_8U )
+        {
+            fprintf(stderr, "%s:%d in %s(): I can only handle CV_8U arrays currently."
+                    " Sorry.\n", __FILE__, __LINE__, __func__);
+            return NULL;
+        }
+
+        // The input is const, so at level 0 I preprocess a copy
+        if(image == &image_input)
+        {
+            image_input.copyTo(image_buffer_output);
+            image = &image_buffer_output;
+        }
+
+        if( preprocess->doclahe )
+        {
+            // One CLAHE object per thread: the caller may be calling me from
+            // several
+            static thread_local cv::Ptr<cv::CLAHE> clahe;
+            if(clahe.empty())
+            {
+                clahe = cv::createCLAHE();
+                clahe->setClipLimit(8);
+            }
+
+            // CLAHE doesn't by itself use the full dynamic range all the time.
+            // I explicitly apply histogram equalization and then CLAHE
+            cv::equalizeHist(image_buffer_output, image_buffer_output);
+            clahe->apply(image_buffer_output, image_buffer_output);
+        }
+        if( preprocess->blur_radius > 0 && !defer_blur )
+            cv::blur( image_buffer_output, image_buffer_output,
+                      cv::Size(1 + 2*preprocess->blur_radius,
+                               1 + 2*preprocess->blur_radius));
+    }
     if( debug )
     {
         char filename[256];
@@ -458,13 +659,6 @@ apply_image_pyramid_scaling(// out
         fprintf(stderr, "Wrote scaled,processed image to %s\n", filename);
     }
 
-    if( !image->isContinuous() )
-    {
-        fprintf(stderr, "%s:%d in %s(): I can only handle continuous arrays (stride == width) currently."
-                " Sorry.\n", __FILE__, __LINE__, __func__);
-        return NULL;
-    }
-
     if( image->type() != CV_8U )
     {
         fprintf(stderr, "%s:%d in %s(): I can only handle CV_8U arrays currently."
@@ -489,26 +683,234 @@ int _find_or_refine_chessboard_corners_from_image_array ( // out
 
                                                           int image_pyramid_level,
                                                           bool debug,
-                                                          const char* debug_image_filename)
+                                                          const char* debug_image_filename,
+                                                          const preprocess_options_t* preprocess,
+                                                          tile_mask_t* tile_mask,
+                                                          mrgingham_cancel_t* cancel,
+                                                          frame_cache_t* frame_cache)
 {
-    cv::Mat _image;
-    const cv::Mat* image = apply_image_pyramid_scaling(_image,
-                                                       image_input, image_pyramid_level,
-                                                       debug);
-    if( image == NULL ) return 0;
+    // The refinement is a stage of its own; the caller marks it
+    if( cancel != NULL && points_scaled_out != NULL )
+        cancel->stage = SEARCH_STAGE_CHESS;
+
+    // At level 0 with a tile mask from the coarser levels, I compute the
+    // response only near the places where they saw something
+    const bool tile_masked =
+        tile_mask != NULL && image_pyramid_level == 0 && !tile_mask->active.empty();
+
+    // With a frame cache (see frame_cache_t) I keep this level's ChESS
+    // response, and next time recompute it only where the image changed. The
+    // masked kernel that does that fuses neither the blur nor the decimation,
+    // so I don't fuse them at all here: every frame is computed the same way
+    if( tile_masked || image_pyramid_level >= MRGINGHAM_FRAME_CACHE_NLEVELS )
+        frame_cache = NULL;
+
+    // The blur at this resolution, if any, I fuse into the ChESS computation:
+    // the blurred image is never stored. Unless I'm debugging: then I want to
+    // write it out. The masked ChESS kernel doesn't blur, so I don't fuse with
+    // a tile mask either
+    const int blur_radius_fused =
+        ( preprocess != NULL && !debug && !tile_masked && frame_cache == NULL &&
+          preprocess->blur_radius <= MRGINGHAM_CHESS_BLUR_RADIUS_MAX ) ?
+        preprocess->blur_radius : 0;
+
+    // If there's nothing to do at this resolution other than to downsample,
+    // I don't store the downsampled image either: the ChESS kernel samples the
+    // full-resolution image directly. Again, unless I'm debugging
+    const bool decimation_fused =
+        image_pyramid_level > 0 && image_pyramid_level <= 10 && !debug &&
+        image_input.type() == CV_8U && frame_cache == NULL &&
+        ( preprocess == NULL ||
+          (!preprocess->doclahe && preprocess->blur_radius <= 0) );
+
+    cv::Mat        _image;
+    const cv::Mat* image;
+    int            w, h;
+    if( decimation_fused )
+    {
+        image = &image_input;
+        decimate_size(&w, &h, image_input.cols, image_input.rows, image_pyramid_level);
+    }
+    else
+    {
+        image = apply_image_pyramid_scaling(_image,
+                                            image_input, image_pyramid_level,
+                                            debug, preprocess,
+                                            blur_radius_fused > 0);
+        if( image == NULL ) return 0;
+
+        w = image->cols;
+        h = image->rows;
+    }
 
-    const int w = image->cols;
-    const int h = image->rows;
+    // The rows of the input image don't need to be densely packed: an image
+    // mmap-ed from a file, or a region of a larger buffer are used as is. The
+    // response I allocate myself, so it is dense
+    const int stride = (int)image->step[0];
 
     // I don't NEED to zero this out, but it makes the debugging easier.
     // Otherwise the edges will contain uninitialized garbage, and the actual
-    // data will be hard to see in the debug images
+    // data will be hard to see in the debug images. With a tile mask I DO need
+    // it: the response in the masked-out tiles isn't computed, and must read as
+    // "no corner"
     cv::Mat response = cv::Mat::zeros( cv::Size(w, h), CV_16S );
 
     uint8_t* imageData    = image->data;
     int16_t* responseData = (int16_t*)response.data;
 
-    mrgingham_ChESS_response_5( responseData, imageData, w, h, w );
+    // The cached response can be updated if it was computed for the previous
+    // frame. Not with CLAHE: that looks at the whole image, so a change
+    // anywhere affects every tile. Until this level is done, its cached data
+    // is unusable
+    frame_cache_t::level_t* cache_level = NULL;
+    bool                    incremental = false;
+    std::vector<uint8_t>    active_response, active_points, active_seeds;
+    int                     cache_tile_size = 0, cache_Ntiles_x = 0, cache_Ntiles_y = 0;
+    if( frame_cache != NULL )
+    {
+        cache_level = &frame_cache->levels[image_pyramid_level];
+        incremental =
+            cache_level->generation == frame_cache->generation-1 &&
+            cache_level->response.cols == w &&
+            cache_level->response.rows == h &&
+            (preprocess == NULL || !preprocess->doclahe);
+        cache_level->generation = -1;
+        if( incremental )
+            frame_cache_level_tiles(&active_response, &active_points, &active_seeds,
+                                    &cache_tile_size, &cache_Ntiles_x, &cache_Ntiles_y,
+                                    frame_cache, image_pyramid_level, w, h,
+                                    (preprocess != NULL) ? preprocess->blur_radius : 0);
+    }
+
+    if( incremental )
+    {
+        mrgingham_ChESS_response_5_masked( (int16_t*)cache_level->response.data,
+                                           imageData, w, h, stride,
+                                           cache_tile_size, cache_Ntiles_x,
+                                           active_response.data(), cancel );
+        // The connected-component search modifies the response it's given
+        cache_level->response.copyTo(response);
+        responseData = (int16_t*)response.data;
+        if(debug)
+        {
+            int Nactive = 0;
+            for(uint8_t a : active_response) Nactive += a;
+            fprintf(stderr, "Frame cache: recomputing the level-%d ChESS response in %d/%d tiles\n",
+                    image_pyramid_level, Nactive, (int)active_response.size());
+        }
+    }
+    else if( decimation_fused )
+    {
+        if( !mrgingham_ChESS_response_5_decimated( responseData, imageData,
+                                                   image->cols, image->rows, stride,
+                                                   image_pyramid_level, cancel ) )
+        {
+            fprintf(stderr, "%s:%d in %s(): Couldn't allocate the downsampling buffers\n",
+                    __FILE__, __LINE__, __func__);
+            return 0;
+        }
+    }
+    else if( blur_radius_fused > 0 )
+    {
+        if( !mrgingham_ChESS_response_5_blurred( responseData, imageData, w, h, stride,
+                                                 blur_radius_fused, cancel ) )
+        {
+            fprintf(stderr, "%s:%d in %s(): Couldn't allocate the blur buffers\n",
+                    __FILE__, __LINE__, __func__);
+            return 0;
+        }
+    }
+    else if( tile_masked )
+    {
+        // Each marked tile, and its neighbors
+        std::vector<uint8_t> active(tile_mask->active.size(), 0);
+        for(int ty=0; ty<tile_mask->Ntiles_y; ty++)
+            for(int tx=0; tx<tile_mask->Ntiles_x; tx++)
+            {
+                if(!tile_mask->active[tx + ty*tile_mask->Ntiles_x])
+                    continue;
+                for(int dy=-1; dy<=1; dy++)
+                    for(int dx=-1; dx<=1; dx++)
+                        if(tx+dx >= 0 && tx+dx < tile_mask->Ntiles_x &&
+                           ty+dy >= 0 && ty+dy < tile_mask->Ntiles_y)
+                            active[tx+dx + (ty+dy)*tile_mask->Ntiles_x] = 1;
+            }
+        mrgingham_ChESS_response_5_masked( responseData, imageData, w, h, stride,
+                                           tile_mask->tile_size, tile_mask->Ntiles_x,
+                                           active.data(), cancel );
+        if(debug)
+        {
+            int Nactive = 0;
+            for(uint8_t a : active) Nactive += a;
+            fprintf(stderr, "Tile mask: computing the level-0 ChESS response in %d/%d tiles\n",
+                    Nactive, (int)active.size());
+        }
+    }
+    else if( cancel == NULL )
+        mrgingham_ChESS_response_5( responseData, imageData, w, h, stride );
+    else
+    {
+        // The plain kernel doesn't look at the cancel token, so I give it the
+        // image in bands of rows, and look at the token between them. Each band
+        // is a sub-image that includes the 7-row margins the kernel needs, so
+        // the bands together produce exactly the same response
+        const int Nrows_band = 64;
+        for(int y0 = 7; y0 < h-7 && !mrgingham_is_cancelled(cancel); y0 += Nrows_band)
+        {
+            int y1 = y0 + Nrows_band;
+            if(y1 > h-7) y1 = h-7;
+            mrgingham_ChESS_response_5( &responseData[(y0-7)*w],
+                                        &imageData[(y0-7)*stride],
+                                        w, (y1-y0) + 14, stride );
+        }
+    }
+    if( mrgingham_is_cancelled(cancel) )
+        return 0;
+
+    if( cache_level != NULL )
+    {
+        if( !incremental )
+            response.copyTo(cache_level->response);
+        cache_level->generation = frame_cache->generation;
+
+        // The corner candidates can be updated only if I have them from the
+        // previous frame. Until this search succeeds, I don't
+        if( !cache_level->have_points )
+            incremental = false;
+        cache_level->have_points = false;
+    }
+
+    if( tile_mask != NULL && image_pyramid_level > 0 )
+    {
+        // I mark the full-resolution tiles covered by each pixel with a
+        // corner-like response
+        if( tile_mask->active.empty() )
+        {
+            tile_mask->tile_size = TILE_MASK_SIZE;
+            tile_mask->Ntiles_x  = (image_input.cols + TILE_MASK_SIZE - 1) / TILE_MASK_SIZE;
+            tile_mask->Ntiles_y  = (image_input.rows + TILE_MASK_SIZE - 1) / TILE_MASK_SIZE;
+            tile_mask->active.assign(tile_mask->Ntiles_x*tile_mask->Ntiles_y, 0);
+        }
+
+        const int T = tile_mask->tile_size;
+        const int L = image_pyramid_level;
+        for(int y=0; y<h; y++)
+            for(int x=0; x<w; x++)
+            {
+                if(responseData[x + y*w] < TILE_MASK_RESPONSE_THRESHOLD)
+                    continue;
+
+                int tx0 = (x << L) / T;
+                int tx1 = (((x+1) << L) - 1) / T;
+                int ty0 = (y << L) / T;
+                int ty1 = (((y+1) << L) - 1) / T;
+                if(tx1 >= tile_mask->Ntiles_x) tx1 = tile_mask->Ntiles_x-1;
+                if(ty1 >= tile_mask->Ntiles_y) ty1 = tile_mask->Ntiles_y-1;
+                for(int ty=ty0; ty<=ty1; ty++)
+                    for(int tx=tx0; tx<=tx1; tx++)
+                        tile_mask->active[tx + ty*tile_mask->Ntiles_x] = 1;
+            }
+    }
 
     if(debug)
     {
@@ -548,9 +950,28 @@ int _find_or_refine_chessboard_corners_from_image_array ( // out
 
     // This serves both to throw away duplicate nearby points at the same corner
     // and to provide sub-pixel-interpolation for the corner location
-    return
+    chess_image_t chess_image = {};
+    if( cancel != NULL && points_scaled_out != NULL )
+        cancel->stage = SEARCH_STAGE_CONNECTED_COMPONENTS;
+
+    chess_image.data        = image->data;
+    chess_image.stride      = stride;
+    chess_image.blur_radius = blur_radius_fused;
+    if( decimation_fused )
+    {
+        chess_image.decimation_level = image_pyramid_level;
+        chess_image.w_full           = image->cols;
+        chess_image.h_full           = image->rows;
+    }
+
+    // Incrementally, I look for the corners only where the response may have
+    // changed, and take the rest from the previous frame
+    const bool incremental_points = incremental && points_scaled_out != NULL;
+    const size_t Npoints_before   = points_scaled_out != NULL ? points_scaled_out->size() : 0;
+
+    int N =
         process_connected_components(w, h, responseData,
-                                     (uint8_t*)image->data,
+                                     &chess_image,
                                      points_scaled_out,
                                      points_refinement, level_refinement,
                                      debug, debug_image_filename,
@@ -561,7 +982,45 @@ int _find_or_refine_chessboard_corners_from_image_array ( // out
                                      // of the ChESS implementation. Anything that
                                      // needs to touch pixels in this 7-pixel-wide
                                      // ring is invalid
-                                     7);
+                                     7,
+                                     cancel,
+                                     incremental_points ? active_seeds.data() : NULL,
+                                     cache_tile_size, cache_Ntiles_x);
+
+    if( cache_level != NULL && points_scaled_out != NULL &&
+        !mrgingham_is_cancelled(cancel) )
+    {
+        if( incremental_points )
+        {
+            // The new candidates are kept only in active_points. Outside of it,
+            // the old ones remain
+            size_t j = Npoints_before;
+            for(size_t i=Npoints_before; i<points_scaled_out->size(); i++)
+                if( active_points[frame_cache_point_tile((*points_scaled_out)[i],
+                                                         image_pyramid_level,
+                                                         cache_tile_size,
+                                                         cache_Ntiles_x, cache_Ntiles_y)] )
+                    (*points_scaled_out)[j++] = (*points_scaled_out)[i];
+            points_scaled_out->resize(j);
+
+            for(const PointInt& p : cache_level->points)
+                if( !active_points[frame_cache_point_tile(p,
+                                                          image_pyramid_level,
+                                                          cache_tile_size,
+                                                          cache_Ntiles_x, cache_Ntiles_y)] )
+                    points_scaled_out->push_back(p);
+            N = (int)(points_scaled_out->size() - Npoints_before);
+
+            if(debug)
+                fprintf(stderr, "Frame cache: level %d has %d corner candidates\n",
+                        image_pyramid_level, N);
+        }
+
+        cache_level->points.assign(points_scaled_out->begin() + Npoints_before,
+                                   points_scaled_out->end());
+        cache_level->have_points = true;
+    }
+    return N;
 }
 
 // WPI_EXPORT
@@ -578,12 +1037,18 @@ bool find_chessboard_corners_from_image_array( // out
                                               // set to 0 to just use the image
                                               int image_pyramid_level,
                                               bool debug,
-                                              const char* debug_image_filename)
+                                              const char* debug_image_filename,
+                                              const preprocess_options_t* preprocess,
+                                              tile_mask_t* tile_mask,
+                                              mrgingham_cancel_t* cancel,
+                                              frame_cache_t* frame_cache)
 {
     return
         _find_or_refine_chessboard_corners_from_image_array(points_scaled_out, NULL, NULL,
                                                             image_input, image_pyramid_level,
-                                                            debug, debug_image_filename) > 0;
+                                                            debug, debug_image_filename,
+                                                            preprocess, tile_mask, cancel,
+                                                            frame_cache) > 0;
 }
 
 // Returns how many points were refined
@@ -609,13 +1074,220 @@ int refine_chessboard_corners_from_image_array( // out/int
 
                                                 int image_pyramid_level,
                                                 bool debug,
-                                                const char* debug_image_filename)
+                                                const char* debug_image_filename,
+                                                const preprocess_options_t* preprocess,
+                                                mrgingham_cancel_t* cancel,
+                                                frame_cache_t* frame_cache)
 {
     return
         _find_or_refine_chessboard_corners_from_image_array( NULL,
                                                              points, level,
                                                              image_input, image_pyramid_level,
-                                                             debug, debug_image_filename);
+                                                             debug, debug_image_filename,
+                                                             preprocess, NULL, cancel,
+                                                             frame_cache);
+}
+
+
+// The saddle-point refinement. Around a chessboard corner the image intensity
+// is locally a saddle: I fit
+//
+//   I(u,v) = a u^2 + b uv + c v^2 + d u + e v + f
+//
+// to the (box-blurred) pixels in a (2*r_fit+1)x(2*r_fit+1) window centered on
+// pixel (x0,y0), and report the stationary point of the fit. The window is
+// symmetric, so the least-squares normal equations decouple, and the fit is a
+// handful of weighted sums. Returns false if the fit isn't a saddle. The
+// stationary point may be outside the window
+#define SADDLE_RADIUS_MAX 16
+static bool fit_saddle(// out
+                       double* x, double* y,
+
+                       // in
+                       const uint8_t* image, int w, int h, int stride,
+                       int x0, int y0,
+                       int r_blur, int r_fit)
+{
+    const int r = r_fit + r_blur;
+    if( x0 - r < 0 || x0 + r >= w ||
+        y0 - r < 0 || y0 + r >= h )
+        return false;
+
+    // The blur is separable: I sum the rows first
+    const int Nside = 2*r_fit + 1;
+    int row_sums[4*SADDLE_RADIUS_MAX+1][2*SADDLE_RADIUS_MAX+1];
+    for(int v=-r; v<=r; v++)
+    {
+        const uint8_t* row = &image[(y0+v)*stride + x0];
+        for(int u=-r_fit; u<=r_fit; u++)
+        {
+            int sum = 0;
+            for(int du=-r_blur; du<=r_blur; du++)
+                sum += row[u+du];
+            row_sums[v+r][u+r_fit] = sum;
+        }
+    }
+
+    double sI = 0, suI = 0, svI = 0, suvI = 0, suuI = 0, svvI = 0;
+    for(int v=-r_fit; v<=r_fit; v++)
+        for(int u=-r_fit; u<=r_fit; u++)
+        {
+            int sum = 0;
+            for(int dv=-r_blur; dv<=r_blur; dv++)
+                sum += row_sums[v+dv+r][u+r_fit];
+            const double I = (double)sum;
+            sI   += I;
+            suI  += u*I;
+            svI  += v*I;
+            suvI += u*v*I;
+            suuI += u*u*I;
+            svvI += v*v*I;
+        }
+
+    // The moments of the window: sum(u^2), sum(u^4), sum(u^2 v^2)
+    const double N = (double)(Nside*Nside);
+    double m2 = 0, m4 = 0;
+    for(int u=-r_fit; u<=r_fit; u++)
+    {
+        m2 += u*u;
+        m4 += u*u*u*u;
+    }
+    const double S2  = m2 * Nside;
+    const double S4  = m4 * Nside;
+    const double S22 = m2 * m2;
+
+    const double d = suI  / S2;
+    const double e = svI  / S2;
+    const double b = suvI / S22;
+
+    // a and c (and f) are coupled. I solve for their sum and difference
+    const double a_minus_c = (suuI - svvI) / (S4 - S22);
+    const double a_plus_c  = (suuI + svvI - 2.*S2*sI/N) / (S4 + S22 - 2.*S2*S2/N);
+    const double a = (a_plus_c + a_minus_c) / 2.;
+    const double c = (a_plus_c - a_minus_c) / 2.;
+
+    // The stationary point: [2a b; b 2c] [u v]t = -[d e]t. It's a saddle only
+    // if the determinant is negative
+    const double det = 4.*a*c - b*b;
+    if( det >= 0. )
+        return false;
+    const double u = (b*e - 2.*c*d) / det;
+    const double v = (b*d - 2.*a*e) / det;
+
+    *x = (double)x0 + u;
+    *y = (double)y0 + v;
+    return true;
+}
+
+// Fits the saddle around (*x,*y), re-centering the window until the fit lands
+// in its central pixel. The estimate I'm given is already close, so if
+// the fit wanders off by more than max_shift pixels, I've latched onto some
+// other feature, and I give up. On success updates *x,*y
+static bool refine_saddle(// in/out
+                          double* x, double* y,
+
+                          // in
+                          const uint8_t* image, int w, int h, int stride,
+                          int r_blur, int r_fit,
+                          double max_shift)
+{
+    int x0 = (int)floor(*x + 0.5);
+    int y0 = (int)floor(*y + 0.5);
+    for(int iteration=0; iteration<4; iteration++)
+    {
+        double xfit, yfit;
+        if(!fit_saddle(&xfit, &yfit, image, w, h, stride, x0, y0, r_blur, r_fit))
+            return false;
+
+        const int x1 = (int)floor(xfit + 0.5);
+        const int y1 = (int)floor(yfit + 0.5);
+        if( (xfit - *x)*(xfit - *x) + (yfit - *y)*(yfit - *y) > max_shift*max_shift )
+            return false;
+        if(x1 == x0 && y1 == y0)
+        {
+            *x = xfit;
+            *y = yfit;
+            return true;
+        }
+
+        // Outside the window the fit is an extrapolation, so I don't jump
+        // further than the window reaches
+        x0 += (x1-x0 > r_fit) ? r_fit : (x1-x0 < -r_fit) ? -r_fit : x1-x0;
+        y0 += (y1-y0 > r_fit) ? r_fit : (y1-y0 < -r_fit) ? -r_fit : y1-y0;
+    }
+    return false;
+}
+
+// Returns how many points were refined
+// WPI_EXPORT
+int refine_chessboard_corners_saddle( // out/in
+                                      std::vector<mrgingham::PointDouble>* points,
+                                      signed char* level,
+
+                                      // in
+                                      const cv::Mat& image_input,
+                                      int image_pyramid_level,
+                                      bool fullres,
+                                      bool debug,
+                                      const preprocess_options_t* preprocess,
+                                      mrgingham_cancel_t* cancel)
+{
+    cv::Mat        _image;
+    const cv::Mat* image = apply_image_pyramid_scaling(_image,
+                                                       image_input, image_pyramid_level,
+                                                       debug, preprocess, false);
+    if( image == NULL ) return 0;
+
+    const double scale = (double)(1 << image_pyramid_level);
+
+    int r_blur_fullres = 1 + (1 << image_pyramid_level)/2;
+    if(r_blur_fullres > SADDLE_RADIUS_MAX-1)
+        r_blur_fullres = SADDLE_RADIUS_MAX-1;
+
+    int Nrefined = 0;
+    for(unsigned i=0; i<points->size() && !mrgingham_is_cancelled(cancel); i++)
+    {
+        if( level[i] != image_pyramid_level )
+            continue;
+
+        PointDouble& pt_full = (*points)[i];
+
+        // At the detection level the squares may be just a few pixels across,
+        // so I look only at the 3x3 window around the corner, with a 3x3 blur
+        bool refined = false;
+        PointDouble pt = scale_image_coord(&pt_full, 1.0 / scale);
+        if( refine_saddle(&pt.x, &pt.y,
+                          image->data, image->cols, image->rows, (int)image->step[0],
+                          1, 1, 2.5) )
+        {
+            pt_full = scale_image_coord(&pt, scale);
+            refined = true;
+        }
+
+        // At full resolution the squares are large, and the estimate from the
+        // coarse level may be off by a pixel or two of that level. So I scale the
+        // window and the blur with the level
+        if( fullres && image_pyramid_level > 0 &&
+            image_input.type() == CV_8U &&
+            refine_saddle(&pt_full.x, &pt_full.y,
+                          image_input.data, image_input.cols, image_input.rows,
+                          (int)image_input.step[0],
+                          r_blur_fullres, r_blur_fullres + 1,
+                          2.5 * scale) )
+        {
+            level[i] = 0;
+            refined  = true;
+        }
+
+        if(refined)
+            Nrefined++;
+    }
+
+    if(debug)
+        fprintf(stderr, "Saddle refinement at level %d%s: refined %d/%d points\n",
+                image_pyramid_level, fullres ? " and level 0" : "",
+                Nrefined, (int)points->size());
+    return Nrefined;
 }
 
 
@@ -644,7 +1316,7 @@ bool find_chessboard_corners_from_image_file( // out
         return false;
     }
 
-    return find_chessboard_corners_from_image_array( points, image, image_pyramid_level, debug, filename );
+    return find_chessboard_corners_from_image_array( points, image, image_pyramid_level, debug, filename, NULL );
 }
 
 }
@@ -3,11 +3,36 @@
 #include <vector>
 #include <opencv2/core/core.hpp>
 #include "point.hh"
+#include "cancel.h"
 
 
 namespace mrgingham
 {
 
+struct preprocess_options_t;
+struct frame_cache_t;
+
+// Which tiles of the full-resolution image could contain corners. When an
+// auto-level search falls through to level 0, the coarser levels have already
+// looked at the whole image. Each one marks the tiles where it saw any
+// corner-like response, and level 0 then computes its ChESS response only in
+// the marked tiles, and in their neighbors
+struct tile_mask_t
+{
+    // in full-resolution pixels
+    int tile_size;
+    int Ntiles_x, Ntiles_y;
+
+    // Ntiles_x*Ntiles_y flags. Empty until a coarse level marks some tiles
+    std::vector<uint8_t> active;
+
+    tile_mask_t() :
+        tile_size(0),
+        Ntiles_x(0),
+        Ntiles_y(0)
+    {}
+};
+
 // these all output the points scaled by FIND_GRID_SCALE in points[].
 bool find_chessboard_corners_from_image_array( // out
 
@@ -27,7 +52,31 @@ bool find_chessboard_corners_from_image_array( // out
                                                // is cut down by a factor of 4
                                                int image_pyramid_level,
                                                bool debug = false,
-                                               const char* debug_image_filename = NULL);
+                                               const char* debug_image_filename = NULL,
+
+                                               // If non-NULL, this is applied
+                                               // to the image after it's
+                                               // downsampled
+                                               const preprocess_options_t* preprocess = NULL,
+
+                                               // If non-NULL: at levels > 0 I
+                                               // mark the tiles where I see
+                                               // corner-like responses. At
+                                               // level 0 I only look at the
+                                               // marked tiles, if any are
+                                               tile_mask_t* tile_mask = NULL,
+
+                                               // If non-NULL, I give up as
+                                               // soon as this token is
+                                               // cancelled, or its deadline
+                                               // passes
+                                               mrgingham_cancel_t* cancel = NULL,
+
+                                               // If non-NULL, I reuse the
+                                               // previous frame's response
+                                               // where the image didn't
+                                               // change, and update it
+                                               frame_cache_t* frame_cache = NULL);
 
 bool find_chessboard_corners_from_image_file( // out
 
@@ -69,6 +118,26 @@ int refine_chessboard_corners_from_image_array( // out/int
 
                                                 int image_pyramid_level,
                                                 bool debug = false,
-                                                const char* debug_image_filename = NULL);
+                                                const char* debug_image_filename = NULL,
+                                                const preprocess_options_t* preprocess = NULL,
+                                                mrgingham_cancel_t* cancel = NULL,
+                                                frame_cache_t* frame_cache = NULL);
+
+// The alternative to refine_chessboard_corners_from_image_array(): each point
+// detected at image_pyramid_level is refined by fitting a saddle to the image
+// intensities around it, at that level. If fullres, the fit is then repeated
+// in a small window of the full-resolution image, and level[ipoint] is set to
+// 0. Returns how many points were refined
+int refine_chessboard_corners_saddle( // out/in
+                                      std::vector<mrgingham::PointDouble>* points,
+                                      signed char* level,
+
+                                      // in
+                                      const cv::Mat& image_input,
+                                      int image_pyramid_level,
+                                      bool fullres,
+                                      bool debug = false,
+                                      const preprocess_options_t* preprocess = NULL,
+                                      mrgingham_cancel_t* cancel = NULL);
 
 };
@@ -514,7 +514,8 @@ static void get_sequence_candidates( // out
 
                                      // for debugging
                                      const debug_sequence_t& debug_sequence,
-                                     const int gridn)
+                                     const int gridn,
+                                     mrgingham_cancel_t* cancel)
 {
     const VORONOI::cell_type* tracing_c = NULL;
 
@@ -546,6 +547,9 @@ static void get_sequence_candidates( // out
 
     for (auto it = voronoi->cells().begin(); it != voronoi->cells().end(); it++ )
     {
+        if(mrgingham_is_cancelled(cancel))
+            return;
+
         const VORONOI::cell_type* c  = &(*it);
 
         bool debug_sequence = ( c == tracing_c );
@@ -1242,6 +1246,23 @@ bool mrgingham::find_grid_from_points( // out
                                       bool  debug,
                                       const debug_sequence_t& debug_sequence)
 {
+    return find_grid_from_points(points_out, points, gridn,
+                                 debug, debug_sequence, NULL);
+}
+
+bool mrgingham::find_grid_from_points( // out
+                                      std::vector<PointDouble>& points_out,
+
+                                      // in
+                                      const std::vector<PointInt>& points,
+                                      const int gridn,
+                                      bool  debug,
+                                      const debug_sequence_t& debug_sequence,
+                                      mrgingham_cancel_t* cancel)
+{
+    if(mrgingham_is_cancelled(cancel))
+        return false;
+
     VORONOI voronoi;
     construct_voronoi(points.begin(), points.end(), &voronoi);
 
@@ -1250,7 +1271,9 @@ bool mrgingham::find_grid_from_points( // out
 
     v_CS sequence_candidates;
     get_sequence_candidates(&sequence_candidates, &voronoi, points,
-                            debug_sequence, gridn);
+                            debug_sequence, gridn, cancel);
+    if(mrgingham_is_cancelled(cancel))
+        return false;
 
     if(debug)
     {
@@ -1315,6 +1338,9 @@ bool mrgingham::find_grid_from_points( // out
     std::set<int> outer_edges_in_found_cycles;
     for( int i=0; i<Nouter_edges; i++ )
     {
+        if(mrgingham_is_cancelled(cancel))
+            return false;
+
         if( outer_edges_in_found_cycles.count(i) )
             // I already processed this edge
             continue;
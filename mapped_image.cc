@@ -0,0 +1,138 @@
+#include "mrgingham.hh"
+#include "windows_defines.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#ifdef WPI_LINUX
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+namespace mrgingham
+{
+
+#ifdef WPI_LINUX
+
+// Parses the next whitespace-separated decimal number in a PGM header,
+// skipping '#' comments. Returns false if there isn't one
+static bool pgm_header_number( int* x, const char* p, size_t size, size_t* i )
+{
+    while(*i < size)
+    {
+        if(p[*i] == '#')
+            while(*i < size && p[*i] != '\n') (*i)++;
+        else if(p[*i] == ' '  || p[*i] == '\t' || p[*i] == '\n' || p[*i] == '\r')
+            (*i)++;
+        else
+            break;
+    }
+
+    if(*i >= size || p[*i] < '0' || p[*i] > '9')
+        return false;
+
+    long v = 0;
+    while(*i < size && p[*i] >= '0' && p[*i] <= '9')
+    {
+        v = v*10 + (p[*i] - '0');
+        if(v > 1000000)
+            return false;
+        (*i)++;
+    }
+    *x = (int)v;
+    return true;
+}
+
+WPI_EXPORT
+bool mapped_image_open( mapped_image_t* mapped, const char* filename )
+{
+    mapped->image    = cv::Mat();
+    mapped->map      = NULL;
+    mapped->map_size = 0;
+
+    int fd = open(filename, O_RDONLY);
+    if(fd < 0)
+        return false;
+
+    struct stat sb;
+    if( fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_size < 8 )
+    {
+        close(fd);
+        return false;
+    }
+
+    char magic[2];
+    if( 2 != pread(fd, magic, 2, 0) ||
+        magic[0] != 'P' || magic[1] != '5' )
+    {
+        close(fd);
+        return false;
+    }
+
+    // MAP_PRIVATE with PROT_WRITE: the caller may preprocess the image in
+    // place. The pages it touches are then copied; the file is never written
+    void* map = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED)
+        return false;
+
+    const char* p    = (const char*)map;
+    const size_t size = sb.st_size;
+    size_t i = 2;
+    int w, h, maxval;
+    if( !pgm_header_number(&w,      p, size, &i) ||
+        !pgm_header_number(&h,      p, size, &i) ||
+        !pgm_header_number(&maxval, p, size, &i) ||
+        w <= 0 || h <= 0 ||
+        // 16-bit PGMs go through the usual path
+        maxval <= 0 || maxval > 255 ||
+        // exactly one whitespace character separates the header from the data
+        i >= size ||
+        size - (i+1) < (size_t)w*(size_t)h )
+    {
+        munmap(map, size);
+        return false;
+    }
+
+    // I'm about to read the whole thing
+    madvise(map, size, MADV_WILLNEED);
+
+    mapped->image    = cv::Mat(h, w, CV_8UC1, (void*)&p[i+1], (size_t)w);
+    mapped->map      = map;
+    mapped->map_size = size;
+    return true;
+}
+
+WPI_EXPORT
+void mapped_image_close( mapped_image_t* mapped )
+{
+    mapped->image.release();
+    if(mapped->map != NULL)
+        munmap(mapped->map, mapped->map_size);
+    mapped->map      = NULL;
+    mapped->map_size = 0;
+}
+
+#else
+
+// No mmap() here. The callers then read the file normally
+WPI_EXPORT
+bool mapped_image_open( mapped_image_t* mapped, const char* filename )
+{
+    mapped->image    = cv::Mat();
+    mapped->map      = NULL;
+    mapped->map_size = 0;
+    return false;
+}
+
+WPI_EXPORT
+void mapped_image_close( mapped_image_t* mapped )
+{
+    mapped->image.release();
+}
+
+#endif
+
+}
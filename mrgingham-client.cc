@@ -0,0 +1,237 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <vector>
+
+#include "server_protocol.hh"
+
+using namespace mrgingham;
+
+// Talks to a resident mrgingham server (mrgingham --server SOCKET). Sends each
+// image on the commandline, and writes out the detections in the same vnlog
+// format as the mrgingham tool
+static bool read_file(std::vector<uint8_t>* data, const char* filename)
+{
+    FILE* fp = fopen(filename, "rb");
+    if(fp == NULL)
+        return false;
+
+    bool result = false;
+    if( 0 == fseek(fp, 0, SEEK_END) )
+    {
+        long size = ftell(fp);
+        if( size >= 0 && 0 == fseek(fp, 0, SEEK_SET) )
+        {
+            data->resize(size);
+            result = (size == 0 || 1 == fread(data->data(), size, 1, fp));
+        }
+    }
+    fclose(fp);
+    return result;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* usage =
+        "Usage: %s --socket SOCKET\n"
+        "          [--blobs] [--gridn N] [--noclahe] [--blur radius]\n"
+        "          [--level l] [--no-refine]\n"
+        "          [--send-data | --raw WIDTHxHEIGHT]\n"
+        "          image image ...\n"
+        "\n"
+        "  Sends the given images to a resident mrgingham server started with\n"
+        "  'mrgingham --server SOCKET', and writes the detections to stdout in the same\n"
+        "  vnlog format as the mrgingham tool. The detection options have the same\n"
+        "  meaning and defaults as in the mrgingham tool.\n"
+        "\n"
+        "  By default only the image paths are sent, and the server reads the images\n"
+        "  itself. With --send-data the client reads the image files, and sends their\n"
+        "  contents. With --raw WIDTHxHEIGHT the image files contain headerless 8-bit\n"
+        "  grayscale pixels, which are sent as they are.\n"
+        "\n";
+
+    struct option opts[] = {
+        { "socket",            required_argument, NULL, 'S' },
+        { "blobs",             no_argument,       NULL, 'B' },
+        { "blur",              required_argument, NULL, 'b' },
+        { "noclahe",           no_argument,       NULL, 'C' },
+        { "level",             required_argument, NULL, 'l' },
+        { "no-refine",         no_argument,       NULL, 'R' },
+        { "gridn",             required_argument, NULL, 'N' },
+        { "send-data",         no_argument,       NULL, 'd' },
+        { "raw",               required_argument, NULL, 'r' },
+        { "help",              no_argument,       NULL, 'h' },
+        {}
+    };
+
+    const char* socket_path = NULL;
+
+    server_request_t request = {};
+    memcpy(request.magic, SERVER_REQUEST_MAGIC, 4);
+    request.source              = SERVER_SOURCE_PATH;
+    request.gridn               = 10;
+    request.image_pyramid_level = -1;
+    request.blur_radius         = 1;
+    request.flags               = 0;
+
+    int opt;
+    do
+    {
+        // "h" means -h does something
+        opt = getopt_long(argc, argv, "h", opts, NULL);
+        switch(opt)
+        {
+        case -1:
+            break;
+
+        case 'h':
+            printf(usage, argv[0]);
+            return 0;
+
+        case 'S':
+            socket_path = optarg;
+            break;
+
+        case 'B':
+            request.flags |= SERVER_FLAG_BLOBS;
+            break;
+
+        case 'C':
+            request.flags |= SERVER_FLAG_NOCLAHE;
+            break;
+
+        case 'R':
+            request.flags |= SERVER_FLAG_NOREFINE;
+            break;
+
+        case 'b':
+            request.blur_radius = atoi(optarg);
+            break;
+
+        case 'l':
+            request.image_pyramid_level = atoi(optarg);
+            break;
+
+        case 'N':
+            request.gridn = atoi(optarg);
+            break;
+
+        case 'd':
+            request.source = SERVER_SOURCE_ENCODED;
+            break;
+
+        case 'r':
+            if( 2 != sscanf(optarg, "%ux%u", &request.width, &request.height) ||
+                request.width == 0 || request.height == 0 )
+            {
+                fprintf(stderr, "--raw must be WIDTHxHEIGHT. Got '%s'\n", optarg);
+                return 1;
+            }
+            request.source = SERVER_SOURCE_RAW;
+            break;
+
+        case '?':
+            fprintf(stderr, "Unknown option\n");
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    } while( opt != -1 );
+
+    if( socket_path == NULL || optind > argc-1 )
+    {
+        fprintf(stderr, "Need --socket and at least one image\n");
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+    if( request.gridn < 2 || request.gridn > SERVER_MAX_GRIDN )
+    {
+        fprintf(stderr, "--gridn value must be >= 2 and <= %d\n", SERVER_MAX_GRIDN);
+        return 1;
+    }
+    if( (request.flags & SERVER_FLAG_BLOBS) && request.image_pyramid_level >= 0)
+    {
+        fprintf(stderr, "ERROR: 'image_pyramid_level' only implemented for chessboards.\n");
+        return 1;
+    }
+
+    int fd = server_connect(socket_path);
+    if(fd < 0)
+        return 1;
+
+    printf("# filename x y level\n");
+
+    std::vector<uint8_t>              data;
+    std::vector<server_reply_point_t> points;
+    char*                             path = NULL;
+    for(int i=optind; i<argc; i++)
+    {
+        const char* filename = argv[i];
+
+        const void* payload;
+        if(request.source == SERVER_SOURCE_PATH)
+        {
+            // The server has its own working directory, so I send it the
+            // absolute path
+            free(path);
+            path = realpath(filename, NULL);
+            if(path == NULL)
+            {
+                fprintf(stderr, "Couldn't find image '%s'\n", filename);
+                printf("## Couldn't open image '%s'\n", filename);
+                printf("%s - - -\n", filename);
+                continue;
+            }
+            payload              = path;
+            request.payload_size = strlen(path);
+        }
+        else
+        {
+            if(!read_file(&data, filename) ||
+               (request.source == SERVER_SOURCE_RAW &&
+                data.size() != (size_t)request.width*request.height))
+            {
+                fprintf(stderr, "Couldn't read image '%s'\n", filename);
+                printf("## Couldn't open image '%s'\n", filename);
+                printf("%s - - -\n", filename);
+                continue;
+            }
+            payload              = data.data();
+            request.payload_size = data.size();
+        }
+
+        server_reply_t reply;
+        if(!server_write_all(fd, &request, sizeof(request)) ||
+           !server_write_all(fd, payload, request.payload_size) ||
+           !server_read_all (fd, &reply, sizeof(reply)) ||
+           0 != memcmp(reply.magic, SERVER_REPLY_MAGIC, 4) ||
+           reply.N < 0)
+        {
+            fprintf(stderr, "Lost the connection to the server while processing '%s'\n", filename);
+            close(fd);
+            return 1;
+        }
+
+        points.resize(reply.N);
+        if(!server_read_all(fd, points.data(), reply.N*sizeof(points[0])))
+        {
+            fprintf(stderr, "Lost the connection to the server while processing '%s'\n", filename);
+            close(fd);
+            return 1;
+        }
+
+        if(reply.status == SERVER_STATUS_BADIMAGE)
+            printf("## Couldn't open image '%s'\n", filename);
+        if(reply.status < 0)
+            printf("%s - - -\n", filename);
+        else
+            for(int j=0; j<reply.N; j++)
+                printf("%s %f %f %d\n", filename,
+                       points[j].x, points[j].y, points[j].level);
+    }
+
+    free(path);
+    close(fd);
+    return 0;
+}
@@ -1,166 +1,2050 @@
 #include "mrgingham.hh"
+#include "disk_cache.hh"
+#include "server_protocol.hh"
+#include "shm_ring.hh"
+#include "tar_reader.hh"
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <errno.h>
+#include <signal.h>
 
 #include "windows_defines.h"
 
 #include <getopt.h>
 #include <glob.h>
 #include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+// --watch uses inotify, so it's only available on Linux
+#include <sys/inotify.h>
+#endif
+#include <poll.h>
+#include <fnmatch.h>
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <opencv2/core/core.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 #include <opencv2/highgui/highgui.hpp>
+#include <opencv2/videoio/videoio.hpp>
+
+#ifndef VERSION
+#define VERSION "unknown"
+#endif
+
+using namespace mrgingham;
+
+enum output_format_t { OUTPUT_VNLOG, OUTPUT_NPY, OUTPUT_RAW };
+
+// An image in the --prefetch window
+struct prefetched_t
+{
+    std::string path;
+    int         fd;
+};
+
+// One parameter set for --sweep
+struct sweep_config_t
+{
+    int         gridn;
+    bool        doclahe;
+    int         blur_radius;
+    int         image_pyramid_level;
+    bool        do_refine;
+};
+
+// The options detect() passes on to the library
+struct library_options_t
+{
+    preprocess_options_t preprocess;
+    search_options_t     search;
+};
+
+// Frames [begin,end) of a video file
+struct video_segment_t
+{
+    const char* path;
+    int64_t     begin, end;
+};
+
+struct mrgingham_thread_context_t
+{
+    // The images come either from the expanded globs or streamed from a
+    // manifest. The workers pull the next image from whichever source we have,
+    // under job_mutex
+    const glob_t* _glob;
+    int           i_glob_next;
+    FILE*         fp_manifest;
+    char          manifest_delimiter;
+    pthread_mutex_t job_mutex;
+
+    // --frames: the images are raw frames streamed on stdin instead. They're
+    // read under job_mutex, and numbered in order. The results are written out
+    // in frame order: a worker that finishes a frame waits until all the
+    // earlier frames were written
+    bool          doframes;
+    bool          frames_y4m;
+    int           frames_width, frames_height;
+    // Bytes after the luma plane in each frame. I skip these
+    size_t        frames_skip_size;
+    uint64_t      frames_next_read;
+    uint64_t      frames_next_output;
+    pthread_cond_t frames_output_cond;
+
+    // --video: the globs are video files. Each is split into segments of
+    // consecutive frames, and the workers pull segments, under job_mutex.
+    // Every video_every-th frame is processed
+    bool          dovideo;
+    int           video_every;
+    std::vector<video_segment_t> video_segments;
+    size_t        i_video_segment_next;
+
+    // --watch: the images come from inotify events on watch_dir: each file
+    // that's closed after writing or moved into the directory. The commandline
+    // globs are fnmatch() patterns selecting which files to process. An inotify
+    // read() returns several events, so I queue up the paths in watch_pending.
+    // A write to watch_stop_fd (from the SIGINT handler) stops the watching
+    bool          dowatch;
+    const char*   watch_dir;
+    int           watch_fd;
+    int           watch_stop_fd;
+    char* const*  watch_patterns;
+    int           Nwatch_patterns;
+    std::deque<std::string> watch_pending;
+    // Write each result out as soon as it's available
+    bool          flush_each_result;
+
+    // --prefetch N: next_image() keeps the next N images open, and has the
+    // kernel read them ahead
+    int           prefetch;
+    std::deque<prefetched_t> prefetch_window;
+    bool          prefetch_source_done;
+    char*         prefetch_buf;
+    size_t        prefetch_bufsize;
+
+    // --tar: the globs are tar archives, read one after another. The workers
+    // read the next member into memory under job_mutex, and decode it
+    // themselves
+    bool          dotar;
+    tar_reader_t  tar;
+
+    // --shard i/N: I only process the images whose path hashes to i mod N
+    int           shard_i, shard_N;
+
+    // With --shard and --merge each image may be listed only once: the output
+    // of a shard can't tell two occurrences of the same image apart. So
+    // next_image() skips the repeats, and counts them. Any repeats make me exit
+    // with an error
+    bool          reject_repeated;
+    std::unordered_set<std::string> seen_inputs;
+    int           Nrepeated;
+
+    // --sweep: each image is decoded once, and the detection is run with each
+    // of these parameter sets. With sweep_first I stop at the first success
+    std::vector<sweep_config_t> sweep;
+    bool          sweep_first;
+
+    int           Njobs;
+    bool          doclahe;
+    int           blur_radius;
+    // --pyramid-preprocess: the CLAHE and blur are applied by the library to
+    // each pyramid level, instead of by me to the full-resolution image.
+    // library.preprocess holds doclahe and blur_radius then. library.search
+    // holds --tile-mask, --parallel-levels, --time-budget, --refinement and
+    // --prefilter. library is passed to the library if any of these is given
+    bool          pyramid_preprocess;
+    library_options_t library;
+    bool          adaptive_level;
+    // --incremental: the change threshold of the frame cache, or <= 0
+    double        incremental_threshold;
+    bool          doblobs;
+    bool          do_refine;
+    int           gridn;
+    bool          debug;
+    debug_sequence_t debug_sequence;
+    int           image_pyramid_level;
+
+    // Binary output. Each image produces one fixed-size record: the index of
+    // its filename in fp_filenames (uint32), followed by gridn*gridn (x,y,level)
+    // float32 triplets. Failed detections have x,y = NaN and level = -1. The
+    // records are written in completion order, and the index is the line
+    // number in the filename table. If any of the writes fail, output_failed is
+    // set, and I exit with an error at the end
+    output_format_t output_format;
+    FILE*         fp_records;
+    FILE*         fp_filenames;
+    uint32_t      Nrecords;
+    bool          output_failed;
+
+    // Result cache. Keyed on the image file contents, seeded with the hash of
+    // all the detection parameters
+    bool          docache;
+    disk_cache_t  cache;
+    hash128_t     cache_key_seed;
+
+    // Decoded-image cache. Keyed on the path, size and mtime of the image file
+    bool          dodecodedcache;
+    disk_cache_t  decoded_cache;
+} ctx;
+
+// numpy "descr" for the binary records. This is a packed structured dtype, so
+// the file can be np.load(mmap_mode='r')-ed directly
+static int npy_descr(char* buf, int bufsize, int gridn)
+{
+    const uint16_t one = 1;
+    const char endian = (*(const uint8_t*)&one == 1) ? '<' : '>';
+    return snprintf(buf, bufsize,
+                    "[('ifile', '%cu4'), ('xyl', '%cf4', (%d, 3))]",
+                    endian, endian, gridn*gridn);
+}
+
+// The npy header has a fixed size, so that I can come back at the end, and
+// fill in the record count
+#define NPY_HEADER_SIZE 256
+static bool write_npy_header(FILE* fp, int gridn, uint32_t Nrecords)
+{
+    char descr[128];
+    npy_descr(descr, sizeof(descr), gridn);
+
+    char header[NPY_HEADER_SIZE];
+    memset(header, ' ', sizeof(header));
+
+    const int prefix_size = 10; // magic, version, header length
+    int len = snprintf(&header[prefix_size], sizeof(header) - prefix_size,
+                       "{'descr': %s, 'fortran_order': False, 'shape': (%u,), }",
+                       descr, Nrecords);
+    if(len < 0 || prefix_size + len >= (int)sizeof(header))
+        return false;
+    // snprintf() wrote a '\0'. The header is padded with spaces, and ends with
+    // a newline
+    header[prefix_size + len]   = ' ';
+    header[sizeof(header) - 1]  = '\n';
+
+    memcpy(header, "\x93NUMPY\x01\x00", 8);
+    header[8] = (char)((sizeof(header) - prefix_size) & 0xFF);
+    header[9] = (char)((sizeof(header) - prefix_size) >> 8);
+
+    return
+        0 == fseek(fp, 0, SEEK_SET) &&
+        1 == fwrite(header, sizeof(header), 1, fp);
+}
+
+// Writes the result for one image. May be called from any thread: the output is
+// atomic
+static void output_result(const char*                     filename,
+                          bool                            result,
+                          const std::vector<PointDouble>& points_out,
+                          const signed char*              refinement_level,
+                          int                             found_pyramid_level)
+{
+    // A board found at level 0 isn't refined, and refinement_level may hold
+    // the levels of an earlier image
+    if(found_pyramid_level <= 0)
+        refinement_level = NULL;
+
+    if(ctx.output_format == OUTPUT_VNLOG)
+    {
+        flockfile(stdout);
+        {
+            if( result )
+            {
+                for(int i=0; i<(int)points_out.size(); i++)
+                    printf( "%s %f %f %d\n", filename,
+                            points_out[i].x,
+                            points_out[i].y,
+                            (refinement_level == NULL) ? found_pyramid_level : (int)refinement_level[i]);
+            }
+            else
+                printf("%s - - -\n", filename);
+            if(ctx.flush_each_result)
+                fflush(stdout);
+        }
+        funlockfile(stdout);
+        return;
+    }
+
+    const int Npoints = ctx.gridn*ctx.gridn;
+    float record_xyl[Npoints*3];
+    for(int i=0; i<Npoints; i++)
+    {
+        if( result && i < (int)points_out.size() )
+        {
+            record_xyl[3*i + 0] = (float)points_out[i].x;
+            record_xyl[3*i + 1] = (float)points_out[i].y;
+            record_xyl[3*i + 2] = (float)((refinement_level == NULL) ? found_pyramid_level : (int)refinement_level[i]);
+        }
+        else
+        {
+            record_xyl[3*i + 0] = NAN;
+            record_xyl[3*i + 1] = NAN;
+            record_xyl[3*i + 2] = -1.0f;
+        }
+    }
+
+    flockfile(ctx.fp_records);
+    {
+        uint32_t ifile = ctx.Nrecords++;
+        if( 1 != fwrite(&ifile,     sizeof(ifile),      1, ctx.fp_records) ||
+            1 != fwrite(record_xyl, sizeof(record_xyl), 1, ctx.fp_records) ||
+            0 >  fprintf(ctx.fp_filenames, "%s\n", filename) ||
+            (ctx.flush_each_result &&
+             (0 != fflush(ctx.fp_records) || 0 != fflush(ctx.fp_filenames))) )
+        {
+            // I report the first failure only
+            if(!ctx.output_failed)
+                fprintf(stderr, "Couldn't write the result for '%s': %s\n",
+                        filename, strerror(errno));
+            ctx.output_failed = true;
+        }
+    }
+    funlockfile(ctx.fp_records);
+}
+
+// Returns the path to the next image to process, or NULL if there aren't any
+// more. Streamed paths are read into *buf, which is managed by getdelim(). This
+// is the caller's buffer: each worker has its own. May be called from any thread
+//
+// If sharding, I skip the images that belong to other shards. So next_image()
+// walks through the full input list in order
+static bool in_this_shard(const char* filename)
+{
+    if(ctx.shard_N <= 1)
+        return true;
+
+    // The assignment depends only on the path string, so it's stable across
+    // reruns and machines. The paths must be given identically on all machines
+    hash128_t h = hash128(filename, strlen(filename));
+    return (int)(h.a % (uint64_t)ctx.shard_N) == ctx.shard_i;
+}
+static bool watch_wanted(const char* name)
+{
+    // Hidden files are usually temporaries, written before being renamed into
+    // place
+    if(name[0] == '.')
+        return false;
+    if(ctx.Nwatch_patterns == 0)
+        return true;
+    for(int i=0; i<ctx.Nwatch_patterns; i++)
+        if(0 == fnmatch(ctx.watch_patterns[i], name, 0))
+            return true;
+    return false;
+}
+
+#ifdef __linux__
+// Waits for the next new file in the watched directory, and reads its path
+// into *buf. Returns false when the watching is over: I was told to stop, or
+// the directory went away. Called with job_mutex held
+static bool next_watched(char** buf, size_t* bufsize)
+{
+    while(ctx.watch_pending.empty())
+    {
+        struct pollfd pfd[2] = { { ctx.watch_fd,      POLLIN, 0 },
+                                 { ctx.watch_stop_fd, POLLIN, 0 } };
+        if(poll(pfd, 2, -1) < 0)
+        {
+            if(errno == EINTR)
+                continue;
+            return false;
+        }
+        // I never read the stop pipe, so all the workers see it
+        if(pfd[1].revents)
+            return false;
+
+        char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t len = read(ctx.watch_fd, events, sizeof(events));
+        if(len < 0 && errno == EINTR)
+            continue;
+        if(len <= 0)
+            return false;
+
+        bool watch_over = false;
+        for(ssize_t i=0; i<len; )
+        {
+            const struct inotify_event* event = (const struct inotify_event*)&events[i];
+            i += sizeof(struct inotify_event) + event->len;
+
+            if(event->mask & (IN_IGNORED | IN_DELETE_SELF | IN_UNMOUNT))
+                watch_over = true;
+            else if(event->len > 0 && !(event->mask & IN_ISDIR) &&
+                    watch_wanted(event->name))
+                ctx.watch_pending.push_back(std::string(ctx.watch_dir) + "/" + event->name);
+        }
+        if(watch_over && ctx.watch_pending.empty())
+        {
+            fprintf(stderr, "The watched directory '%s' went away. Stopping\n", ctx.watch_dir);
+            return false;
+        }
+    }
+
+    const std::string& path = ctx.watch_pending.front();
+    if(*bufsize < path.size() + 1)
+    {
+        *bufsize = path.size() + 1;
+        *buf     = (char*)realloc(*buf, *bufsize);
+    }
+    memcpy(*buf, path.c_str(), path.size() + 1);
+    ctx.watch_pending.pop_front();
+    return true;
+}
+#else
+// --watch is rejected when parsing the options
+static bool next_watched(char** buf, size_t* bufsize)
+{
+    return false;
+}
+#endif
+
+static int watch_stop_pipe[2];
+static void watch_stop(int sig)
+{
+    // Async-signal-safe. The workers finish their current images, and exit
+    ssize_t n = write(watch_stop_pipe[1], "", 1);
+    (void)n;
+}
+
+static bool is_repeated(const char* filename)
+{
+    if(!ctx.reject_repeated ||
+       ctx.seen_inputs.insert(std::string(filename)).second)
+        return false;
+
+    fprintf(stderr, "Repeated: '%s' is listed more than once. With --shard and --merge each image may be listed only once. Skipping\n",
+            filename);
+    ctx.Nrepeated++;
+    return true;
+}
+
+static const char* next_image_from_source(char** buf, size_t* bufsize)
+{
+    const char* filename = NULL;
+    do
+    {
+        filename = NULL;
+        if(ctx.dowatch)
+        {
+            if(next_watched(buf, bufsize))
+                filename = *buf;
+        }
+        else if(ctx.fp_manifest == NULL)
+        {
+            if(ctx.i_glob_next < (int)ctx._glob->gl_pathc)
+                filename = ctx._glob->gl_pathv[ctx.i_glob_next++];
+        }
+        else
+        {
+            ssize_t len;
+            while( (len = getdelim(buf, bufsize, ctx.manifest_delimiter, ctx.fp_manifest)) >= 0 )
+            {
+                if(len > 0 && (*buf)[len-1] == ctx.manifest_delimiter)
+                    (*buf)[--len] = '\0';
+                // skip blank lines
+                if(len > 0)
+                {
+                    filename = *buf;
+                    break;
+                }
+            }
+        }
+    } while(filename != NULL && (!in_this_shard(filename) || is_repeated(filename)));
+    return filename;
+}
+
+// --prefetch: I keep a window of the next few images open, and I tell the
+// kernel that I'll need their data soon. The kernel then reads them in the
+// background while the workers are busy detecting, so on a cold cache the
+// workers don't wait on the storage. The worker gets the open fd of its image.
+// It reads the file through it only if it needs all of it (for the --cache
+// key). Otherwise it closes it, and loads the image as usual, from the page
+// cache. posix_fadvise() isn't available everywhere; without it --prefetch is
+// rejected when parsing the options
+static const char* next_image(char** buf, size_t* bufsize, int* fd)
+{
+    const char* filename = NULL;
+    *fd = -1;
+
+    pthread_mutex_lock(&ctx.job_mutex);
+    if(ctx.prefetch <= 0)
+        filename = next_image_from_source(buf, bufsize);
+    else
+    {
+        while(!ctx.prefetch_source_done &&
+              (int)ctx.prefetch_window.size() <= ctx.prefetch)
+        {
+            const char* path =
+                next_image_from_source(&ctx.prefetch_buf, &ctx.prefetch_bufsize);
+            if(path == NULL)
+            {
+                ctx.prefetch_source_done = true;
+                break;
+            }
+
+            // If this fails, I report it when the image is processed
+            int fd_prefetch = open(path, O_RDONLY | O_CLOEXEC);
+#ifdef POSIX_FADV_WILLNEED
+            if(fd_prefetch >= 0)
+                posix_fadvise(fd_prefetch, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+            ctx.prefetch_window.push_back(prefetched_t{std::string(path), fd_prefetch});
+        }
+
+        if(!ctx.prefetch_window.empty())
+        {
+            const prefetched_t& next = ctx.prefetch_window.front();
+            if(*bufsize < next.path.size() + 1)
+            {
+                *bufsize = next.path.size() + 1;
+                *buf     = (char*)realloc(*buf, *bufsize);
+            }
+            memcpy(*buf, next.path.c_str(), next.path.size() + 1);
+            filename = *buf;
+            *fd      = next.fd;
+            ctx.prefetch_window.pop_front();
+        }
+    }
+    pthread_mutex_unlock(&ctx.job_mutex);
+
+    return filename;
+}
+
+// Reads the next member of the tar archives into *data, and returns its path
+// within the archive. The path is in *buf, managed like in next_image(). May be
+// called from any thread
+static const char* next_tar_member(char** buf, size_t* bufsize,
+                                   std::vector<uint8_t>* data)
+{
+    const char* filename = NULL;
+
+    pthread_mutex_lock(&ctx.job_mutex);
+    while(filename == NULL)
+    {
+        if(ctx.tar.fp == NULL)
+        {
+            if(ctx.i_glob_next >= (int)ctx._glob->gl_pathc)
+                break;
+            if(!tar_open(&ctx.tar, ctx._glob->gl_pathv[ctx.i_glob_next++]))
+                continue;
+        }
+
+        std::string name;
+        uint64_t    size;
+        const int   status = tar_next(&ctx.tar, &name, &size);
+        if(status > 0 && !in_this_shard(name.c_str()))
+            continue;
+        if(status > 0 && size > TAR_MAX_MEMBER_SIZE)
+        {
+            // The next tar_next() skips it
+            fprintf(stderr, "Skipping '%s' in archive '%s': it's too large (%llu bytes)\n",
+                    name.c_str(), ctx.tar.path, (unsigned long long)size);
+            continue;
+        }
+        if( status <= 0 || !tar_read(&ctx.tar, data) )
+        {
+            // The end of this archive, or an error. Either way, I move on to
+            // the next archive
+            tar_close(&ctx.tar);
+            continue;
+        }
+
+        if(*bufsize < name.size() + 1)
+        {
+            *bufsize = name.size() + 1;
+            *buf     = (char*)realloc(*buf, *bufsize);
+        }
+        memcpy(*buf, name.c_str(), name.size() + 1);
+        filename = *buf;
+    }
+    pthread_mutex_unlock(&ctx.job_mutex);
+
+    return filename;
+}
+
+// --merge: I read the vnlog outputs of all the shards, and write them out in the
+// order of the input list. Each image's records are contiguous in a shard
+// output, so I index each one as a (shard,offset,size) block in the mmap-ed
+// shard file. Images missing from all the shards, or present more than once,
+// are reported, as are images listed more than once in the input (next_image()
+// skips those). Returns the exit code
+struct merge_block_t
+{
+    int    ishard;
+    size_t offset, size;
+    bool   emitted;
+};
+static int merge_shards(const std::vector<const char*>& shard_filenames)
+{
+    int Nshards = (int)shard_filenames.size();
+    std::vector<const char*> shard_data(Nshards, NULL);
+    std::vector<size_t>      shard_size(Nshards, 0);
+
+    std::unordered_map<std::string, merge_block_t> blocks;
+    int Nduplicates = 0;
+    int Nmissing    = 0;
+    int Nextra      = 0;
+
+    for(int ishard=0; ishard<Nshards; ishard++)
+    {
+        int fd = open(shard_filenames[ishard], O_RDONLY);
+        struct stat sb;
+        if(fd < 0 || fstat(fd, &sb) != 0)
+        {
+            fprintf(stderr, "Couldn't open shard output '%s'\n", shard_filenames[ishard]);
+            return 1;
+        }
+        shard_size[ishard] = sb.st_size;
+        if(sb.st_size > 0)
+        {
+            void* p = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(p == MAP_FAILED)
+            {
+                fprintf(stderr, "Couldn't mmap shard output '%s'\n", shard_filenames[ishard]);
+                return 1;
+            }
+            shard_data[ishard] = (const char*)p;
+        }
+        close(fd);
+
+        const char* data = shard_data[ishard];
+        const size_t size = shard_size[ishard];
+        merge_block_t* block_current     = NULL;
+        std::string    filename_current;
+        size_t         line_previous_end = 0;
+
+        for(size_t i=0; i<size; )
+        {
+            const char* line = &data[i];
+            const char* eol  = (const char*)memchr(line, '\n', size - i);
+            size_t      len  = eol ? (size_t)(eol - line) + 1 : size - i;
+            i += len;
+
+            if(line[0] == '#' || line[0] == '\n')
+                continue;
+
+            // The mmap-ed data isn't '\0'-terminated, so I can't strcspn()
+            size_t filename_len = 0;
+            while(filename_len < len &&
+                  line[filename_len] != ' '  &&
+                  line[filename_len] != '\t' &&
+                  line[filename_len] != '\n')
+                filename_len++;
+            std::string filename(line, filename_len);
+
+            // Continuing the current image?
+            if(filename == filename_current &&
+               line_previous_end == (size_t)(line - data))
+            {
+                // If this image is a duplicate, I skip all of its lines
+                if(block_current != NULL)
+                    block_current->size += len;
+                line_previous_end += len;
+                continue;
+            }
+            filename_current  = filename;
+            line_previous_end = (size_t)(line - data) + len;
+
+            auto inserted = blocks.emplace(filename,
+                                           merge_block_t{ishard, (size_t)(line - data), len, false});
+            if(!inserted.second)
+            {
+                fprintf(stderr, "Duplicate: '%s' appears in '%s' and '%s'. Using the first one\n",
+                        filename.c_str(),
+                        shard_filenames[inserted.first->second.ishard],
+                        shard_filenames[ishard]);
+                Nduplicates++;
+                block_current = NULL;
+                continue;
+            }
+            block_current = &inserted.first->second;
+        }
+    }
+
+    printf("# filename x y level\n");
+
+    char*  manifest_line      = NULL;
+    size_t manifest_line_size = 0;
+    const char* filename;
+    int fd_unused;
+    while( NULL != (filename = next_image(&manifest_line, &manifest_line_size, &fd_unused)) )
+    {
+        auto it = blocks.find(std::string(filename));
+        if(it == blocks.end())
+        {
+            fprintf(stderr, "Missing: '%s' isn't in any shard output\n", filename);
+            printf("## Missing from all shards: '%s'\n", filename);
+            Nmissing++;
+            continue;
+        }
+        fwrite(&shard_data[it->second.ishard][it->second.offset],
+               it->second.size, 1, stdout);
+        it->second.emitted = true;
+    }
+    free(manifest_line);
+
+    for(auto it = blocks.begin(); it != blocks.end(); it++)
+        if(!it->second.emitted)
+        {
+            fprintf(stderr, "Extra: '%s' from '%s' isn't in the input list. Ignoring\n",
+                    it->first.c_str(), shard_filenames[it->second.ishard]);
+            Nextra++;
+        }
+
+    for(int ishard=0; ishard<Nshards; ishard++)
+        if(shard_data[ishard] != NULL)
+            munmap((void*)shard_data[ishard], shard_size[ishard]);
+
+    if(Nmissing || Nduplicates || Nextra || ctx.Nrepeated)
+    {
+        fprintf(stderr, "Merge incomplete: %d missing, %d duplicated, %d extra images. %d repeated in the input\n",
+                Nmissing, Nduplicates, Nextra, ctx.Nrepeated);
+        return 1;
+    }
+    return 0;
+}
+
+// Reads the whole file into memory, and closes the fd
+static bool read_fd(std::vector<uint8_t>* data, int fd)
+{
+    bool result = false;
+    struct stat sb;
+    if( fstat(fd, &sb) == 0 )
+    {
+        data->resize(sb.st_size);
+        size_t Nread = 0;
+        while(Nread < data->size())
+        {
+            ssize_t n = read(fd, &(*data)[Nread], data->size() - Nread);
+            if(n < 0 && errno == EINTR)
+                continue;
+            if(n <= 0)
+                break;
+            Nread += n;
+        }
+        result = (Nread == data->size());
+    }
+    close(fd);
+    return result;
+}
+
+static bool read_file(std::vector<uint8_t>* data, const char* filename)
+{
+    FILE* fp = fopen(filename, "rb");
+    if(fp == NULL)
+        return false;
+
+    bool result = false;
+    if( 0 == fseek(fp, 0, SEEK_END) )
+    {
+        long size = ftell(fp);
+        if( size >= 0 && 0 == fseek(fp, 0, SEEK_SET) )
+        {
+            data->resize(size);
+            result = (size == 0 || 1 == fread(data->data(), size, 1, fp));
+        }
+    }
+    fclose(fp);
+    return result;
+}
+
+// Cache entries are a fixed header followed by the points: N (x,y) doubles,
+// then N int8 levels
+struct cache_entry_header_t
+{
+    char    magic[4];
+    int32_t found_pyramid_level;
+    int32_t N;
+};
+#define CACHE_ENTRY_MAGIC "MRG1"
+
+static void cache_store(hash128_t key,
+                        bool                            result,
+                        const std::vector<PointDouble>& points_out,
+                        const signed char*              refinement_level,
+                        int                             found_pyramid_level)
+{
+    // A board found at level 0 isn't refined, and refinement_level may hold
+    // the levels of an earlier image
+    if(found_pyramid_level <= 0)
+        refinement_level = NULL;
+
+    const int N = result ? (int)points_out.size() : 0;
+
+    std::vector<uint8_t> entry(sizeof(cache_entry_header_t) +
+                               N*(2*sizeof(double) + 1));
+
+    cache_entry_header_t* header = (cache_entry_header_t*)entry.data();
+    memcpy(header->magic, CACHE_ENTRY_MAGIC, 4);
+    header->found_pyramid_level = result ? found_pyramid_level : -1;
+    header->N                   = N;
+
+    uint8_t* xy    = &entry[sizeof(cache_entry_header_t)];
+    uint8_t* level = &xy[N*2*sizeof(double)];
+    for(int i=0; i<N; i++)
+    {
+        memcpy(&xy[(2*i+0)*sizeof(double)], &points_out[i].x, sizeof(double));
+        memcpy(&xy[(2*i+1)*sizeof(double)], &points_out[i].y, sizeof(double));
+        level[i] = (uint8_t)((refinement_level == NULL) ? found_pyramid_level : refinement_level[i]);
+    }
+
+    if(!disk_cache_put(&ctx.cache, key, entry.data(), entry.size()))
+        fprintf(stderr, "Warning: couldn't write to the cache in '%s'\n", ctx.cache.dir);
+}
+
+// Returns true if this was a valid cache entry, and I reported its contents
+static bool cache_output(const char* filename, const std::vector<uint8_t>& entry)
+{
+    if( entry.size() < sizeof(cache_entry_header_t) )
+        return false;
+
+    cache_entry_header_t header;
+    memcpy(&header, entry.data(), sizeof(header));
+    if( 0 != memcmp(header.magic, CACHE_ENTRY_MAGIC, 4) ||
+        header.N < 0 ||
+        entry.size() != sizeof(cache_entry_header_t) + header.N*(2*sizeof(double) + 1) )
+        return false;
+
+    std::vector<PointDouble> points_out(header.N);
+    std::vector<signed char> level     (header.N);
+    const uint8_t* xy = &entry[sizeof(cache_entry_header_t)];
+    for(int i=0; i<header.N; i++)
+    {
+        memcpy(&points_out[i].x, &xy[(2*i+0)*sizeof(double)], sizeof(double));
+        memcpy(&points_out[i].y, &xy[(2*i+1)*sizeof(double)], sizeof(double));
+        level[i] = (signed char)xy[2*header.N*sizeof(double) + i];
+    }
+
+    output_result(filename, header.found_pyramid_level >= 0,
+                  points_out, level.data(), header.found_pyramid_level);
+    return true;
+}
+
+// --decoded-cache: the decoded grayscale images are stored as binary PGMs, which
+// later runs mmap() instead of decoding the original again. This is useful when
+// sweeping the detection parameters over a dataset: the result cache misses
+// each time, but the decoding is done once. The key is the canonical path, the
+// size and the mtime of the image file, so the file contents needn't be read to
+// find the entry
+// The mtime of a file, with whatever resolution the platform has. POSIX
+// calls it st_mtim; macOS calls it st_mtimespec
+static struct timespec stat_mtime(const struct stat* sb)
+{
+#if defined(__APPLE__)
+    return sb->st_mtimespec;
+#else
+    return sb->st_mtim;
+#endif
+}
+
+static bool decoded_cache_key(hash128_t* key, const char* filename)
+{
+    char path[PATH_MAX];
+    struct stat sb;
+    if( realpath(filename, path) == NULL ||
+        stat(path, &sb) != 0 )
+        return false;
+
+    const struct timespec mtime = stat_mtime(&sb);
+    const int64_t meta[] = { (int64_t)sb.st_size,
+                             (int64_t)mtime.tv_sec,
+                             (int64_t)mtime.tv_nsec };
+    const char seed[] = "mrgingham decoded-image cache. version=1";
+    *key = hash128(seed, sizeof(seed)-1);
+    *key = hash128(path, strlen(path), *key);
+    *key = hash128(meta, sizeof(meta), *key);
+    return true;
+}
+
+static void decoded_cache_store(hash128_t key, const cv::Mat& image)
+{
+    char header[64];
+    int  Nheader = snprintf(header, sizeof(header), "P5\n%d %d\n255\n",
+                            image.cols, image.rows);
+
+    std::vector<uint8_t> entry(Nheader + (size_t)image.cols*image.rows);
+    memcpy(entry.data(), header, Nheader);
+    for(int y=0; y<image.rows; y++)
+        memcpy(&entry[Nheader + (size_t)y*image.cols], image.ptr(y), image.cols);
+
+    if(!disk_cache_put(&ctx.decoded_cache, key, entry.data(), entry.size()))
+        fprintf(stderr, "Warning: couldn't write to the cache in '%s'\n", ctx.decoded_cache.dir);
+}
+
+// Loads an 8-bit grayscale image. If file_data is non-NULL, it contains the
+// file, and I decode it from there. Otherwise I read the file. PGMs are mmap-ed
+// and used in place; with --decoded-cache, so are images decoded in a previous
+// run. *mapped holds that mapping; the caller must mapped_image_close() it once
+// it's done with the image
+static cv::Mat load_image(mapped_image_t*             mapped,
+                          const char*                 filename,
+                          const std::vector<uint8_t>* file_data)
+{
+    if(file_data == NULL && mapped_image_open(mapped, filename))
+        return mapped->image;
+
+    hash128_t decoded_key;
+    const bool cacheable =
+        ctx.dodecodedcache && decoded_cache_key(&decoded_key, filename);
+    if(cacheable)
+    {
+        // An entry could be evicted before I open it. Then I just decode
+        char path[1100];
+        if( disk_cache_get_path(&ctx.decoded_cache, decoded_key, path, sizeof(path)) &&
+            mapped_image_open(mapped, path) )
+            return mapped->image;
+    }
+
+    cv::Mat image;
+    if(file_data == NULL)
+        image = cv::imread(filename,
+                           cv::IMREAD_IGNORE_ORIENTATION |
+                           cv::IMREAD_GRAYSCALE);
+    else if(!file_data->empty())
+        image = cv::imdecode(cv::Mat(1, (int)file_data->size(), CV_8UC1,
+                                     (void*)file_data->data()),
+                             cv::IMREAD_IGNORE_ORIENTATION |
+                             cv::IMREAD_GRAYSCALE);
+
+    if(cacheable && image.data != NULL)
+        decoded_cache_store(decoded_key, image);
+    return image;
+}
+
+// The image preprocessing applied before the detection. The CLAHE object is
+// created on first use, and reused for all the images processed by this thread
+static void preprocess_image(cv::Mat&            image,
+                             cv::Ptr<cv::CLAHE>& clahe,
+                             bool                doclahe,
+                             int                 blur_radius)
+{
+    if( doclahe )
+    {
+        if(clahe.empty())
+        {
+            clahe = cv::createCLAHE();
+            clahe->setClipLimit(8);
+        }
+
+        // CLAHE doesn't by itself use the full dynamic range all the time.
+        // I explicitly apply histogram equalization and then CLAHE
+        cv::equalizeHist(image, image);
+        clahe->apply(image, image);
+    }
+    if( blur_radius > 0 )
+    {
+        cv::blur( image, image,
+                  cv::Size(1 + 2*blur_radius,
+                           1 + 2*blur_radius));
+    }
+}
+
+// Whether the library needs to see these options, or if the defaults would do
+// the same thing. The CLAHE and blur are the library's only with
+// --pyramid-preprocess; otherwise I apply them myself
+static bool need_library_options(const library_options_t* options)
+{
+    const search_options_t* search = &options->search;
+    return
+        ctx.pyramid_preprocess       ||
+        search->tile_mask            ||
+        search->parallel_levels      ||
+        search->time_budget_ms > 0   ||
+        search->refinement != REFINEMENT_PYRAMID ||
+        search->prefilter_threshold > 0 ||
+        search->level_policy != NULL ||
+        search->frame_cache  != NULL;
+}
+
+// The library_options_t to pass to detect(), or NULL if the defaults will do
+static const library_options_t* library_options(void)
+{
+    if(!ctx.adaptive_level && ctx.incremental_threshold <= 0)
+        return need_library_options(&ctx.library) ? &ctx.library : NULL;
+
+    // The level policy learns from the images each worker sees, and the frame
+    // cache holds the previous one, so each thread has its own
+    static thread_local level_policy_t    level_policy;
+    static thread_local frame_cache_t     frame_cache;
+    static thread_local library_options_t options;
+    options = ctx.library;
+    if(ctx.adaptive_level)
+        options.search.level_policy = &level_policy;
+    if(ctx.incremental_threshold > 0)
+    {
+        frame_cache.change_threshold = ctx.incremental_threshold;
+        options.search.frame_cache   = &frame_cache;
+    }
+    return &options;
+}
+
+// Finds the chessboard (or the circle grid). Returns the pyramid level where
+// the board was found or <0 on failure. *refinement_level is a realloc()-ed
+// buffer owned by the caller; it's filled in only if do_refine && !doblobs. If
+// options is non-NULL, it's passed on to the library. If options->preprocess
+// asks for CLAHE or blur, the library preprocesses each pyramid level with it;
+// the caller then shouldn't preprocess the image itself
+static int detect(std::vector<PointDouble>& points_out,
+                  signed char**             refinement_level,
+                  const cv::Mat&            image,
+                  bool                      doblobs,
+                  bool                      do_refine,
+                  int                       gridn,
+                  int                       image_pyramid_level,
+                  const library_options_t*  options,
+                  bool                      debug,
+                  debug_sequence_t          debug_sequence,
+                  const char*               filename)
+{
+    if(doblobs)
+    {
+        // image_pyramid_level == 0 here. The cmdline parser makes sure
+        return
+            find_circle_grid_from_image_array(points_out,
+                                              image, gridn,
+                                              debug, debug_sequence) ?
+            0 : -1;
+    }
+
+    if(options != NULL && options->search.time_budget_ms > 0)
+    {
+        // I want to say which images ran out of time
+        search_stats_t   stats;
+        search_options_t search = options->search;
+        search.stats = &stats;
+
+        int result =
+            find_chessboard_from_image_array (points_out,
+                                              do_refine ? refinement_level : NULL,
+                                              gridn,
+                                              image,
+                                              options->preprocess,
+                                              search,
+                                              image_pyramid_level,
+                                              debug, debug_sequence,
+                                              filename);
+        if(stats.timed_out)
+            fprintf(stderr, "%s: ran out of the time budget (%.1fms) at pyramid level %d%s\n",
+                    filename, stats.elapsed_ms, stats.level_timed_out,
+                    result >= 0 ? " while refining; the corners are only partially refined" : "");
+        return result;
+    }
+
+    if(options != NULL)
+        return
+            find_chessboard_from_image_array (points_out,
+                                              do_refine ? refinement_level : NULL,
+                                              gridn,
+                                              image,
+                                              options->preprocess,
+                                              options->search,
+                                              image_pyramid_level,
+                                              debug, debug_sequence,
+                                              filename);
+    return
+        find_chessboard_from_image_array (points_out,
+                                          do_refine ? refinement_level : NULL,
+                                          gridn,
+                                          image,
+                                          image_pyramid_level,
+                                          debug, debug_sequence,
+                                          filename);
+}
+
+// --sweep parameter sets look like "clahe=0,blur=2,level=1". The parameters
+// not given take the values from the commandline
+static bool parse_sweep_config(sweep_config_t* config, const char* spec)
+{
+    const char* s = spec;
+    while(*s != '\0')
+    {
+        char key[16];
+        int  value, len;
+        if( 2 != sscanf(s, "%15[a-z]=%d%n", key, &value, &len) ||
+            (s[len] != ',' && s[len] != '\0') )
+        {
+            fprintf(stderr, "Couldn't parse --sweep '%s'. Expected a list such as 'clahe=0,blur=2,level=1,gridn=10,refine=1'\n",
+                    spec);
+            return false;
+        }
+
+        if     (0 == strcmp(key, "gridn"))  config->gridn               = value;
+        else if(0 == strcmp(key, "clahe"))  config->doclahe             = value != 0;
+        else if(0 == strcmp(key, "blur"))   config->blur_radius         = value;
+        else if(0 == strcmp(key, "level"))  config->image_pyramid_level = value;
+        else if(0 == strcmp(key, "refine")) config->do_refine           = value != 0;
+        else
+        {
+            fprintf(stderr, "Unknown --sweep parameter '%s' in '%s'. Known: gridn,clahe,blur,level,refine\n",
+                    key, spec);
+            return false;
+        }
+
+        s += len;
+        if(*s == ',') s++;
+    }
+
+    if(config->gridn < 2)
+    {
+        fprintf(stderr, "--sweep '%s': gridn must be >= 2\n", spec);
+        return false;
+    }
+    return true;
+}
+
+static void output_sweep_result(const char*                     filename,
+                                int                             iconfig,
+                                bool                            result,
+                                const std::vector<PointDouble>& points_out,
+                                const signed char*              refinement_level,
+                                int                             found_pyramid_level)
+{
+    flockfile(stdout);
+    {
+        if( result )
+        {
+            for(int i=0; i<(int)points_out.size(); i++)
+                printf( "%s %d %f %f %d\n", filename, iconfig,
+                        points_out[i].x,
+                        points_out[i].y,
+                        (refinement_level == NULL) ? found_pyramid_level : (int)refinement_level[i]);
+        }
+        else if(iconfig >= 0)
+            printf("%s %d - - -\n", filename, iconfig);
+        else
+            printf("%s - - - -\n", filename);
+        if(ctx.flush_each_result)
+            fflush(stdout);
+    }
+    funlockfile(stdout);
+}
+
+// Runs each --sweep parameter set on the decoded image. The configs with the
+// same CLAHE and blur settings share the preprocessed image. Each result is
+// tagged with the index of its config. With --sweep-first I stop at the first
+// config that finds the board, and if none do, I report one failure, with no
+// config. With --adaptive-level each config learns its own level policy: they
+// search with different settings, so the levels that work for one don't
+// necessarily work for another
+static void sweep(const char*         filename,
+                  const cv::Mat&      image,
+                  signed char**       refinement_level,
+                  cv::Ptr<cv::CLAHE>& clahe)
+{
+    struct preprocessed_t
+    {
+        bool    doclahe;
+        int     blur_radius;
+        cv::Mat image;
+    };
+    std::vector<preprocessed_t> preprocessed;
+
+    for(int iconfig=0; iconfig<(int)ctx.sweep.size(); iconfig++)
+    {
+        const sweep_config_t& config = ctx.sweep[iconfig];
+
+        // With --pyramid-preprocess the library does the preprocessing, so
+        // there's nothing to share
+        library_options_t options = ctx.library;
+        options.preprocess.doclahe     = ctx.pyramid_preprocess && config.doclahe;
+        options.preprocess.blur_radius = ctx.pyramid_preprocess ? config.blur_radius : 0;
+        if(ctx.adaptive_level)
+        {
+            static thread_local std::vector<level_policy_t> level_policies;
+            level_policies.resize(ctx.sweep.size());
+            options.search.level_policy = &level_policies[iconfig];
+        }
+
+        const cv::Mat* image_preprocessed = ctx.pyramid_preprocess ? &image : NULL;
+        for(const preprocessed_t& p : preprocessed)
+            if( p.doclahe     == config.doclahe &&
+                p.blur_radius == config.blur_radius )
+            {
+                image_preprocessed = &p.image;
+                break;
+            }
+        if(image_preprocessed == NULL)
+        {
+            // preprocess_image() works in place. If it does nothing, I use the
+            // decoded image as is
+            preprocessed.push_back(preprocessed_t{config.doclahe, config.blur_radius,
+                                                  (config.doclahe || config.blur_radius > 0) ?
+                                                  image.clone() : image});
+            preprocess_image(preprocessed.back().image, clahe,
+                             config.doclahe, config.blur_radius);
+            image_preprocessed = &preprocessed.back().image;
+        }
+
+        std::vector<PointDouble> points_out;
+        int found_pyramid_level =
+            detect(points_out, refinement_level, *image_preprocessed,
+                   false, config.do_refine, config.gridn, config.image_pyramid_level,
+                   need_library_options(&options) ? &options : NULL,
+                   ctx.debug, ctx.debug_sequence, filename);
+        bool result = (found_pyramid_level >= 0);
+
+        // A board found at level 0 isn't refined, and *refinement_level isn't
+        // touched. It could then hold the levels from a previous config
+        if(result || !ctx.sweep_first)
+            output_sweep_result(filename, iconfig, result, points_out,
+                                (config.do_refine && found_pyramid_level > 0) ?
+                                *refinement_level : NULL,
+                                found_pyramid_level);
+        if(result && ctx.sweep_first)
+            return;
+    }
+
+    if(ctx.sweep_first)
+        output_sweep_result(filename, -1, false, std::vector<PointDouble>(), NULL, -1);
+}
+
+static void* worker( void* _ijob )
+{
+    // Worker thread. Processes images from the glob or the manifest. Writes
+    // point detections back out on the other end.
+
+    cv::Ptr<cv::CLAHE> clahe;
+
+    // The buffers. I'll realloc() these as I go. MUST free at the end
+    signed char* refinement_level = NULL;
+    char*        manifest_line    = NULL;
+    size_t       manifest_line_size = 0;
+
+    const char* filename;
+    std::vector<uint8_t> file_data, cache_entry;
+
+    int fd = -1;
+    while( NULL != (filename =
+                    ctx.dotar ?
+                    next_tar_member(&manifest_line, &manifest_line_size, &file_data) :
+                    next_image     (&manifest_line, &manifest_line_size, &fd)) )
+    {
+        cv::Mat        image;
+        hash128_t      cache_key;
+        mapped_image_t mapped = {};
+
+        if(!ctx.docache && !ctx.dotar)
+        {
+            // A prefetched file is now in the page cache. I don't read it
+            // here: load_image() first tries to mmap a PGM and to look up the
+            // --decoded-cache, neither of which reads the whole file
+            if(fd >= 0)
+                close(fd);
+            image = load_image(&mapped, filename, NULL);
+        }
+        else if(ctx.dotar ||
+                (ctx.prefetch > 0 ?
+                 (fd >= 0 && read_fd(&file_data, fd)) :
+                 read_file(&file_data, filename)))
+        {
+            // I'm caching or reading from an archive. I have the file contents
+            // in memory, and I decode from there. If caching, the contents are
+            // the key, and I decode only on a miss
+            if(ctx.docache)
+            {
+                cache_key = hash128(file_data.data(), file_data.size(),
+                                    ctx.cache_key_seed);
+                if( disk_cache_get(&ctx.cache, cache_key, &cache_entry) &&
+                    cache_output(filename, cache_entry) )
+                    continue;
+            }
+
+            image = load_image(&mapped, filename, &file_data);
+        }
+
+        if( image.data == NULL )
+        {
+            fprintf(stderr, "Couldn't open image '%s'\n", filename);
+            if(ctx.output_format == OUTPUT_VNLOG)
+            {
+                flockfile(stdout);
+                {
+                    printf("## Couldn't open image '%s'\n", filename);
+                    printf(ctx.sweep.empty() ? "%s - - -\n" : "%s - - - -\n", filename);
+                }
+                funlockfile(stdout);
+            }
+            else
+                output_result(filename, false, std::vector<PointDouble>(), NULL, -1);
+            continue;
+        }
+
+        if(!ctx.sweep.empty())
+        {
+            sweep(filename, image, &refinement_level, clahe);
+            image.release();
+            mapped_image_close(&mapped);
+            continue;
+        }
+
+        if(!ctx.pyramid_preprocess)
+            preprocess_image(image, clahe, ctx.doclahe, ctx.blur_radius);
+
+        if( ctx.debug )
+        {
+            do
+            {
+                char basename[1024];
+
+                const char* last_slash = strrchr(filename, '/');
+                const char* basename_start = last_slash ? &last_slash[1] : filename;
+
+                char* basename_start_end = stpncpy(basename, basename_start, sizeof(basename));
+                if(&basename[sizeof(basename)] == basename_start_end)
+                {
+                    fprintf(stderr, "--debug file dump overran filename buffer! Not dumping files\n");
+                    break;
+                }
+
+                // basename is now just the FILENAME with no directory. It still has
+                // an extension
+                char* last_dot = strrchr(basename, '.');
+                if(last_dot)
+                    *last_dot = '\0';
+
+                char filename_out[1024];
+                if(snprintf(filename_out, sizeof(filename_out),
+                            "/tmp/%s_preprocessed.png",
+                            basename) >= (int)sizeof(filename_out))
+                {
+                    fprintf(stderr, "--debug file dump overran filename buffer! Not dumping files\n");
+                    break;
+                }
+
+                cv::imwrite(filename_out, image);
+                fprintf(stderr, "Wrote preprocessed image to %s\n", filename_out);
+
+            } while(0);
+        }
+        std::vector<PointDouble> points_out;
+        // need this because ctx.image_pyramid_level could be -1
+        int found_pyramid_level =
+            detect(points_out, &refinement_level, image,
+                   ctx.doblobs, ctx.do_refine, ctx.gridn, ctx.image_pyramid_level,
+                   library_options(),
+                   ctx.debug, ctx.debug_sequence, filename);
+        bool result = (found_pyramid_level >= 0);
+
+        image.release();
+        mapped_image_close(&mapped);
+
+        output_result(filename, result, points_out,
+                      refinement_level, found_pyramid_level);
+        if(ctx.docache)
+            cache_store(cache_key, result, points_out,
+                        refinement_level, found_pyramid_level);
+    }
+
+    free(refinement_level);
+    free(manifest_line);
+
+    return NULL;
+}
+
+// --server: I stay resident, and process requests coming in over a Unix socket.
+// This avoids paying the process startup and the thread creation for each
+// image. Each of the Njobs threads accept()s connections on the shared
+// listening socket, and serves the requests on that connection until the
+// client closes it. The threads keep their buffers between requests. The
+// protocol is described in server_protocol.hh
+static const char* server_socket_path = NULL;
+static void server_exit(int sig)
+{
+    unlink(server_socket_path);
+    _exit(0);
+}
+
+static bool server_reply(int fd, int status,
+                         const std::vector<PointDouble>& points_out,
+                         const signed char*              refinement_level)
+{
+    const int N = (status >= 0) ? (int)points_out.size() : 0;
+
+    server_reply_t reply = {};
+    memcpy(reply.magic, SERVER_REPLY_MAGIC, 4);
+    reply.status = status;
+    reply.N      = N;
+
+    std::vector<server_reply_point_t> points(N);
+    for(int i=0; i<N; i++)
+    {
+        points[i].x        = points_out[i].x;
+        points[i].y        = points_out[i].y;
+        points[i].level    = (refinement_level == NULL) ? status : (int)refinement_level[i];
+        points[i].reserved = 0;
+    }
+
+    return
+        server_write_all(fd, &reply, sizeof(reply)) &&
+        server_write_all(fd, points.data(), N*sizeof(points[0]));
+}
+
+static void server_serve_connection(int fd,
+                                    cv::Ptr<cv::CLAHE>&   clahe,
+                                    signed char**         refinement_level,
+                                    std::vector<uint8_t>& payload)
+{
+    server_request_t request;
+    while(server_read_all(fd, &request, sizeof(request)))
+    {
+        if( 0 != memcmp(request.magic, SERVER_REQUEST_MAGIC, 4) ||
+            request.payload_size > SERVER_MAX_PAYLOAD_SIZE      ||
+            request.gridn < 2 || request.gridn > SERVER_MAX_GRIDN ||
+            ( (request.flags & SERVER_FLAG_BLOBS) && request.image_pyramid_level >= 0) ||
+            ( request.source == SERVER_SOURCE_RAW &&
+              (uint64_t)request.width*request.height != request.payload_size ) )
+        {
+            fprintf(stderr, "Got a malformed request. Closing the connection\n");
+            return;
+        }
+
+        // Like the CLI, I read any negative level as "search the levels", and
+        // any blur_radius <= 0 as "no blur". The large values are clamped: the
+        // request is untrusted
+        if(request.image_pyramid_level < 0)
+            request.image_pyramid_level = -1;
+        else if(request.image_pyramid_level > SERVER_MAX_PYRAMID_LEVEL)
+            request.image_pyramid_level = SERVER_MAX_PYRAMID_LEVEL;
+        if(request.blur_radius < 0)
+            request.blur_radius = 0;
+        else if(request.blur_radius > SERVER_MAX_BLUR_RADIUS)
+            request.blur_radius = SERVER_MAX_BLUR_RADIUS;
+
+        // One extra byte for the '\0' of SERVER_SOURCE_PATH
+        payload.resize(request.payload_size + 1);
+        if(!server_read_all(fd, payload.data(), request.payload_size))
+            return;
+        payload[request.payload_size] = '\0';
+
+        if( request.source != SERVER_SOURCE_PATH    &&
+            request.source != SERVER_SOURCE_ENCODED &&
+            request.source != SERVER_SOURCE_RAW )
+        {
+            fprintf(stderr, "Got a request with unknown source %u. Closing the connection\n",
+                    request.source);
+            return;
+        }
+
+        cv::Mat image;
+        const char* filename = "server-request";
+        std::vector<PointDouble> points_out;
+        int status;
+
+        // OpenCV throws on some corrupt images, and the payload is untrusted. A
+        // throw here would take down the whole server, so I catch it, and
+        // report a bad image
+        try
+        {
+            switch(request.source)
+            {
+            case SERVER_SOURCE_PATH:
+                filename = (const char*)payload.data();
+                image = cv::imread(filename,
+                                   cv::IMREAD_IGNORE_ORIENTATION |
+                                   cv::IMREAD_GRAYSCALE);
+                break;
+            case SERVER_SOURCE_ENCODED:
+                image = cv::imdecode(cv::Mat(1, (int)request.payload_size, CV_8UC1, payload.data()),
+                                     cv::IMREAD_IGNORE_ORIENTATION |
+                                     cv::IMREAD_GRAYSCALE);
+                break;
+            case SERVER_SOURCE_RAW:
+                // No copy. The preprocessing writes into the payload buffer,
+                // which is fine: I don't need it afterwards
+                image = cv::Mat((int)request.height, (int)request.width, CV_8UC1, payload.data());
+                break;
+            }
+
+            if( image.data == NULL || image.total() == 0 )
+            {
+                fprintf(stderr, "Couldn't decode the image in a request from '%s'\n", filename);
+                status = SERVER_STATUS_BADIMAGE;
+            }
+            else
+            {
+                preprocess_image(image, clahe,
+                                 !(request.flags & SERVER_FLAG_NOCLAHE),
+                                 request.blur_radius);
+
+                debug_sequence_t debug_sequence;
+                status = detect(points_out, refinement_level, image,
+                                request.flags & SERVER_FLAG_BLOBS,
+                                !(request.flags & SERVER_FLAG_NOREFINE),
+                                request.gridn, request.image_pyramid_level,
+                                NULL,
+                                false, debug_sequence, filename);
+                if(status < 0)
+                    status = SERVER_STATUS_NOTFOUND;
+            }
+        }
+        catch(const cv::Exception& e)
+        {
+            fprintf(stderr, "OpenCV failed on the image in a request from '%s': %s\n",
+                    filename, e.what());
+            points_out.clear();
+            status = SERVER_STATUS_BADIMAGE;
+        }
+
+        // A board found at level 0 isn't refined, and *refinement_level isn't
+        // touched: it holds the levels of an earlier request, possibly with a
+        // smaller gridn
+        if(!server_reply(fd, status, points_out,
+                         (status <= 0 ||
+                          (request.flags & (SERVER_FLAG_NOREFINE | SERVER_FLAG_BLOBS))) ?
+                         NULL : *refinement_level))
+            return;
+    }
+}
+
+static void* server_worker( void* _fd_listen )
+{
+    const int fd_listen = (int)(intptr_t)_fd_listen;
+
+    // These persist across all the requests this thread serves
+    cv::Ptr<cv::CLAHE>   clahe;
+    signed char*         refinement_level = NULL;
+    std::vector<uint8_t> payload;
+
+    while(true)
+    {
+        int fd = accept(fd_listen, NULL, NULL);
+        if(fd < 0)
+        {
+            if(errno == EINTR || errno == ECONNABORTED)
+                continue;
+            fprintf(stderr, "accept() failed: %s\n", strerror(errno));
+            break;
+        }
+        server_serve_connection(fd, clahe, &refinement_level, payload);
+        close(fd);
+    }
+
+    free(refinement_level);
+    return NULL;
+}
+
+static int run_server(const char* socket_path, int Njobs)
+{
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if( strlen(socket_path) >= sizeof(addr.sun_path) )
+    {
+        fprintf(stderr, "Socket path '%s' is too long\n", socket_path);
+        return 1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd_listen = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd_listen < 0)
+    {
+        fprintf(stderr, "Couldn't create socket: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // A socket left over from a previous server that didn't clean up would
+    // make the bind() fail. If nobody is listening on it, I remove it
+    int fd_probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool in_use  =
+        fd_probe >= 0 &&
+        connect(fd_probe, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+    if(fd_probe >= 0)
+        close(fd_probe);
+    if(in_use)
+    {
+        fprintf(stderr, "Another server is already listening on '%s'\n", socket_path);
+        close(fd_listen);
+        return 1;
+    }
+    unlink(socket_path);
+
+    if( bind(fd_listen, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+        listen(fd_listen, 64) != 0 )
+    {
+        fprintf(stderr, "Couldn't listen on '%s': %s\n", socket_path, strerror(errno));
+        close(fd_listen);
+        return 1;
+    }
+
+    server_socket_path = socket_path;
+    signal(SIGINT,  server_exit);
+    signal(SIGTERM, server_exit);
+
+    fprintf(stderr, "Listening on '%s' with %d worker threads\n", socket_path, Njobs);
+
+    pthread_t thread[Njobs];
+    for(int i=0; i<Njobs; i++)
+        pthread_create(&thread[i], NULL, &server_worker, (void*)(intptr_t)fd_listen);
+    for(int i=0; i<Njobs; i++)
+        pthread_join(thread[i], NULL);
+
+    close(fd_listen);
+    unlink(socket_path);
+    return 1;
+}
+
+// --frames: parses the Y4M stream header from stdin. This is a line such as
+//
+//   YUV4MPEG2 W1920 H1080 F30:1 Ip A1:1 C420jpeg
+//
+// I need the size and the colorspace. I use the luma plane only, so I figure
+// out how many chroma bytes follow it in each frame
+static bool read_y4m_header(void)
+{
+    char header[1024];
+    if( NULL == fgets(header, sizeof(header), stdin) ||
+        0 != strncmp(header, "YUV4MPEG2 ", 10) )
+    {
+        fprintf(stderr, "--frames y4m: stdin doesn't start with a YUV4MPEG2 header\n");
+        return false;
+    }
+
+    int         width = 0, height = 0;
+    const char* colorspace = "420";
+    char*       saveptr;
+    for(char* token = strtok_r(&header[10], " \n", &saveptr);
+        token != NULL;
+        token = strtok_r(NULL, " \n", &saveptr))
+    {
+        if     (token[0] == 'W') width      = atoi(&token[1]);
+        else if(token[0] == 'H') height     = atoi(&token[1]);
+        else if(token[0] == 'C') colorspace = &token[1];
+    }
+    if(width <= 0 || height <= 0)
+    {
+        fprintf(stderr, "--frames y4m: the header has no valid W,H\n");
+        return false;
+    }
+
+    // Higher bit depths are denoted by suffixes such as "420p10" and "mono16".
+    // "mono16" is rejected below
+    bool is_8bit = true;
+    for(const char* c = colorspace; *c; c++)
+        if(c[0] == 'p' && c[1] >= '0' && c[1] <= '9')
+            is_8bit = false;
+
+    const size_t cw2 = (width +1)/2, ch2 = (height+1)/2, cw4 = (width+3)/4;
+    size_t skip;
+    if(!is_8bit)
+        skip = (size_t)-1;
+    else if(0 == strcmp (colorspace, "mono"))
+        skip = 0;
+    else if(0 == strncmp(colorspace, "420",  3))
+        // 420jpeg, 420mpeg2, 420paldv all have the same layout
+        skip = 2*cw2*ch2;
+    else if(0 == strcmp (colorspace, "422"))
+        skip = 2*cw2*height;
+    else if(0 == strcmp (colorspace, "411"))
+        skip = 2*cw4*height;
+    else if(0 == strcmp (colorspace, "444"))
+        skip = 2*(size_t)width*height;
+    else if(0 == strcmp (colorspace, "444alpha"))
+        skip = 3*(size_t)width*height;
+    else
+        skip = (size_t)-1;
+
+    if(skip == (size_t)-1)
+    {
+        fprintf(stderr, "--frames y4m: unsupported colorspace 'C%s'. Only 8-bit data is supported\n",
+                colorspace);
+        return false;
+    }
+
+    ctx.frames_width     = width;
+    ctx.frames_height    = height;
+    ctx.frames_skip_size = skip;
+    return true;
+}
+
+// Reads the next frame from stdin into *image. Returns the index of this frame,
+// or -1 at the end of the stream. May be called from any thread
+static int64_t next_frame(cv::Mat* image, std::vector<uint8_t>* skip)
+{
+    int64_t index = -1;
+
+    pthread_mutex_lock(&ctx.job_mutex);
+    do
+    {
+        if(ctx.frames_y4m)
+        {
+            // Each frame is preceded by a "FRAME" line, possibly with
+            // parameters that I ignore
+            char frame_header[256];
+            if( NULL == fgets(frame_header, sizeof(frame_header), stdin) )
+                break;
+            if( 0 != strncmp(frame_header, "FRAME", 5) ||
+                strchr(frame_header, '\n') == NULL )
+            {
+                fprintf(stderr, "--frames y4m: invalid frame header after frame %llu. Stopping\n",
+                        (unsigned long long)ctx.frames_next_read);
+                break;
+            }
+        }
 
-using namespace mrgingham;
+        image->create(ctx.frames_height, ctx.frames_width, CV_8UC1);
+        skip->resize(ctx.frames_skip_size);
+        size_t Nread = fread(image->data, 1, image->total(), stdin);
+        if( Nread == 0 && !ctx.frames_y4m )
+            break;
+        if( Nread != image->total() ||
+            (ctx.frames_skip_size > 0 &&
+             1 != fread(skip->data(), ctx.frames_skip_size, 1, stdin)) )
+        {
+            fprintf(stderr, "--frames: truncated frame %llu. Stopping\n",
+                    (unsigned long long)ctx.frames_next_read);
+            break;
+        }
+        index = (int64_t)ctx.frames_next_read++;
+    } while(0);
+    pthread_mutex_unlock(&ctx.job_mutex);
 
-struct mrgingham_thread_context_t
+    return index;
+}
+
+static void* frames_worker( void* _ijob )
 {
-    const glob_t* _glob;
-    int           Njobs;
-    bool          doclahe;
-    int           blur_radius;
-    bool          doblobs;
-    bool          do_refine;
-    int           gridn;
-    bool          debug;
-    debug_sequence_t debug_sequence;
-    int           image_pyramid_level;
-} ctx;
+    cv::Ptr<cv::CLAHE>   clahe;
+    signed char*         refinement_level = NULL;
+    cv::Mat              image;
+    std::vector<uint8_t> skip;
 
-static void* worker( void* _ijob )
+    int64_t index;
+    while( (index = next_frame(&image, &skip)) >= 0 )
+    {
+        char filename[32];
+        snprintf(filename, sizeof(filename), "frame%06lld", (long long)index);
+
+        if(!ctx.pyramid_preprocess)
+            preprocess_image(image, clahe, ctx.doclahe, ctx.blur_radius);
+
+        std::vector<PointDouble> points_out;
+        int found_pyramid_level =
+            detect(points_out, &refinement_level, image,
+                   ctx.doblobs, ctx.do_refine, ctx.gridn, ctx.image_pyramid_level,
+                   library_options(),
+                   false, ctx.debug_sequence, filename);
+
+        // In frame order. All the earlier frames were already claimed by other
+        // workers, so this wait always ends
+        pthread_mutex_lock(&ctx.job_mutex);
+        while(ctx.frames_next_output != (uint64_t)index)
+            pthread_cond_wait(&ctx.frames_output_cond, &ctx.job_mutex);
+        pthread_mutex_unlock(&ctx.job_mutex);
+
+        output_result(filename, found_pyramid_level >= 0, points_out,
+                      refinement_level, found_pyramid_level);
+
+        pthread_mutex_lock(&ctx.job_mutex);
+        ctx.frames_next_output++;
+        pthread_cond_broadcast(&ctx.frames_output_cond);
+        pthread_mutex_unlock(&ctx.job_mutex);
+    }
+
+    free(refinement_level);
+    return NULL;
+}
+
+// --video: a decoder must decode a video sequentially from a keyframe. To use
+// all the cores on one long video, I split it into segments, and each worker
+// decodes its segment independently, after seeking to its start. The decoder
+// seeks to the preceding keyframe, and decodes forward from there, so the
+// segments should be long enough to amortize that
+#define VIDEO_SEGMENT_MIN_FRAMES 300
+
+static void plan_video_segments(const glob_t* _glob, int Njobs, int every)
 {
-    // Worker thread. Processes images from the glob. Writes point detections
-    // back out on the other end.
+    for(int i=0; i<(int)_glob->gl_pathc; i++)
+    {
+        const char* path = _glob->gl_pathv[i];
+
+        cv::VideoCapture video(path);
+        if(!video.isOpened())
+        {
+            fprintf(stderr, "Couldn't open video '%s'\n", path);
+            if(ctx.output_format == OUTPUT_VNLOG)
+                printf("## Couldn't open video '%s'\n", path);
+            continue;
+        }
 
-    int ijob = *(int*)(&_ijob);
+        // The frame count comes from the container metadata, and may be
+        // missing or approximate. So the last segment always goes to the end
+        // of the file
+        int64_t Nframes = (int64_t)video.get(cv::CAP_PROP_FRAME_COUNT);
+        int64_t segment_size = (Nframes + 4*Njobs - 1) / (4*Njobs);
+        if(segment_size < VIDEO_SEGMENT_MIN_FRAMES)
+            segment_size = VIDEO_SEGMENT_MIN_FRAMES;
+        // Each segment starts on a frame I process
+        segment_size = (segment_size + every - 1) / every * every;
 
-    cv::Ptr<cv::CLAHE> clahe;
+        int64_t begin = 0;
+        while(begin + segment_size < Nframes)
+        {
+            ctx.video_segments.push_back(video_segment_t{path, begin, begin + segment_size});
+            begin += segment_size;
+        }
+        ctx.video_segments.push_back(video_segment_t{path, begin, INT64_MAX});
+    }
+    ctx.i_video_segment_next = 0;
+}
+
+static bool next_video_segment(video_segment_t* segment)
+{
+    bool result = false;
 
-    if(ctx.doclahe)
+    pthread_mutex_lock(&ctx.job_mutex);
+    if(ctx.i_video_segment_next < ctx.video_segments.size())
     {
-        clahe = cv::createCLAHE();
-        clahe->setClipLimit(8);
+        *segment = ctx.video_segments[ctx.i_video_segment_next++];
+        result   = true;
     }
+    pthread_mutex_unlock(&ctx.job_mutex);
 
-    // The buffer. I'll realloc() this as I go. MUST free at the end
-    signed char* refinement_level = NULL;
+    return result;
+}
+
+// Positions the video at frame "begin". Seeks if the video is somewhere else
+static bool video_seek(cv::VideoCapture* video, int64_t* pos,
+                       const char* path, int64_t begin)
+{
+    if(*pos == begin)
+        return true;
 
-    for(int i_image=ijob; i_image<(int)ctx._glob->gl_pathc; i_image += ctx.Njobs)
+    if( video->set(cv::CAP_PROP_POS_FRAMES, (double)begin) )
     {
-        const char* filename = ctx._glob->gl_pathv[i_image];
+        *pos = begin;
+        return true;
+    }
 
-        cv::Mat image = cv::imread(filename,
-                                   cv::IMREAD_IGNORE_ORIENTATION |
-                                   cv::IMREAD_GRAYSCALE);
-        if( image.data == NULL )
+    // This video isn't seekable. I decode my way there from the start
+    video->release();
+    if(!video->open(path))
+        return false;
+    for(*pos = 0; *pos < begin; (*pos)++)
+        if(!video->grab())
+            return false;
+    return true;
+}
+
+static void* video_worker( void* _ijob )
+{
+    cv::Ptr<cv::CLAHE> clahe;
+    signed char*       refinement_level = NULL;
+
+    // I keep the video open across segments: if I get the next segment of the
+    // same video, I don't need to seek
+    cv::VideoCapture video;
+    const char*      video_path = NULL;
+    int64_t          video_pos  = 0;
+
+    cv::Mat         frame, image;
+    video_segment_t segment;
+    while(next_video_segment(&segment))
+    {
+        if(video_path != segment.path)
         {
-            fprintf(stderr, "Couldn't open image '%s'\n", filename);
-            flockfile(stdout);
+            video.release();
+            video_path = segment.path;
+            video_pos  = 0;
+            if(!video.open(video_path))
             {
-                printf("## Couldn't open image '%s'\n", filename);
-                printf("%s - - -\n", filename);
+                fprintf(stderr, "Couldn't open video '%s'\n", video_path);
+                video_path = NULL;
+                continue;
             }
-            funlockfile(stdout);
-            break;
         }
-
-        if( ctx.doclahe )
+        if(!video_seek(&video, &video_pos, video_path, segment.begin))
         {
-            // CLAHE doesn't by itself use the full dynamic range all the time.
-            // I explicitly apply histogram equalization and then CLAHE
-            cv::equalizeHist(image, image);
-            clahe->apply(image, image);
+            fprintf(stderr, "Couldn't seek to frame %lld in '%s'. Skipping this segment\n",
+                    (long long)segment.begin, video_path);
+            video.release();
+            video_path = NULL;
+            continue;
         }
-        if( ctx.blur_radius > 0 )
+
+        for(; video_pos < segment.end; video_pos++)
         {
-            cv::blur( image, image,
-                      cv::Size(1 + 2*ctx.blur_radius,
-                               1 + 2*ctx.blur_radius));
+            // The frames I skip are grab()-ed but not retrieve()-ed: they are
+            // decoded, but not converted
+            if(!video.grab())
+                break;
+            if(video_pos % ctx.video_every != 0)
+                continue;
+            if(!video.retrieve(frame))
+                break;
+
+            if(frame.channels() == 1)
+                frame.copyTo(image);
+            else
+                cv::cvtColor(frame, image, cv::COLOR_BGR2GRAY);
+
+            char filename[4096];
+            snprintf(filename, sizeof(filename), "%s:%06lld",
+                     video_path, (long long)video_pos);
+
+            if(!ctx.pyramid_preprocess)
+                preprocess_image(image, clahe, ctx.doclahe, ctx.blur_radius);
+
+            std::vector<PointDouble> points_out;
+            int found_pyramid_level =
+                detect(points_out, &refinement_level, image,
+                       ctx.doblobs, ctx.do_refine, ctx.gridn, ctx.image_pyramid_level,
+                       library_options(),
+                       false, ctx.debug_sequence, filename);
+            output_result(filename, found_pyramid_level >= 0, points_out,
+                          refinement_level, found_pyramid_level);
         }
 
-        if( ctx.debug )
+        // If I stopped early (end of file or a decode error), the next segment
+        // must seek
+        if(video_pos < segment.end && segment.end != INT64_MAX)
         {
-            do
-            {
-                char basename[1024];
-
-                const char* last_slash = strrchr(filename, '/');
-                const char* basename_start = last_slash ? &last_slash[1] : filename;
+            video.release();
+            video_path = NULL;
+        }
+    }
 
-                char* basename_start_end = stpncpy(basename, basename_start, sizeof(basename));
-                if(&basename[sizeof(basename)] == basename_start_end)
-                {
-                    fprintf(stderr, "--debug file dump overran filename buffer! Not dumping files\n");
-                    break;
-                }
+    free(refinement_level);
+    return NULL;
+}
 
-                // basename is now just the FILENAME with no directory. It still has
-                // an extension
-                char* last_dot = strrchr(basename, '.');
-                if(last_dot)
-                    *last_dot = '\0';
+// --shm: I process the frames published by a capture process into a shared
+// memory ring, and write the results into the parallel result ring. The
+// protocol is described in shm_ring.hh. The detection parameters come from the
+// commandline, as usual
+static shm_ring_t shm_ring;
+static void* shm_worker( void* _Nprocessed )
+{
+    shm_ring_header_t* header = shm_ring.header;
 
-                char filename_out[1024];
-                if(snprintf(filename_out, sizeof(filename_out),
-                            "/tmp/%s_preprocessed.png",
-                            basename) >= (int)sizeof(filename_out))
-                {
-                    fprintf(stderr, "--debug file dump overran filename buffer! Not dumping files\n");
-                    break;
-                }
+    cv::Ptr<cv::CLAHE> clahe;
+    signed char*       refinement_level = NULL;
+    cv::Mat            image;
+    uint64_t           Nprocessed       = 0;
 
-                cv::imwrite(filename_out, image);
-                fprintf(stderr, "Wrote preprocessed image to %s\n", filename_out);
+    while(true)
+    {
+        uint64_t sequence = __atomic_fetch_add(&header->next_claim, (uint64_t)1, __ATOMIC_RELAXED);
 
-            } while(0);
+        shm_frame_header_t* frame = shm_ring_frame(&shm_ring, sequence);
+        int  Nwaits = 0;
+        bool done   = false;
+        while(!shm_is_published(&frame->published, sequence))
+        {
+            // The producer publishes the frames before closing the ring. So if
+            // it's closed, and this frame isn't among the published ones, it
+            // will never come
+            if( __atomic_load_n(&header->closed, __ATOMIC_ACQUIRE) &&
+                sequence >= __atomic_load_n(&header->Nframes_published, __ATOMIC_ACQUIRE) )
+            {
+                done = true;
+                break;
+            }
+            shm_ring_backoff(&Nwaits);
         }
-        std::vector<PointDouble> points_out;
-        bool result;
-        int found_pyramid_level; // need this because ctx.image_pyramid_level could be -1
+        if(done)
+            break;
 
-        if(ctx.doblobs)
+        // I validate a snapshot of the frame dimensions, and use only that
+        const uint32_t width  = frame->width;
+        const uint32_t height = frame->height;
+        const uint32_t stride = frame->stride;
+
+        std::vector<PointDouble> points_out;
+        int status;
+        if( width  == 0 || width  > shm_ring.max_width  ||
+            height == 0 || height > shm_ring.max_height ||
+            stride < width ||
+            (uint64_t)stride*(height-1) + width >
+              shm_ring.frame_slot_size - sizeof(shm_frame_header_t) )
         {
-            result = find_circle_grid_from_image_array(points_out,
-                                                       image, ctx.gridn,
-                                                       ctx.debug, ctx.debug_sequence);
-            // ctx.image_pyramid_level == 0 here. cmdline parser makes sure.
-            found_pyramid_level = 0;
+            fprintf(stderr, "Frame %llu has invalid dimensions. Skipping\n",
+                    (unsigned long long)sequence);
+            status = -2;
         }
         else
         {
-            std::chrono::system_clock::now();
-            found_pyramid_level =
-                find_chessboard_from_image_array (points_out,
-                                                  ctx.do_refine ? &refinement_level : NULL,
-                                                  ctx.gridn,
-                                                  image,
-                                                  ctx.image_pyramid_level,
-                                                  ctx.debug, ctx.debug_sequence,
-                                                  filename);
-            result = (found_pyramid_level >= 0);
+            // The producer won't touch this slot until I publish the result.
+            // The library takes strided images, so with --pyramid-preprocess I
+            // use the frame in the ring as is. Otherwise I copy it out: the
+            // preprocessing is done in-place
+            cv::Mat frame_image(height, width, CV_8UC1,
+                                shm_frame_pixels(frame), stride);
+            if(ctx.pyramid_preprocess)
+                image = frame_image;
+            else
+            {
+                frame_image.copyTo(image);
+                preprocess_image(image, clahe, ctx.doclahe, ctx.blur_radius);
+            }
+            status = detect(points_out, &refinement_level, image,
+                            ctx.doblobs, ctx.do_refine, ctx.gridn, ctx.image_pyramid_level,
+                            library_options(),
+                            false, ctx.debug_sequence, "shm-frame");
+            if(status < 0)
+                status = -1;
         }
 
-        flockfile(stdout);
+        shm_result_header_t* result = shm_ring_result(&shm_ring, sequence);
+        shm_result_point_t*  points = shm_result_points(result);
+        const int N = (status >= 0) ? (int)points_out.size() : 0;
+        for(int i=0; i<N; i++)
         {
-            if( result )
-            {
-                for(int i=0; i<(int)points_out.size(); i++)
-                    printf( "%s %f %f %d\n", filename,
-                            points_out[i].x,
-                            points_out[i].y,
-                            (refinement_level == NULL) ? found_pyramid_level : (int)refinement_level[i]);
-            }
-            else
-                printf("%s - - -\n", filename);
+            points[i].x        = points_out[i].x;
+            points[i].y        = points_out[i].y;
+            // A board found at level 0 isn't refined, and refinement_level
+            // isn't touched: it's NULL or holds the levels of an earlier frame
+            points[i].level    = (status > 0 && refinement_level != NULL) ? (int)refinement_level[i] : status;
+            points[i].reserved = 0;
         }
-        funlockfile(stdout);
+        result->status = status;
+        result->N      = N;
+        shm_publish(&result->published, sequence);
+
+        Nprocessed++;
     }
 
     free(refinement_level);
-
+    *(uint64_t*)_Nprocessed = Nprocessed;
     return NULL;
 }
 
+static int run_shm(const char* name)
+{
+    if(!shm_ring_attach(&shm_ring, name))
+        return 1;
+    if( shm_ring.gridn != (uint32_t)ctx.gridn )
+    {
+        fprintf(stderr, "The result ring in '%s' has room for gridn=%d, but we're looking for gridn=%d\n",
+                name, (int)shm_ring.gridn, ctx.gridn);
+        shm_ring_detach(&shm_ring);
+        return 1;
+    }
+
+    pthread_t thread    [ctx.Njobs];
+    uint64_t  Nprocessed[ctx.Njobs];
+    for(int i=0; i<ctx.Njobs; i++)
+        pthread_create(&thread[i], NULL, &shm_worker, &Nprocessed[i]);
+
+    uint64_t Nprocessed_total = 0;
+    for(int i=0; i<ctx.Njobs; i++)
+    {
+        pthread_join(thread[i], NULL);
+        Nprocessed_total += Nprocessed[i];
+    }
+
+    fprintf(stderr, "The producer closed the ring '%s'. Processed %llu frames\n",
+            name, (unsigned long long)Nprocessed_total);
+    shm_ring_detach(&shm_ring);
+    return 0;
+}
+
 int main(int argc, char* argv[])
 {
     const char* usage =
@@ -177,6 +2061,34 @@ int main(int argc, char* argv[])
         { "gridn",             required_argument, NULL, 'N' },
         { "debug",             no_argument,       NULL, 'd' },
         { "debug-sequence",    required_argument, NULL, 'D' },
+        { "output-format",     required_argument, NULL, 'F' },
+        { "output",            required_argument, NULL, 'o' },
+        { "files-from",        required_argument, NULL, 'T' },
+        { "null",              no_argument,       NULL, '0' },
+        { "cache",             required_argument, NULL, 'c' },
+        { "cache-max-size",    required_argument, NULL, 'S' },
+        { "decoded-cache",     required_argument, NULL, 'K' },
+        { "pyramid-preprocess",no_argument,       NULL, 'y' },
+        { "tile-mask",         no_argument,       NULL, 'G' },
+        { "adaptive-level",    no_argument,       NULL, 'A' },
+        { "parallel-levels",   no_argument,       NULL, 'L' },
+        { "time-budget",       required_argument, NULL, 'U' },
+        { "refinement",        required_argument, NULL, 'E' },
+        { "incremental",       required_argument, NULL, 'X' },
+        { "prefilter",         required_argument, NULL, 'Z' },
+        { "prefilter-level",   required_argument, NULL, 'Y' },
+        { "sweep",             required_argument, NULL, 'w' },
+        { "sweep-first",       no_argument,       NULL, 'I' },
+        { "shard",             required_argument, NULL, 's' },
+        { "merge",             required_argument, NULL, 'M' },
+        { "server",            required_argument, NULL, 'Q' },
+        { "shm",               required_argument, NULL, 'm' },
+        { "frames",            required_argument, NULL, 'f' },
+        { "video",             no_argument,       NULL, 'v' },
+        { "every",             required_argument, NULL, 'e' },
+        { "watch",             required_argument, NULL, 'W' },
+        { "tar",               no_argument,       NULL, 't' },
+        { "prefetch",          required_argument, NULL, 'P' },
         { "help",              no_argument,       NULL, 'h' },
         {}
     };
@@ -192,52 +2104,253 @@ int main(int argc, char* argv[])
     int         image_pyramid_level = -1;
     int         jobs                = 1;
     int         gridn               = 10;
+    output_format_t output_format   = OUTPUT_VNLOG;
+    const char* output_filename     = NULL;
+    const char* manifest_filename   = NULL;
+    char        manifest_delimiter  = '\n';
+    const char* cache_dir           = NULL;
+    uint64_t    cache_max_size      = 1ULL << 30;
+    const char* decoded_cache_dir   = NULL;
+    bool        pyramid_preprocess  = false;
+    bool        tile_mask           = false;
+    bool        adaptive_level      = false;
+    bool        parallel_levels     = false;
+    double      time_budget_ms      = 0.0;
+    refinement_mode_t refinement    = REFINEMENT_PYRAMID;
+    double      incremental_threshold = 0.0;
+    double      prefilter_threshold = 0.0;
+    int         prefilter_level     = -1;
+    std::vector<const char*> sweep_specs;
+    bool        sweep_first         = false;
+    int         shard_i             = 0;
+    int         shard_N             = 1;
+    std::vector<const char*> merge_filenames;
+    const char* server_socket       = NULL;
+    const char* shm_name            = NULL;
+    const char* frames              = NULL;
+    bool        dovideo             = false;
+    int         video_every         = 1;
+    const char* watch_dir           = NULL;
+    bool        dotar               = false;
+    int         prefetch            = 0;
+
+    int opt;
+    do
+    {
+        // "h" means -h does something
+        opt = getopt_long(argc, argv, "hj:b:l:T:0", opts, NULL);
+        switch(opt)
+        {
+        case -1:
+            break;
+
+        case 'h':
+            printf(usage, argv[0]);
+            return 0;
+
+        case 'B':
+            doblobs = true;
+            break;
+
+        case 'C':
+            doclahe = false;
+            break;
+
+        case 'R':
+            do_refine = false;
+            break;
+
+        case 'd':
+            debug = true;
+            break;
+
+        case 'D':
+            debug_sequence = true;
+            if( 2 != sscanf(optarg, "%d,%d",
+                            &debug_sequence_pt.x,
+                            &debug_sequence_pt.y) )
+            {
+                fprintf(stderr, "I could not parse 'x,y' from --debug-sequence '%s'. Giving up\n",
+                        optarg);
+                fprintf(stderr, usage, argv[0]);
+                return -1;
+            }
+            break;
+
+        case 'N':
+            gridn = atoi(optarg);
+            break;
+
+        case 'F':
+            if(     0 == strcmp(optarg, "vnlog")) output_format = OUTPUT_VNLOG;
+            else if(0 == strcmp(optarg, "npy"  )) output_format = OUTPUT_NPY;
+            else if(0 == strcmp(optarg, "raw"  )) output_format = OUTPUT_RAW;
+            else
+            {
+                fprintf(stderr, "--output-format must be one of 'vnlog', 'npy', 'raw'. Got '%s'\n",
+                        optarg);
+                fprintf(stderr, usage, argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'o':
+            output_filename = optarg;
+            break;
+
+        case 'T':
+            manifest_filename = optarg;
+            break;
+
+        case '0':
+            manifest_delimiter = '\0';
+            break;
+
+        case 'c':
+            cache_dir = optarg;
+            break;
+
+        case 'K':
+            decoded_cache_dir = optarg;
+            break;
+
+        case 'y':
+            pyramid_preprocess = true;
+            break;
+
+        case 'G':
+            tile_mask = true;
+            break;
+
+        case 'A':
+            adaptive_level = true;
+            break;
+
+        case 'L':
+            parallel_levels = true;
+            break;
+
+        case 'E':
+            if(     0 == strcmp(optarg, "pyramid"       )) refinement = REFINEMENT_PYRAMID;
+            else if(0 == strcmp(optarg, "saddle"        )) refinement = REFINEMENT_SADDLE;
+            else if(0 == strcmp(optarg, "saddle-fullres")) refinement = REFINEMENT_SADDLE_FULLRES;
+            else
+            {
+                fprintf(stderr, "--refinement must be one of 'pyramid', 'saddle', 'saddle-fullres'. Got '%s'\n",
+                        optarg);
+                fprintf(stderr, usage, argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'U':
+            time_budget_ms = atof(optarg);
+            if(time_budget_ms <= 0)
+            {
+                fprintf(stderr, "--time-budget must be a positive number of milliseconds. Got '%s'\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'X':
+            incremental_threshold = atof(optarg);
+            if(incremental_threshold <= 0)
+            {
+                fprintf(stderr, "--incremental must be a positive number of gray levels. Got '%s'\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'Z':
+            prefilter_threshold = atof(optarg);
+            if(prefilter_threshold <= 0)
+            {
+                fprintf(stderr, "--prefilter must be a positive presence score. Got '%s'\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'Y':
+            prefilter_level = atoi(optarg);
+            if(prefilter_level < 0 || prefilter_level > 10)
+            {
+                fprintf(stderr, "--prefilter-level must be a pyramid level in [0,10]. Got '%s'\n", optarg);
+                return 1;
+            }
+            break;
+
+        case 'w':
+            sweep_specs.push_back(optarg);
+            break;
+
+        case 'I':
+            sweep_first = true;
+            break;
+
+        case 's':
+            if( 2 != sscanf(optarg, "%d/%d", &shard_i, &shard_N) ||
+                shard_N < 1 || shard_i < 0 || shard_i >= shard_N )
+            {
+                fprintf(stderr, "--shard must be 'i/N' with 0 <= i < N. Got '%s'\n",
+                        optarg);
+                fprintf(stderr, usage, argv[0]);
+                return 1;
+            }
+            break;
+
+        case 'M':
+            merge_filenames.push_back(optarg);
+            break;
+
+        case 'Q':
+            server_socket = optarg;
+            break;
 
-    int opt;
-    do
-    {
-        // "h" means -h does something
-        opt = getopt_long(argc, argv, "hj:b:l:", opts, NULL);
-        switch(opt)
-        {
-        case -1:
+        case 'm':
+            shm_name = optarg;
             break;
 
-        case 'h':
-            printf(usage, argv[0]);
-            return 0;
+        case 'f':
+            frames = optarg;
+            break;
 
-        case 'B':
-            doblobs = true;
+        case 'v':
+            dovideo = true;
             break;
 
-        case 'C':
-            doclahe = false;
+        case 'W':
+            watch_dir = optarg;
             break;
 
-        case 'R':
-            do_refine = false;
+        case 't':
+            dotar = true;
             break;
 
-        case 'd':
-            debug = true;
+        case 'P':
+            prefetch = atoi(optarg);
+            if(prefetch < 0)
+            {
+                fprintf(stderr, "--prefetch must be a non-negative integer. Got '%s'\n", optarg);
+                return 1;
+            }
             break;
 
-        case 'D':
-            debug_sequence = true;
-            if( 2 != sscanf(optarg, "%d,%d",
-                            &debug_sequence_pt.x,
-                            &debug_sequence_pt.y) )
+        case 'e':
+            video_every = atoi(optarg);
+            if(video_every <= 0)
             {
-                fprintf(stderr, "I could not parse 'x,y' from --debug-sequence '%s'. Giving up\n",
-                        optarg);
-                fprintf(stderr, usage, argv[0]);
-                return -1;
+                fprintf(stderr, "--every must be a positive integer. Got '%s'\n", optarg);
+                return 1;
             }
             break;
 
-        case 'N':
-            gridn = atoi(optarg);
+        case 'S':
+            if(!parse_size(&cache_max_size, optarg) || cache_max_size == 0)
+            {
+                fprintf(stderr, "--cache-max-size must be a positive size, optionally with a K,M,G,T suffix. Got '%s'\n",
+                        optarg);
+                return 1;
+            }
             break;
 
         case 'b':
@@ -259,12 +2372,132 @@ int main(int argc, char* argv[])
         }
     } while( opt != -1 );
 
-    if( optind > argc-1)
+    // The input modes are --server, --shm, --frames, --video, --watch and
+    // --tar. Without any of them I read the image files in the globs or in
+    // --files-from. I check all the combinations of the modes and the options
+    // here, before any mode runs
+    const bool image_files = (optind <= argc-1 || manifest_filename != NULL);
+    if( (server_socket != NULL) + (shm_name != NULL) + (frames != NULL) +
+        dovideo + (watch_dir != NULL) + dotar > 1 )
+    {
+        fprintf(stderr, "--server, --shm, --frames, --video, --watch and --tar are mutually exclusive\n");
+        return 1;
+    }
+    if( server_socket != NULL &&
+        ( image_files ||
+          debug || debug_sequence || cache_dir != NULL || decoded_cache_dir != NULL ||
+          shard_N > 1 || !merge_filenames.empty() ||
+          output_filename != NULL || output_format != OUTPUT_VNLOG ||
+          prefetch > 0 || !sweep_specs.empty() || sweep_first ||
+          doblobs || !doclahe || !do_refine || blur_radius != 1 ||
+          image_pyramid_level != -1 || gridn != 10 ||
+          pyramid_preprocess || tile_mask || adaptive_level || parallel_levels ||
+          time_budget_ms > 0 || refinement != REFINEMENT_PYRAMID ||
+          incremental_threshold > 0 || prefilter_threshold > 0 || prefilter_level >= 0 ) )
+    {
+        fprintf(stderr, "--server takes no images, and only the --jobs option: the requests carry the detection parameters\n");
+        return 1;
+    }
+    if( shm_name != NULL &&
+        ( image_files ||
+          debug || debug_sequence || cache_dir != NULL || decoded_cache_dir != NULL ||
+          shard_N > 1 || !merge_filenames.empty() ||
+          output_filename != NULL || output_format != OUTPUT_VNLOG ||
+          prefetch > 0 || !sweep_specs.empty() || sweep_first ) )
+    {
+        fprintf(stderr, "--shm takes no images. The results are written to the result ring, so --output, --output-format, --cache, --decoded-cache, --prefetch, --sweep, --shard, --merge, --debug aren't supported\n");
+        return 1;
+    }
+    if( frames != NULL &&
+        ( image_files ||
+          debug || cache_dir != NULL || decoded_cache_dir != NULL ||
+          shard_N > 1 || !merge_filenames.empty() ||
+          prefetch > 0 || !sweep_specs.empty() ) )
+    {
+        fprintf(stderr, "--frames reads the images from stdin. It can't take image globs, --files-from, --cache, --decoded-cache, --prefetch, --sweep, --shard, --merge or --debug\n");
+        return 1;
+    }
+    if( dovideo &&
+        ( manifest_filename != NULL ||
+          debug || cache_dir != NULL || decoded_cache_dir != NULL ||
+          shard_N > 1 || !merge_filenames.empty() ||
+          prefetch > 0 || !sweep_specs.empty() ) )
+    {
+        fprintf(stderr, "--video processes the video files given in the globs. It can't take --files-from, --cache, --decoded-cache, --prefetch, --sweep, --shard, --merge or --debug\n");
+        return 1;
+    }
+#ifndef __linux__
+    if( watch_dir != NULL )
+    {
+        fprintf(stderr, "--watch uses inotify, and is only supported on Linux\n");
+        return 1;
+    }
+#endif
+#ifndef POSIX_FADV_WILLNEED
+    if( prefetch > 0 )
+    {
+        fprintf(stderr, "--prefetch uses posix_fadvise(), which this platform doesn't have\n");
+        return 1;
+    }
+#endif
+    if( watch_dir != NULL &&
+        ( manifest_filename != NULL || debug || !merge_filenames.empty() ||
+          prefetch > 0 ) )
+    {
+        fprintf(stderr, "--watch can't take --files-from, --prefetch, --merge or --debug\n");
+        return 1;
+    }
+    if( dotar &&
+        ( manifest_filename != NULL || debug || !merge_filenames.empty() ||
+          decoded_cache_dir != NULL || prefetch > 0 ) )
+    {
+        fprintf(stderr, "--tar processes the archives given in the globs. It can't take --files-from, --decoded-cache, --prefetch, --merge or --debug\n");
+        return 1;
+    }
+    if( !dovideo && video_every != 1 )
+    {
+        fprintf(stderr, "--every only applies with --video\n");
+        return 1;
+    }
+
+    if( server_socket != NULL )
+    {
+        if( jobs <= 0 )
+        {
+            fprintf(stderr, "The job count must be a positive integer\n");
+            return 1;
+        }
+        return run_server(server_socket, jobs);
+    }
+
+    if( manifest_filename == NULL && shm_name == NULL && frames == NULL && watch_dir == NULL &&
+        optind > argc-1)
+    {
+        fprintf(stderr, "Not enough arguments: need image globs or --files-from or --frames or --watch\n");
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+    if( manifest_filename != NULL && optind <= argc-1)
     {
-        fprintf(stderr, "Not enough arguments: need image globs\n");
+        fprintf(stderr, "--files-from and image globs are mutually exclusive\n");
         fprintf(stderr, usage, argv[0]);
         return 1;
     }
+    if( !merge_filenames.empty() && shard_N > 1 )
+    {
+        fprintf(stderr, "--merge combines the outputs of all the shards; it can't take --shard\n");
+        return 1;
+    }
+    if( cache_dir != NULL && debug )
+    {
+        fprintf(stderr, "--cache and --debug are mutually exclusive: a cache hit wouldn't produce the debug output\n");
+        return 1;
+    }
+    if( manifest_filename != NULL && debug )
+    {
+        fprintf(stderr, "When debugging, pass one image at a time: --files-from isn't supported\n");
+        return 1;
+    }
     if( jobs <= 0 )
     {
         fprintf(stderr, "The job count must be a positive integer\n");
@@ -281,8 +2514,204 @@ int main(int argc, char* argv[])
         fprintf(stderr, "--gridn value must be >= 2\n");
         return 1;
     }
+    if( output_format != OUTPUT_VNLOG && output_filename == NULL )
+    {
+        fprintf(stderr, "Binary --output-format requires an --output file\n");
+        return 1;
+    }
+    if( output_format == OUTPUT_VNLOG && output_filename != NULL )
+    {
+        fprintf(stderr, "--output is only used with a binary --output-format. The vnlog goes to stdout\n");
+        return 1;
+    }
+
+    if( pyramid_preprocess && doblobs )
+    {
+        fprintf(stderr, "--pyramid-preprocess only applies to chessboards: it can't take --blobs\n");
+        return 1;
+    }
+    if( tile_mask && doblobs )
+    {
+        fprintf(stderr, "--tile-mask only applies to chessboards: it can't take --blobs\n");
+        return 1;
+    }
+    if( adaptive_level && doblobs )
+    {
+        fprintf(stderr, "--adaptive-level only applies to chessboards: it can't take --blobs\n");
+        return 1;
+    }
+    if( parallel_levels && doblobs )
+    {
+        fprintf(stderr, "--parallel-levels only applies to chessboards: it can't take --blobs\n");
+        return 1;
+    }
+    if( refinement != REFINEMENT_PYRAMID && doblobs )
+    {
+        fprintf(stderr, "--refinement only applies to chessboards: it can't take --blobs\n");
+        return 1;
+    }
+    if( refinement != REFINEMENT_PYRAMID && !do_refine )
+    {
+        fprintf(stderr, "--refinement and --no-refine are mutually exclusive\n");
+        return 1;
+    }
+    if( time_budget_ms > 0 && doblobs )
+    {
+        fprintf(stderr, "--time-budget only applies to chessboards: it can't take --blobs\n");
+        return 1;
+    }
+    if( time_budget_ms > 0 && cache_dir != NULL )
+    {
+        fprintf(stderr, "--time-budget and --cache are mutually exclusive: the result of a time-limited search depends on the machine's load, so it can't be cached\n");
+        return 1;
+    }
+    if( incremental_threshold > 0 && doblobs )
+    {
+        fprintf(stderr, "--incremental only applies to chessboards: it can't take --blobs\n");
+        return 1;
+    }
+    if( incremental_threshold > 0 && (parallel_levels || tile_mask) )
+    {
+        fprintf(stderr, "--incremental can't take --parallel-levels or --tile-mask: the search reuses the previous frame's data instead\n");
+        return 1;
+    }
+    if( incremental_threshold > 0 && cache_dir != NULL )
+    {
+        fprintf(stderr, "--incremental and --cache are mutually exclusive: the result of an incremental search depends on the previous images, so it can't be cached\n");
+        return 1;
+    }
+    if( prefilter_threshold > 0 && doblobs )
+    {
+        fprintf(stderr, "--prefilter only applies to chessboards: it can't take --blobs\n");
+        return 1;
+    }
+    if( prefilter_level >= 0 && prefilter_threshold <= 0 )
+    {
+        fprintf(stderr, "--prefilter-level only applies with --prefilter\n");
+        return 1;
+    }
+    if( parallel_levels && tile_mask )
+    {
+        fprintf(stderr, "--parallel-levels and --tile-mask are exclusive: level 0 doesn't wait for the coarser levels to fill in the tile mask\n");
+        return 1;
+    }
+
+    // The detection parameters
+    ctx.Njobs               = jobs;
+    ctx.doclahe             = doclahe;
+    ctx.blur_radius         = blur_radius;
+    ctx.pyramid_preprocess  = pyramid_preprocess;
+    if(pyramid_preprocess)
+    {
+        ctx.library.preprocess.doclahe     = doclahe;
+        ctx.library.preprocess.blur_radius = blur_radius;
+    }
+    ctx.library.search.tile_mask           = tile_mask;
+    ctx.library.search.parallel_levels     = parallel_levels;
+    ctx.library.search.time_budget_ms      = time_budget_ms;
+    ctx.library.search.refinement          = refinement;
+    ctx.library.search.prefilter_threshold = prefilter_threshold;
+    ctx.library.search.prefilter_level     = prefilter_level;
+    ctx.adaptive_level      = adaptive_level;
+    ctx.incremental_threshold = incremental_threshold;
+    ctx.doblobs             = doblobs;
+    ctx.do_refine           = do_refine;
+    ctx.gridn               = gridn;
+    ctx.debug               = debug;
+
+    ctx.debug_sequence.dodebug = debug_sequence;
+    ctx.debug_sequence.pt      = debug_sequence_pt;
+
+    ctx.image_pyramid_level = image_pyramid_level;
+
+    if( shm_name != NULL )
+        return run_shm(shm_name);
+
+    ctx.doframes = (frames != NULL);
+    if( ctx.doframes )
+    {
+        if(0 == strcmp(frames, "y4m"))
+        {
+            ctx.frames_y4m = true;
+            if(!read_y4m_header())
+                return 1;
+        }
+        else
+        {
+            ctx.frames_y4m       = false;
+            ctx.frames_skip_size = 0;
+            if( 2 != sscanf(frames, "%dx%d", &ctx.frames_width, &ctx.frames_height) ||
+                ctx.frames_width <= 0 || ctx.frames_height <= 0 )
+            {
+                fprintf(stderr, "--frames must be 'y4m' or 'WIDTHxHEIGHT'. Got '%s'\n", frames);
+                return 1;
+            }
+        }
+        ctx.frames_next_read   = 0;
+        ctx.frames_next_output = 0;
+        pthread_cond_init(&ctx.frames_output_cond, NULL);
+    }
+
+    ctx.dovideo     = dovideo;
+    ctx.video_every = video_every;
+
+    ctx.dowatch = (watch_dir != NULL);
+    if( ctx.dowatch )
+    {
+        // The globs are patterns to match against the new files
+        ctx.watch_dir         = watch_dir;
+        ctx.watch_patterns    = &argv[optind];
+        ctx.Nwatch_patterns   = argc - optind;
+        ctx.flush_each_result = true;
+        optind = argc;
+
+#ifdef __linux__
+        ctx.watch_fd = inotify_init1(IN_CLOEXEC);
+        if( ctx.watch_fd < 0 ||
+            inotify_add_watch(ctx.watch_fd, watch_dir,
+                              IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE_SELF | IN_ONLYDIR) < 0 )
+        {
+            fprintf(stderr, "Couldn't watch directory '%s': %s\n", watch_dir, strerror(errno));
+            return 1;
+        }
+#endif
+
+        if( pipe(watch_stop_pipe) != 0 )
+        {
+            fprintf(stderr, "Couldn't create a pipe: %s\n", strerror(errno));
+            return 1;
+        }
+        ctx.watch_stop_fd = watch_stop_pipe[0];
+        signal(SIGINT,  watch_stop);
+        signal(SIGTERM, watch_stop);
+        fprintf(stderr, "Watching '%s' for new images. Send SIGINT (^C) to stop\n", watch_dir);
+    }
+
+    ctx.dotar = dotar;
+
+    if( !sweep_specs.empty() &&
+        ( doblobs || cache_dir != NULL || incremental_threshold > 0 ||
+          !merge_filenames.empty() || output_format != OUTPUT_VNLOG ) )
+    {
+        fprintf(stderr, "--sweep can't take --blobs, --cache, --incremental, --merge or a binary --output-format\n");
+        return 1;
+    }
+    if( sweep_first && sweep_specs.empty() )
+    {
+        fprintf(stderr, "--sweep-first only applies with --sweep\n");
+        return 1;
+    }
+    for(const char* spec : sweep_specs)
+    {
+        sweep_config_t config = { gridn, doclahe, blur_radius,
+                                  image_pyramid_level, do_refine };
+        if(!parse_sweep_config(&config, spec))
+            return 1;
+        ctx.sweep.push_back(config);
+    }
+    ctx.sweep_first = sweep_first;
 
-    glob_t _glob;
+    glob_t _glob = {};
     int doappend = 0;
     for( int iopt_glob = optind; iopt_glob<argc; iopt_glob++ )
     {
@@ -290,6 +2719,8 @@ int main(int argc, char* argv[])
         int globresult =
             glob(imageglob,
                  doappend |
+                 // The archive "-" is stdin. It's passed through as is
+                 (dotar ? GLOB_NOCHECK : 0) |
                  GLOB_ERR | GLOB_MARK | GLOB_NOSORT,
                  NULL, &_glob);
         if(globresult == GLOB_NOMATCH)
@@ -306,6 +2737,42 @@ int main(int argc, char* argv[])
         doappend = GLOB_APPEND;
     }
 
+    FILE* fp_manifest = NULL;
+    if(manifest_filename != NULL)
+    {
+        if(0 == strcmp(manifest_filename, "-"))
+            fp_manifest = stdin;
+        else
+        {
+            fp_manifest = fopen(manifest_filename, "r");
+            if(fp_manifest == NULL)
+            {
+                fprintf(stderr, "Couldn't open manifest '%s' for reading\n", manifest_filename);
+                return 1;
+            }
+        }
+    }
+
+    // The job source. Used by the workers, and by --merge to define the order
+    ctx._glob               = &_glob;
+    ctx.i_glob_next         = 0;
+    ctx.fp_manifest         = fp_manifest;
+    ctx.manifest_delimiter  = manifest_delimiter;
+    ctx.shard_i             = shard_i;
+    ctx.shard_N             = shard_N;
+    ctx.reject_repeated     = shard_N > 1 || !merge_filenames.empty();
+    ctx.Nrepeated           = 0;
+    pthread_mutex_init(&ctx.job_mutex, NULL);
+
+    if(!merge_filenames.empty())
+    {
+        int result = merge_shards(merge_filenames);
+        globfree(&_glob);
+        if(fp_manifest != NULL && fp_manifest != stdin)
+            fclose(fp_manifest);
+        return result;
+    }
+
     if(debug && _glob.gl_pathc != 1)
     {
         fprintf(stderr, "When debugging, pass one image at a time. Got %d instead\n",
@@ -314,39 +2781,154 @@ int main(int argc, char* argv[])
     }
 
 
-    printf("## generated with");
-    for(int i=0; i<argc; i++)
-        printf(" %s", argv[i]);
-    printf("\n");
+    ctx.output_format = output_format;
+    ctx.Nrecords      = 0;
+    if(output_format == OUTPUT_VNLOG)
+    {
+        printf("## generated with");
+        for(int i=0; i<argc; i++)
+            printf(" %s", argv[i]);
+        printf("\n");
 
-    printf("# filename x y level\n");
+        if(ctx.sweep.empty())
+            printf("# filename x y level\n");
+        else
+        {
+            for(int i=0; i<(int)ctx.sweep.size(); i++)
+                printf("## config %d: gridn=%d,clahe=%d,blur=%d,level=%d,refine=%d\n",
+                       i,
+                       ctx.sweep[i].gridn, (int)ctx.sweep[i].doclahe,
+                       ctx.sweep[i].blur_radius, ctx.sweep[i].image_pyramid_level,
+                       (int)ctx.sweep[i].do_refine);
+            printf("# filename config x y level\n");
+        }
+    }
+    else
+    {
+        ctx.fp_records = fopen(output_filename, "wb");
+        if(ctx.fp_records == NULL)
+        {
+            fprintf(stderr, "Couldn't open '%s' for writing\n", output_filename);
+            return 1;
+        }
+
+        char filename_table[1024];
+        if(snprintf(filename_table, sizeof(filename_table),
+                    "%s.filenames", output_filename) >= (int)sizeof(filename_table))
+        {
+            fprintf(stderr, "--output filename too long\n");
+            return 1;
+        }
+        ctx.fp_filenames = fopen(filename_table, "w");
+        if(ctx.fp_filenames == NULL)
+        {
+            fprintf(stderr, "Couldn't open '%s' for writing\n", filename_table);
+            return 1;
+        }
+
+        // Placeholder header. I fill in the record count when I'm done
+        if(output_format == OUTPUT_NPY &&
+           !write_npy_header(ctx.fp_records, gridn, 0))
+        {
+            fprintf(stderr, "Couldn't write the .npy header to '%s'\n", output_filename);
+            return 1;
+        }
+    }
 
     // I'm done with the preliminaries. I now spawn the child threads. Note that
     // in this implementation it is important that these are THREADS and not a
     // fork. I want to make sure that the image output is atomic. To do that I
     // use flockfile(), and each child thread writes directly to stdout.
     // flockfile() does not work in a fork, but does work in a thread
-    ctx._glob               = &_glob;
-    ctx.Njobs               = jobs;
-    ctx.doclahe             = doclahe;
-    ctx.blur_radius         = blur_radius;
-    ctx.doblobs             = doblobs;
-    ctx.do_refine           = do_refine;
-    ctx.gridn               = gridn;
-    ctx.debug               = debug;
+    ctx.prefetch             = prefetch;
+    ctx.prefetch_source_done = false;
 
-    ctx.debug_sequence.dodebug = debug_sequence;
-    ctx.debug_sequence.pt      = debug_sequence_pt;
+    ctx.docache = (cache_dir != NULL);
+    if(ctx.docache)
+    {
+        if(!disk_cache_init(&ctx.cache, cache_dir, cache_max_size))
+            return 1;
 
-    ctx.image_pyramid_level = image_pyramid_level;
+        // Everything that could affect the result goes into the key
+        char params[512];
+        int len = snprintf(params, sizeof(params),
+                           "mrgingham result cache. version=%s gridn=%d level=%d blur=%d clahe=%d refine=%d blobs=%d pyramid_preprocess=%d tile_mask=%d adaptive_level=%d refinement=%d prefilter=%g prefilter_level=%d",
+                           VERSION, gridn, image_pyramid_level, blur_radius,
+                           (int)doclahe, (int)do_refine, (int)doblobs, (int)pyramid_preprocess,
+                           (int)tile_mask, (int)adaptive_level, (int)refinement,
+                           prefilter_threshold, prefilter_level);
+        if(len < 0 || len >= (int)sizeof(params))
+        {
+            // A truncated string would drop parameters from the key, and
+            // different parameters would share cache entries
+            fprintf(stderr, "Couldn't construct the cache key: the parameter string doesn't fit\n");
+            return 1;
+        }
+        ctx.cache_key_seed = hash128(params, len);
+    }
+
+    ctx.dodecodedcache = (decoded_cache_dir != NULL);
+    if( ctx.dodecodedcache &&
+        !disk_cache_init(&ctx.decoded_cache, decoded_cache_dir, cache_max_size) )
+        return 1;
+
+    if(ctx.dovideo)
+        plan_video_segments(&_glob, jobs, video_every);
 
     pthread_t thread[jobs];
     for(unsigned int i=0; i<jobs; i++)
-        pthread_create(&thread[i], NULL, &worker, (void*)i);
+        pthread_create(&thread[i], NULL,
+                       ctx.doframes ? &frames_worker :
+                       ctx.dovideo  ? &video_worker  :
+                       &worker,
+                       (void*)i);
 
     for(unsigned int i=0; i<jobs; i++)
         pthread_join(thread[i], NULL);
 
+    if(ctx.docache)
+        disk_cache_evict(&ctx.cache);
+    if(ctx.dodecodedcache)
+        disk_cache_evict(&ctx.decoded_cache);
+
     globfree(&_glob);
+    if(fp_manifest != NULL && fp_manifest != stdin)
+        fclose(fp_manifest);
+    pthread_mutex_destroy(&ctx.job_mutex);
+    free(ctx.prefetch_buf);
+    if(ctx.dowatch)
+    {
+        close(ctx.watch_fd);
+        close(watch_stop_pipe[0]);
+        close(watch_stop_pipe[1]);
+    }
+    if(ctx.doframes)
+        pthread_cond_destroy(&ctx.frames_output_cond);
+
+    if(output_format != OUTPUT_VNLOG)
+    {
+        if(output_format == OUTPUT_NPY &&
+           !write_npy_header(ctx.fp_records, gridn, ctx.Nrecords))
+        {
+            fprintf(stderr, "Couldn't finalize the .npy header in '%s'\n", output_filename);
+            return 1;
+        }
+
+        // fclose() flushes the buffered records, so it can fail too
+        bool closed_records   = (0 == fclose(ctx.fp_records));
+        bool closed_filenames = (0 == fclose(ctx.fp_filenames));
+        if(ctx.output_failed || !closed_records || !closed_filenames)
+        {
+            fprintf(stderr, "Couldn't write all the results to '%s' and its .filenames table\n",
+                    output_filename);
+            return 1;
+        }
+    }
+
+    if(ctx.Nrepeated > 0)
+    {
+        fprintf(stderr, "Skipped %d repeated images\n", ctx.Nrepeated);
+        return 1;
+    }
     return 0;
 }
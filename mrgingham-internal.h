@@ -1,6 +1,20 @@
 #pragma once
 
+#include "mrgingham.hh"
+#include "cancel.h"
+
 #define FIND_GRID_SCALE 1000 /* Voronoi diagram is integer-only, so I scale-up
                                 to get more resolution */
 
 #define FIND_GRID_SCALE_APPROX_POWER2 1024
+
+namespace mrgingham
+{
+    // find_grid_from_points(), which gives up early if cancel is cancelled
+    bool find_grid_from_points( std::vector<mrgingham::PointDouble>& points_out,
+                                const std::vector<mrgingham::PointInt>& points,
+                                const int gridn,
+                                bool debug,
+                                const debug_sequence_t& debug_sequence,
+                                mrgingham_cancel_t* cancel);
+};
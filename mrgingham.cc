@@ -1,11 +1,22 @@
 #include "mrgingham.hh"
+#include "mrgingham-internal.h"
 #include "find_blobs.hh"
 #include "find_chessboard_corners.hh"
 #include "windows_defines.h"
 #include "windows_defines.h"
 
+#include <string.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
 #include <opencv2/highgui/highgui.hpp>
 
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define FRAME_CACHE_SSE2 1
+#endif
+
 
 namespace mrgingham
 {
@@ -36,23 +47,36 @@ namespace mrgingham
     }
 
     // *refinement_level is managed by realloc(). IT IS THE CALLER'S
-    // *RESPONSIBILITY TO free() IT
+    // *RESPONSIBILITY TO free() IT. If non-NULL, found(cookie) is called as
+    // soon as the grid is found, before the refinement
     bool _find_chessboard_from_image_array( std::vector<PointDouble>& points_out,
                                                    signed char** refinement_level,
                                                    const cv::Mat& image,
                                                    int image_pyramid_level,
                                                    const int gridn,
+                                                   const preprocess_options_t* preprocess,
+                                                   const search_options_t* search,
                                                    bool debug,
                                                    debug_sequence_t debug_sequence,
-                                                   const char* debug_image_filename)
+                                                   const char* debug_image_filename,
+                                                   tile_mask_t* tile_mask = NULL,
+                                                   mrgingham_cancel_t* cancel = NULL,
+                                                   void (*found)(void* cookie) = NULL,
+                                                   void* cookie = NULL)
     {
         const bool do_refine = (refinement_level != NULL);
+        frame_cache_t* frame_cache = (search != NULL) ? search->frame_cache : NULL;
 
         std::vector<PointInt> points;
-        find_chessboard_corners_from_image_array(&points, image, image_pyramid_level, debug, debug_image_filename);
+        find_chessboard_corners_from_image_array(&points, image, image_pyramid_level, debug, debug_image_filename,
+                                                 preprocess, tile_mask, cancel, frame_cache);
+        if(cancel != NULL)
+            cancel->stage = SEARCH_STAGE_GRID;
         if(!find_grid_from_points(points_out, points, gridn,
-                                  debug, debug_sequence))
+                                  debug, debug_sequence, cancel))
             return false;
+        if(found != NULL)
+            found(cookie);
 
         // we found a grid! If we're not trying to refine the locations, or if
         // we can't refine them, we're done
@@ -86,6 +110,24 @@ namespace mrgingham
         for(int i=0; i<N; i++)
             (*refinement_level)[i] = (signed char)image_pyramid_level;
 
+        if(cancel != NULL)
+            cancel->stage = SEARCH_STAGE_REFINEMENT;
+
+        if(search != NULL && search->refinement != REFINEMENT_PYRAMID)
+        {
+            // One fit around each point instead of a pass per level. A
+            // timeout leaves some points unrefined, like in the loop below
+            mrgingham::
+            refine_chessboard_corners_saddle( &points_out,
+                                              *refinement_level,
+                                              image, image_pyramid_level,
+                                              search->refinement == REFINEMENT_SADDLE_FULLRES,
+                                              debug, preprocess, cancel);
+            if(mrgingham_is_cancelled(cancel))
+                return mrgingham_cancel_timed_out(cancel);
+            return true;
+        }
+
         while(image_pyramid_level--)
         {
             int Nrefined =
@@ -93,7 +135,13 @@ namespace mrgingham
                 refine_chessboard_corners_from_image_array( &points_out,
                                                             *refinement_level,
                                                             image, image_pyramid_level,
-                                                            debug, debug_image_filename);
+                                                            debug, debug_image_filename,
+                                                            preprocess, cancel, frame_cache);
+            // If I ran out of time, the board is still found: the points are
+            // refined as far as they got, and *refinement_level says how far
+            // that is. If I was cancelled, some other level won
+            if(mrgingham_is_cancelled(cancel))
+                return mrgingham_cancel_timed_out(cancel);
             if(debug)
                 fprintf(stderr, "Refining to level %d... Nrefined=%d\n", image_pyramid_level, Nrefined);
             if(Nrefined <= 0)
@@ -102,42 +150,623 @@ namespace mrgingham
         return true;
     }
 
+    WPI_EXPORT
+    double level_policy_hit_rate( const level_policy_t* policy )
+    {
+        if(policy->Nsearches <= 0) return 0.0;
+        return (double)policy->Nstart_hits / (double)policy->Nsearches;
+    }
+
+    // Fills in levels[] with the pyramid levels the auto-level search should
+    // try, in order. Returns how many there are
+    static int level_policy_order( int* levels,
+                                   const level_policy_t* policy,
+                                   int w, int h )
+    {
+        // The coarsest level is where the image is 240-480 pixels across
+        int size = w > h ? w : h;
+        int level_coarsest = 0;
+        while( level_coarsest < MRGINGHAM_LEVEL_POLICY_NLEVELS-1 &&
+               (size >> (level_coarsest+1)) >= 240 )
+            level_coarsest++;
+
+        // I start at the level with the most recent detections, if any
+        int   level_start = level_coarsest;
+        float hits_best   = 0.0f;
+        for(int level=level_coarsest; level>=0; level--)
+            if(policy->hits[level] > hits_best)
+            {
+                hits_best   = policy->hits[level];
+                level_start = level;
+            }
+
+        // Then the coarser levels, which are cheap, and then the finer ones
+        int N = 0;
+        levels[N++] = level_start;
+        for(int level=level_start+1; level<=level_coarsest; level++)
+            levels[N++] = level;
+        for(int level=level_start-1; level>=0; level--)
+            levels[N++] = level;
+        return N;
+    }
+
+    static void level_policy_update( level_policy_t* policy,
+                                     int level_start, int level_found )
+    {
+        // The history decays by half in about 3 frames
+        for(int i=0; i<MRGINGHAM_LEVEL_POLICY_NLEVELS; i++)
+            policy->hits[i] *= 0.8f;
+        if(level_found >= 0)
+            policy->hits[level_found] += 1.0f;
+
+        policy->start_level = level_start;
+        policy->found_level = level_found;
+        policy->Nsearches++;
+        if(level_found >= 0 && level_found == level_start)
+            policy->Nstart_hits++;
+    }
+
+    // The auto-level search with each of levels[] evaluated at the same time,
+    // on its own thread. When a level finds the board, I cancel the levels
+    // after it in levels[]; the ones before it run to completion. The first
+    // success in levels[] is then reported, as in the sequential search. Each
+    // level gets the same deadline, if there is one. I fill in the level counts
+    // and the timeout in *stats.
+    //
     // *refinement_level is managed by realloc(). IT IS THE CALLER'S
     // *RESPONSIBILITY TO free() IT
-    int find_chessboard_from_image_array( std::vector<PointDouble>& points_out,
-                                          signed char** refinement_level,
-                                          const int gridn,
-                                          const cv::Mat& image,
-                                          int image_pyramid_level,
-                                          bool debug,
-                                          debug_sequence_t debug_sequence,
-                                          const char* debug_image_filename)
+    static int _find_chessboard_from_image_array_parallel( std::vector<PointDouble>& points_out,
+                                                           signed char** refinement_level,
+                                                           search_stats_t* stats,
+                                                           const cv::Mat& image,
+                                                           const int* levels, int Nlevels,
+                                                           const int gridn,
+                                                           const preprocess_options_t* preprocess,
+                                                           const search_options_t* search_options,
+                                                           debug_sequence_t debug_sequence,
+                                                           int64_t deadline_ns)
+    {
+        struct level_search_t
+        {
+            std::vector<PointDouble> points;
+            signed char*             refinement_level;
+            bool                     found;
+            mrgingham_cancel_t       cancel;
+
+            // So that found_grid() can get at the levels after this one
+            level_search_t*          all;
+            int                      i, N;
+        } search[MRGINGHAM_LEVEL_POLICY_NLEVELS];
+
+        // Once a level has found the grid, it will succeed: only the
+        // refinement remains. So I cancel the levels after it right away
+        void (*found_grid)(void*) = [](void* cookie)
+        {
+            level_search_t* s = (level_search_t*)cookie;
+            for(int j=s->i+1; j<s->N; j++)
+                mrgingham_cancel(&s->all[j].cancel);
+        };
+
+        auto run = [&](int i)
+        {
+            search[i].found =
+                _find_chessboard_from_image_array( search[i].points,
+                                                   (refinement_level != NULL) ? &search[i].refinement_level : NULL,
+                                                   image,
+                                                   levels[i],
+                                                   gridn,
+                                                   preprocess, search_options,
+                                                   false, debug_sequence,
+                                                   NULL,
+                                                   NULL,
+                                                   &search[i].cancel,
+                                                   found_grid, &search[i]);
+        };
+
+        for(int i=0; i<Nlevels; i++)
+        {
+            search[i].refinement_level = NULL;
+            search[i].found            = false;
+            mrgingham_cancel_init(&search[i].cancel, deadline_ns);
+            search[i].all              = search;
+            search[i].i                = i;
+            search[i].N                = Nlevels;
+        }
+
+        // The first level runs on this thread
+        std::vector<std::thread> threads;
+        for(int i=1; i<Nlevels; i++)
+            threads.emplace_back(run, i);
+        run(0);
+        for(std::thread& t : threads)
+            t.join();
+
+        int result = -1;
+        for(int i=0; i<Nlevels; i++)
+        {
+            // The levels after the one that's reported don't matter
+            if(result < 0)
+            {
+                if(!search[i].cancel.cancelled.load(std::memory_order_relaxed))
+                    stats->Nlevels_completed++;
+                if(mrgingham_cancel_timed_out(&search[i].cancel) && !stats->timed_out)
+                {
+                    stats->timed_out       = true;
+                    stats->level_timed_out = levels[i];
+                    stats->stage_timed_out = (search_stage_t)search[i].cancel.stage;
+                }
+            }
+
+            if(result < 0 && search[i].found)
+            {
+                result = levels[i];
+                points_out.swap(search[i].points);
+
+                // Level 0 isn't refined, and the caller's buffer isn't touched
+                if(search[i].refinement_level != NULL)
+                {
+                    free(*refinement_level);
+                    *refinement_level = search[i].refinement_level;
+                    continue;
+                }
+            }
+            free(search[i].refinement_level);
+        }
+        return result;
+    }
+
+    // The thumbnail level of the board-presence prefilter: the requested one,
+    // or if that's <0, one picked from the image size
+    static int prefilter_level( const cv::Mat& image,
+                                int level_requested )
+    {
+        if(level_requested >= 0)
+            return level_requested;
+
+        const int size = std::min(image.cols, image.rows);
+        int level = 0;
+        while(level < MRGINGHAM_LEVEL_POLICY_NLEVELS-1 &&
+              (size >> (level+1)) >= MRGINGHAM_PREFILTER_MIN_SIZE)
+            level++;
+        return level;
+    }
+
+    // Returns <0 if cancelled
+    static double _chessboard_presence_score( const cv::Mat& image,
+                                              const int gridn,
+                                              int level,
+                                              const preprocess_options_t* preprocess,
+                                              mrgingham_cancel_t* cancel )
+    {
+        // Only the preprocessing applies to the thumbnail. In particular, the
+        // frame cache holds the levels of the search proper, so I don't pass it
+        std::vector<PointInt> points;
+        find_chessboard_corners_from_image_array( &points, image, level,
+                                                  false, NULL,
+                                                  preprocess, NULL,
+                                                  cancel );
+        if(mrgingham_is_cancelled(cancel))
+            return -1.0;
+
+        // The thumbnail has few candidates, so I simply look at all the pairs
+        const int N = (int)points.size();
+        std::vector<double> d2(N);
+        int Nplausible = 0;
+        for(int i=0; i<N; i++)
+        {
+            double d2_min = 1e30;
+            for(int j=0; j<N; j++)
+            {
+                const double dx = (double)(points[j].x - points[i].x);
+                const double dy = (double)(points[j].y - points[i].y);
+                d2[j] = (j == i) ? 1e30 : dx*dx + dy*dy;
+                if(d2[j] < d2_min) d2_min = d2[j];
+            }
+
+            // The diagonal neighbors are sqrt(2) further than the nearest one.
+            // I allow some more for the perspective
+            int Nnear = 0;
+            for(int j=0; j<N; j++)
+                if(d2[j] <= 1.5*1.5*d2_min)
+                    Nnear++;
+            if(Nnear >= 3)
+                Nplausible++;
+        }
+        return (double)Nplausible / (double)(gridn*gridn);
+    }
+
+    WPI_EXPORT
+    double chessboard_presence_score( const cv::Mat&              image,
+                                      const int                   gridn,
+                                      const preprocess_options_t* preprocess,
+                                      int                         prefilter_level_requested )
+    {
+        return _chessboard_presence_score(image, gridn,
+                                          prefilter_level(image, prefilter_level_requested),
+                                          preprocess, NULL);
+    }
+
+    // Sum of absolute differences of N pixels
+    static uint32_t row_sad( const uint8_t* a, const uint8_t* b, int N )
+    {
+        uint32_t sum = 0;
+        int      x   = 0;
+#ifdef FRAME_CACHE_SSE2
+        __m128i acc = _mm_setzero_si128();
+        for(; x+16 <= N; x += 16)
+            acc = _mm_add_epi64(acc,
+                                _mm_sad_epu8(_mm_loadu_si128((const __m128i*)&a[x]),
+                                             _mm_loadu_si128((const __m128i*)&b[x])));
+        sum = (uint32_t)_mm_cvtsi128_si32(acc) +
+              (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+        for(; x<N; x++)
+            sum += (uint32_t)abs((int)a[x] - (int)b[x]);
+        return sum;
+    }
+
+    // Compares the image to the frame_cache's reference frame, and marks the
+    // tiles that changed in cache->tile_changed. Returns how many there are. If
+    // there's nothing to compare to, I mark all the tiles, and return -1
+    static int frame_cache_compare( frame_cache_t* cache, const cv::Mat& image )
+    {
+        const int T = MRGINGHAM_FRAME_CACHE_TILE_SIZE;
+        const bool comparable =
+            image.type() == CV_8U &&
+            cache->frame.type() == CV_8U &&
+            cache->frame.cols   == image.cols &&
+            cache->frame.rows   == image.rows;
+
+        cache->Ntiles_x = (image.cols + T - 1) / T;
+        cache->Ntiles_y = (image.rows + T - 1) / T;
+        cache->tile_changed.assign(cache->Ntiles_x * cache->Ntiles_y, 1);
+        if(!comparable)
+            return -1;
+
+        std::vector<uint32_t> sad(cache->Ntiles_x, 0);
+        int Nchanged = 0;
+        for(int ty=0; ty<cache->Ntiles_y; ty++)
+        {
+            const int y0 = ty*T;
+            const int y1 = std::min(y0 + T, image.rows);
+            std::fill(sad.begin(), sad.end(), 0);
+            for(int y=y0; y<y1; y++)
+            {
+                const uint8_t* row     = image.ptr(y);
+                const uint8_t* row_ref = cache->frame.ptr(y);
+                for(int tx=0; tx<cache->Ntiles_x; tx++)
+                {
+                    const int x0 = tx*T;
+                    sad[tx] += row_sad(&row[x0], &row_ref[x0],
+                                       std::min(T, image.cols - x0));
+                }
+            }
+            for(int tx=0; tx<cache->Ntiles_x; tx++)
+            {
+                const int Npixels = (y1-y0) * std::min(T, image.cols - tx*T);
+                const bool changed =
+                    (double)sad[tx] > cache->change_threshold * (double)Npixels;
+                cache->tile_changed[tx + ty*cache->Ntiles_x] = changed;
+                if(changed) Nchanged++;
+            }
+        }
+        return Nchanged;
+    }
+
+    // Brings the frame_cache's reference frame up to date with the image: the
+    // tiles that changed are copied in. The others are left as they were, so
+    // that a slow drift accumulates, and is eventually noticed
+    static void frame_cache_update_frame( frame_cache_t* cache, const cv::Mat& image,
+                                          bool compared )
+    {
+        if(image.type() != CV_8U)
+        {
+            cache->frame.release();
+            return;
+        }
+        if(!compared)
+        {
+            cache->frame = image.clone();
+            return;
+        }
+
+        const int T = MRGINGHAM_FRAME_CACHE_TILE_SIZE;
+        for(int ty=0; ty<cache->Ntiles_y; ty++)
+            for(int tx=0; tx<cache->Ntiles_x; tx++)
+            {
+                if(!cache->tile_changed[tx + ty*cache->Ntiles_x])
+                    continue;
+                const int x0 = tx*T;
+                const int N  = std::min(T, image.cols - x0);
+                for(int y=ty*T; y<std::min((ty+1)*T, image.rows); y++)
+                    memcpy(&cache->frame.ptr(y)[x0], &image.ptr(y)[x0], N);
+            }
+    }
+
+    // *refinement_level is managed by realloc(). IT IS THE CALLER'S
+    // *RESPONSIBILITY TO free() IT
+    static int _find_chessboard_from_image_array_levels( std::vector<PointDouble>& points_out,
+                                                         signed char** refinement_level,
+                                                         const int gridn,
+                                                         const cv::Mat& image,
+                                                         const preprocess_options_t* preprocess,
+                                                         const search_options_t* search,
+                                                         int image_pyramid_level,
+                                                         bool debug,
+                                                         debug_sequence_t debug_sequence,
+                                                         const char* debug_image_filename)
 
     {
+        const int64_t t0 = mrgingham_now_ns();
+
+        search_stats_t stats;
+
+        // With a time budget, every stage of the search checks the clock
+        const int64_t deadline_ns =
+            (search != NULL && search->time_budget_ms > 0) ?
+            t0 + (int64_t)(search->time_budget_ms * 1e6) : 0;
+        mrgingham_cancel_t  cancel;
+        mrgingham_cancel_t* pcancel = NULL;
+        if(deadline_ns > 0)
+        {
+            mrgingham_cancel_init(&cancel, deadline_ns);
+            pcancel = &cancel;
+        }
+
+        level_policy_t* policy = NULL;
+        int levels[MRGINGHAM_LEVEL_POLICY_NLEVELS];
+        int result = -1;
+
+        // With a frame cache I first look at what changed since the previous
+        // frame. If nothing did, the previous result stands
+        frame_cache_t* frame_cache = (search != NULL) ? search->frame_cache : NULL;
+        bool frame_reused = false;
+        if(frame_cache != NULL)
+        {
+            frame_cache->Nframes++;
+            frame_cache->Ntiles_changed = frame_cache_compare(frame_cache, image);
+            frame_cache->Ntiles         = frame_cache->Ntiles_x * frame_cache->Ntiles_y;
+
+            if(frame_cache->Ntiles_changed == 0 && frame_cache->have_result &&
+               ( refinement_level == NULL || frame_cache->result <= 0 ||
+                 !frame_cache->refinement_level.empty() ))
+            {
+                frame_cache->Nframes_unchanged++;
+                if(debug)
+                    fprintf(stderr, "Frame cache: no tile changed. Reusing the previous result\n");
+
+                result = frame_cache->result;
+                points_out.insert(points_out.end(),
+                                  frame_cache->points.begin(), frame_cache->points.end());
+                if(result > 0 && refinement_level != NULL)
+                {
+                    const int N = (int)frame_cache->refinement_level.size();
+                    *refinement_level = (signed char*)realloc(*refinement_level, N);
+                    memcpy(*refinement_level, frame_cache->refinement_level.data(), N);
+                }
+                frame_reused = true;
+                goto done;
+            }
+
+            if(debug)
+                fprintf(stderr, "Frame cache: %d/%d tiles changed\n",
+                        frame_cache->Ntiles_changed, frame_cache->Ntiles);
+            frame_cache->generation++;
+        }
+
+        // The prefilter rejects the images that plainly have no board, before
+        // the search proper
+        if(search != NULL && search->prefilter_threshold > 0)
+        {
+            const int level = prefilter_level(image, search->prefilter_level);
+            stats.presence_score =
+                _chessboard_presence_score(image, gridn, level, preprocess, pcancel);
+            if(mrgingham_cancel_timed_out(pcancel))
+            {
+                stats.timed_out       = true;
+                stats.level_timed_out = level;
+                stats.stage_timed_out = (search_stage_t)pcancel->stage;
+                goto done;
+            }
+
+            if(debug)
+                fprintf(stderr, "Prefilter: presence score %.3f at level %d\n",
+                        stats.presence_score, level);
+            if(stats.presence_score < search->prefilter_threshold)
+            {
+                stats.prefilter_rejected = true;
+                goto done;
+            }
+        }
+
         if( image_pyramid_level >= 0)
-            return
+        {
+            result =
                 _find_chessboard_from_image_array( points_out,
                                                    refinement_level,
                                                    image,
                                                    image_pyramid_level,
                                                    gridn,
+                                                   preprocess, search,
                                                    debug, debug_sequence,
-                                                   debug_image_filename)
+                                                   debug_image_filename,
+                                                   NULL,
+                                                   pcancel)
                 ? image_pyramid_level : -1;
+            if(!mrgingham_cancel_timed_out(pcancel))
+                stats.Nlevels_completed = 1;
+            else
+            {
+                stats.timed_out       = true;
+                stats.level_timed_out = image_pyramid_level;
+                stats.stage_timed_out = (search_stage_t)pcancel->stage;
+            }
+            goto done;
+        }
 
-        for( image_pyramid_level=3; image_pyramid_level>=0; image_pyramid_level--)
         {
-            int result = _find_chessboard_from_image_array( points_out,
-                                                            refinement_level,
-                                                            image,
-                                                            image_pyramid_level,
-                                                            gridn,
-                                                            debug, debug_sequence,
-                                                            debug_image_filename)
-                ? image_pyramid_level : -1;
-            if(result >= 0) return result;
+            // With search->tile_mask the coarse levels mark where level 0
+            // should look, if we get that far
+            tile_mask_t  tile_mask;
+            tile_mask_t* ptile_mask =
+                (search != NULL && search->tile_mask && frame_cache == NULL) ?
+                &tile_mask : NULL;
+
+            policy = (search != NULL) ? search->level_policy : NULL;
+            int Nlevels;
+            if(policy == NULL)
+            {
+                Nlevels = 4;
+                for(int i=0; i<Nlevels; i++)
+                    levels[i] = 3-i;
+            }
+            else
+            {
+                Nlevels = level_policy_order(levels, policy, image.cols, image.rows);
+                if(debug)
+                {
+                    fprintf(stderr, "Level policy: trying levels");
+                    for(int i=0; i<Nlevels; i++)
+                        fprintf(stderr, " %d", levels[i]);
+                    fprintf(stderr, "\n");
+                }
+            }
+
+            if(search != NULL && search->parallel_levels && !debug && Nlevels > 1 &&
+               frame_cache == NULL)
+                result = _find_chessboard_from_image_array_parallel( points_out,
+                                                                     refinement_level,
+                                                                     &stats,
+                                                                     image,
+                                                                     levels, Nlevels,
+                                                                     gridn,
+                                                                     preprocess, search,
+                                                                     debug_sequence,
+                                                                     deadline_ns );
+            else
+            {
+                // Level 0 is either tried last, after all the coarser levels have
+                // filled in the tile mask, or first, with an empty mask, which then
+                // isn't used
+                for(int i=0; i<Nlevels && result < 0; i++)
+                {
+                    result = _find_chessboard_from_image_array( points_out,
+                                                                refinement_level,
+                                                                image,
+                                                                levels[i],
+                                                                gridn,
+                                                                preprocess, search,
+                                                                debug, debug_sequence,
+                                                                debug_image_filename,
+                                                                ptile_mask,
+                                                                pcancel)
+                        ? levels[i] : -1;
+
+                    // The tile mask is conservative, but a board that only level
+                    // 0 can see may not have registered at the coarser levels at
+                    // all. So if the masked level 0 fails, I look at the whole
+                    // image after all. An empty mask isn't applied
+                    if(result < 0 && levels[i] == 0 && ptile_mask != NULL &&
+                       std::find(tile_mask.active.begin(), tile_mask.active.end(), 0) != tile_mask.active.end() &&
+                       !mrgingham_cancel_timed_out(pcancel))
+                    {
+                        if(debug)
+                            fprintf(stderr, "Tile mask: the masked level 0 failed. Trying the whole image\n");
+                        tile_mask.active.clear();
+                        result = _find_chessboard_from_image_array( points_out,
+                                                                    refinement_level,
+                                                                    image,
+                                                                    0,
+                                                                    gridn,
+                                                                    preprocess, search,
+                                                                    debug, debug_sequence,
+                                                                    debug_image_filename,
+                                                                    ptile_mask,
+                                                                    pcancel)
+                            ? 0 : -1;
+                    }
+
+                    if(mrgingham_cancel_timed_out(pcancel))
+                    {
+                        stats.timed_out       = true;
+                        stats.level_timed_out = levels[i];
+                        stats.stage_timed_out = (search_stage_t)pcancel->stage;
+                        break;
+                    }
+                    stats.Nlevels_completed++;
+                }
+            }
+        }
+
+    done:
+        // A timeout during the refinement still produces a result: the points
+        // are refined as far as they got. Otherwise a timeout is reported as
+        // such
+        if(result < 0 && stats.timed_out)
+            result = MRGINGHAM_TIMED_OUT;
+
+        if(policy != NULL)
+            level_policy_update(policy, levels[0], result);
+
+        // A timed-out search is incomplete, so next time I search again
+        if(frame_cache != NULL && !frame_reused)
+        {
+            frame_cache->have_result = !stats.timed_out;
+            frame_cache->result      = result;
+            frame_cache->points      = points_out;
+            if(result > 0 && refinement_level != NULL)
+                frame_cache->refinement_level.assign(*refinement_level,
+                                                     *refinement_level + points_out.size());
+            else
+                frame_cache->refinement_level.clear();
+            frame_cache_update_frame(frame_cache, image,
+                                     frame_cache->Ntiles_changed >= 0);
+        }
+
+        if(debug && stats.timed_out)
+            fprintf(stderr, "Timed out at level %d after %d levels were searched\n",
+                    stats.level_timed_out, stats.Nlevels_completed);
+
+        if(search != NULL && search->stats != NULL)
+        {
+            stats.elapsed_ms = (double)(mrgingham_now_ns() - t0) / 1e6;
+            *search->stats = stats;
         }
-        return -1;
+        return result;
+    }
+
+    int find_chessboard_from_image_array( std::vector<PointDouble>& points_out,
+                                          signed char** refinement_level,
+                                          const int gridn,
+                                          const cv::Mat& image,
+                                          int image_pyramid_level,
+                                          bool debug,
+                                          debug_sequence_t debug_sequence,
+                                          const char* debug_image_filename)
+    {
+        return _find_chessboard_from_image_array_levels(points_out, refinement_level,
+                                                        gridn, image, NULL, NULL,
+                                                        image_pyramid_level,
+                                                        debug, debug_sequence,
+                                                        debug_image_filename);
+    }
+
+    int find_chessboard_from_image_array( std::vector<PointDouble>& points_out,
+                                          signed char** refinement_level,
+                                          const int gridn,
+                                          const cv::Mat& image,
+                                          const preprocess_options_t& preprocess,
+                                          const search_options_t& search,
+                                          int image_pyramid_level,
+                                          bool debug,
+                                          debug_sequence_t debug_sequence,
+                                          const char* debug_image_filename)
+    {
+        return _find_chessboard_from_image_array_levels(points_out, refinement_level,
+                                                        gridn, image, &preprocess, &search,
+                                                        image_pyramid_level,
+                                                        debug, debug_sequence,
+                                                        debug_image_filename);
     }
 
     // *refinement_level is managed by realloc(). IT IS THE CALLER'S
@@ -151,22 +780,32 @@ namespace mrgingham
                                          bool debug,
                                          debug_sequence_t debug_sequence)
     {
-        cv::Mat image = cv::imread(filename,
-                                   cv::IMREAD_IGNORE_ORIENTATION |
-                                   cv::IMREAD_GRAYSCALE);
-        if( image.data == NULL )
+        // PGMs I mmap() and use in place. Anything else I decode
+        mapped_image_t mapped;
+        cv::Mat image;
+        if(mapped_image_open(&mapped, filename))
+            image = mapped.image;
+        else
         {
-            fprintf(stderr, "%s:%d in %s(): Couldn't open image '%s'."
-                    " Sorry.\n", __FILE__, __LINE__, __func__, filename);
-            return -1;
+            image = cv::imread(filename,
+                               cv::IMREAD_IGNORE_ORIENTATION |
+                               cv::IMREAD_GRAYSCALE);
+            if( image.data == NULL )
+            {
+                fprintf(stderr, "%s:%d in %s(): Couldn't open image '%s'."
+                        " Sorry.\n", __FILE__, __LINE__, __func__, filename);
+                return -1;
+            }
         }
 
-        std::vector<PointInt> points;
-        return find_chessboard_from_image_array(points_out,
-                                                refinement_level,
-                                                gridn,
-                                                image, image_pyramid_level,
-                                                debug, debug_sequence,
-                                                filename);
+        int result = find_chessboard_from_image_array(points_out,
+                                                      refinement_level,
+                                                      gridn,
+                                                      image, image_pyramid_level,
+                                                      debug, debug_sequence,
+                                                      filename);
+        image.release();
+        mapped_image_close(&mapped);
+        return result;
     }
 };
@@ -35,6 +35,294 @@ namespace mrgingham
                                            bool debug = false,
                                            debug_sequence_t debug_sequence = debug_sequence_t());
 
+    // How the auto-level search (image_pyramid_level < 0) picks its pyramid
+    // levels. Without a policy, levels 3,2,1,0 are tried, in that order,
+    // whatever the image. With one, the coarsest level is chosen from the image
+    // size: it's the one where the image is 240-480 pixels across. In streaming
+    // use, the search then starts at the level that found the board in the
+    // recent frames. If that fails, the coarser levels are tried, and then the
+    // finer ones.
+    //
+    // The policy is updated by each search, so one object should be used for
+    // one stream of images, by one thread at a time
+#define MRGINGHAM_LEVEL_POLICY_NLEVELS 8
+    struct level_policy_t
+    {
+        // The recent detections at each level. Each search decays these, and
+        // adds 1 to the level where the board was found
+        float hits[MRGINGHAM_LEVEL_POLICY_NLEVELS];
+
+        // The level the most recent search started at, and the level where it
+        // found the board (<0 if it didn't)
+        int   start_level;
+        int   found_level;
+
+        // How many searches were done, and in how many of them the starting
+        // level found the board
+        int   Nsearches;
+        int   Nstart_hits;
+
+        level_policy_t() :
+            start_level(-1),
+            found_level(-1),
+            Nsearches(0),
+            Nstart_hits(0)
+        {
+            for(int i=0; i<MRGINGHAM_LEVEL_POLICY_NLEVELS; i++)
+                hits[i] = 0.0f;
+        }
+    };
+
+    // The fraction of the searches where the starting level found the board.
+    // 0 if no searches were done yet
+    WPI_EXPORT
+    double level_policy_hit_rate( const level_policy_t* policy );
+
+    // State for processing a stream of frames of a mostly-static scene. If
+    // search_options_t.frame_cache is non-NULL, each search first compares
+    // its image to the previous one, in tiles of
+    // MRGINGHAM_FRAME_CACHE_TILE_SIZE pixels. A tile has changed if the mean
+    // absolute difference of its pixels exceeds change_threshold. If no tile
+    // changed, the previous result is returned immediately. Otherwise the ChESS
+    // response at each pyramid level is recomputed only in and around the
+    // changed tiles, and so are the corner candidates; the rest are reused.
+    //
+    // The reference frame takes in only the tiles that changed, so a slow
+    // drift is noticed eventually. Still, a frame within the
+    // threshold reproduces the previous corners exactly: this shouldn't be
+    // used to measure the noise of the detections, as
+    // mrgingham-observe-pixel-uncertainty does. As with level_policy_t, one
+    // object should be used for one stream of images, with the same options,
+    // by one thread at a time. The members after the statistics are internal
+#define MRGINGHAM_FRAME_CACHE_TILE_SIZE 64
+#define MRGINGHAM_FRAME_CACHE_NLEVELS   11
+    struct frame_cache_t
+    {
+        // In gray levels
+        double change_threshold;
+
+        // How many frames were searched, and how many of those were unchanged
+        int    Nframes;
+        int    Nframes_unchanged;
+
+        // The most recent frame: how many tiles it has, and how many of them
+        // changed. Ntiles_changed < 0 if there was nothing to compare to
+        int    Ntiles;
+        int    Ntiles_changed;
+
+        // The pixels everything below was computed from, and which of its
+        // tiles changed in the current frame
+        cv::Mat              frame;
+        int                  Ntiles_x, Ntiles_y;
+        std::vector<uint8_t> tile_changed;
+
+        // Counts the frames that weren't skipped. Each level's data is
+        // reusable only if it was computed for the previous one of those
+        int    generation;
+        struct level_t
+        {
+            int                   generation;
+            // The ChESS response, before the connected-component search
+            cv::Mat               response;
+            // The corner candidates, if the level was searched for corners,
+            // and not just used to refine them
+            bool                  have_points;
+            std::vector<PointInt> points;
+        } levels[MRGINGHAM_FRAME_CACHE_NLEVELS];
+
+        // The result of the previous search
+        bool                     have_result;
+        int                      result;
+        std::vector<PointDouble> points;
+        std::vector<signed char> refinement_level;
+
+        frame_cache_t(double _change_threshold = 2.0) :
+            change_threshold(_change_threshold),
+            Nframes(0),
+            Nframes_unchanged(0),
+            Ntiles(0),
+            Ntiles_changed(-1),
+            Ntiles_x(0),
+            Ntiles_y(0),
+            generation(0),
+            have_result(false),
+            result(-1)
+        {
+            for(int i=0; i<MRGINGHAM_FRAME_CACHE_NLEVELS; i++)
+            {
+                levels[i].generation  = -1;
+                levels[i].have_points = false;
+            }
+        }
+    };
+
+    // Where a time-limited search ran out of time. See search_stats_t
+    enum search_stage_t
+    {
+        SEARCH_STAGE_NONE,
+        SEARCH_STAGE_CHESS,
+        SEARCH_STAGE_CONNECTED_COMPONENTS,
+        SEARCH_STAGE_GRID,
+        SEARCH_STAGE_REFINEMENT
+    };
+
+    // Returned by find_chessboard_from_image_array() if search_options_t
+    // had a time_budget_ms, and it ran out before the board was found
+#define MRGINGHAM_TIMED_OUT -2
+
+    // What a search did, reported through search_options_t.stats
+    struct search_stats_t
+    {
+        // Whether the time budget ran out, at which level and in which stage.
+        // If it ran out during the refinement, the board is still reported:
+        // its points are refined as far as they got
+        bool           timed_out;
+        int            level_timed_out;
+        search_stage_t stage_timed_out;
+
+        double         elapsed_ms;
+
+        // How many pyramid levels were searched to completion, successfully or
+        // not
+        int            Nlevels_completed;
+
+        // The board-presence prefilter's score, or <0 if it didn't run, and
+        // whether it rejected the image. See chessboard_presence_score()
+        double         presence_score;
+        bool           prefilter_rejected;
+
+        search_stats_t() :
+            timed_out(false),
+            level_timed_out(-1),
+            stage_timed_out(SEARCH_STAGE_NONE),
+            elapsed_ms(0.0),
+            Nlevels_completed(0),
+            presence_score(-1.0),
+            prefilter_rejected(false)
+        {}
+    };
+
+    // How the corners found at a coarse pyramid level are refined.
+    // REFINEMENT_PYRAMID repeats the ChESS detection at each finer level, down
+    // to level 0. REFINEMENT_SADDLE instead fits a saddle to the image
+    // intensities around each corner, at the level where it was found. This is
+    // much cheaper, since no full-resolution ChESS response is computed, but
+    // the corners are then only as good as that level allows.
+    // REFINEMENT_SADDLE_FULLRES adds a second fit in a small window of the
+    // full-resolution image
+    enum refinement_mode_t
+    {
+        REFINEMENT_PYRAMID,
+        REFINEMENT_SADDLE,
+        REFINEMENT_SADDLE_FULLRES
+    };
+
+    // The image preprocessing done by the library. Normally the caller
+    // preprocesses the full-resolution image (the mrgingham tool applies
+    // histogram equalization, CLAHE, and a blur), and passes the result in. The
+    // detection then runs on a downsampled copy of it, so much of that work is
+    // wasted. If these options are passed to find_chessboard_from_image_array()
+    // instead, the preprocessing is applied to each pyramid level after the
+    // downsampling, so it runs at the resolution the detection actually uses.
+    // The blur radius is in the pixels of each level. The default is no
+    // preprocessing
+    struct preprocess_options_t
+    {
+        // equalizeHist() followed by CLAHE
+        bool doclahe;
+        // box blur of size 1+2*blur_radius. <= 0 to disable
+        int  blur_radius;
+        preprocess_options_t() :
+            doclahe(false),
+            blur_radius(0)
+        {}
+    };
+
+    // How find_chessboard_from_image_array() searches for the board. The
+    // defaults are the plain search. None of these require any preprocessing
+    // to be enabled
+    //
+    // tile_mask is an optimization of the auto-level search (image_pyramid_level
+    // < 0). If the coarse levels all fail, and the search falls through to
+    // level 0, the full-resolution ChESS response is computed only in the
+    // tiles of the image where the coarse levels saw some corner-like response.
+    // If that fails, level 0 is searched again, on the whole image, so the
+    // results are the same as without the mask. This is faster if the board is
+    // found at level 0, and slower if it isn't found at all
+    //
+    // level_policy, if non-NULL, sets the order of the auto-level search, and
+    // is updated by it. See level_policy_t
+    //
+    // parallel_levels makes the auto-level search evaluate all its levels at
+    // the same time, each on its own thread, all reading the same input image.
+    // When a level finds the board, the levels after it in the search order are
+    // cancelled. The levels before it are allowed to finish, so the result is
+    // the same as that of the sequential search. This trades CPU time for
+    // latency. level 0 then doesn't wait for the coarser levels, so tile_mask
+    // is ignored. Debugging runs the levels sequentially
+    //
+    // time_budget_ms limits the time a search may take; <= 0 means no limit.
+    // Each stage checks the clock periodically, and gives up once the budget
+    // is spent: MRGINGHAM_TIMED_OUT is then returned. The checks are
+    // cooperative, so the search overshoots the budget slightly. If stats is
+    // non-NULL, each search writes what it did there
+    //
+    // refinement selects how the corners are refined, if they are. See
+    // refinement_mode_t
+    //
+    // frame_cache, if non-NULL, makes the search incremental, for streams of
+    // frames of a static scene. See frame_cache_t. It disables parallel_levels
+    // and tile_mask
+    //
+    // prefilter_threshold > 0 enables the board-presence prefilter: before the
+    // search, chessboard_presence_score() looks at a thumbnail of the image,
+    // and if the score is below the threshold, the search fails right away.
+    // This is cheap, and saves the whole search on images without a board. A
+    // lower threshold rejects fewer images with a board (and fewer without
+    // one). prefilter_level is the pyramid level of the thumbnail; < 0 picks
+    // one from the image size
+    struct search_options_t
+    {
+        bool              tile_mask;
+        level_policy_t*   level_policy;
+        bool              parallel_levels;
+        double            time_budget_ms;
+        search_stats_t*   stats;
+        refinement_mode_t refinement;
+        frame_cache_t*    frame_cache;
+        double            prefilter_threshold;
+        int               prefilter_level;
+        search_options_t() :
+            tile_mask(false),
+            level_policy(NULL),
+            parallel_levels(false),
+            time_budget_ms(0.0),
+            stats(NULL),
+            refinement(REFINEMENT_PYRAMID),
+            frame_cache(NULL),
+            prefilter_threshold(0.0),
+            prefilter_level(-1)
+        {}
+    };
+
+    // The board-presence prefilter used by find_chessboard_from_image_array()
+    // if search_options_t.prefilter_threshold > 0. The corner candidates are
+    // found at a coarse pyramid level: prefilter_level, or if that's < 0, the
+    // coarsest level that is at least MRGINGHAM_PREFILTER_MIN_SIZE pixels in
+    // each dimension. The CLAHE and blur in preprocess are applied to it. A
+    // candidate is plausibly a chessboard corner if at least 3 others are about
+    // as close as its nearest neighbor: on a board these are its neighbors
+    // along the grid and the diagonals. Returns the number of plausible
+    // candidates as a fraction of the gridn*gridn corners of a board. This is
+    // near 1 for a board that is fully resolved at that level, and near 0 for
+    // most images without one
+#define MRGINGHAM_PREFILTER_MIN_SIZE 240
+    WPI_EXPORT
+    double chessboard_presence_score( const cv::Mat&              image,
+                                      const int                   gridn,
+                                      const preprocess_options_t* preprocess      = NULL,
+                                      int                         prefilter_level = -1 );
+
     // set image_pyramid_level=0 to just use the image as is.
     //
     // image_pyramid_level > 0 cut down the image by a factor of 2 that many
@@ -62,6 +350,22 @@ namespace mrgingham
                                            debug_sequence_t                     debug_sequence = debug_sequence_t(),
                                            const char*                          debug_image_filename = NULL);
 
+    // Same as above, but the given preprocessing is applied to each pyramid
+    // level, and the search is done as the search options say. See
+    // preprocess_options_t and search_options_t. Returns MRGINGHAM_TIMED_OUT
+    // if the time budget ran out
+    WPI_EXPORT
+    int  find_chessboard_from_image_array( std::vector<mrgingham::PointDouble>& points_out,
+                                           signed char**                        refinement_level,
+                                           const int                            gridn,
+                                           const cv::Mat&                       image,
+                                           const preprocess_options_t&          preprocess,
+                                           const search_options_t&              search,
+                                           int                                  image_pyramid_level  = -1,
+                                           bool                                 debug                = false,
+                                           debug_sequence_t                     debug_sequence = debug_sequence_t(),
+                                           const char*                          debug_image_filename = NULL);
+
     // set image_pyramid_level=0 to just use the image as is.
     //
     // image_pyramid_level > 0 cut down the image by a factor of 2 that many
@@ -88,6 +392,27 @@ namespace mrgingham
                                          bool                                 debug               = false,
                                          debug_sequence_t                     debug_sequence = debug_sequence_t());
 
+    // A binary 8-bit PGM file, mmap-ed. image references the pixels in the
+    // mapping directly, so nothing is copied or decoded: the data comes
+    // straight from the page cache. The mapping is private, so image may be
+    // modified in place without touching the file. image is valid until
+    // mapped_image_close().
+    //
+    // mapped_image_open() returns false if the file can't be mapped: it isn't
+    // a binary PGM with maxval <= 255, or it can't be read, or this platform
+    // has no mmap(). Nothing is reported then; the caller should read the file
+    // the usual way, and report errors from there
+    struct mapped_image_t
+    {
+        cv::Mat image;
+        void*   map;
+        size_t  map_size;
+    };
+    WPI_EXPORT
+    bool mapped_image_open ( mapped_image_t* mapped, const char* filename );
+    WPI_EXPORT
+    void mapped_image_close( mapped_image_t* mapped );
+
     WPI_EXPORT
     bool find_grid_from_points( std::vector<mrgingham::PointDouble>& points_out,
                                 const std::vector<mrgingham::PointInt>& points,
@@ -204,17 +204,20 @@ static PyObject* find_chessboard(PyObject* NPY_UNUSED(self),
     PyObject*      result              = NULL;
     int            image_pyramid_level = -1;
     int            gridn               = 10;
+    int            adaptive_level      = 0;
 
     SET_SIGINT();
 
     char* keywords[] = { "image", "image_pyramid_level", "gridn",
+                         "adaptive_level",
                          NULL };
 
     if(!PyArg_ParseTupleAndKeywords( args, kwargs,
-                                     "O&|ii",
+                                     "O&|iii",
                                      keywords,
                                      PyArray_Converter, &image,
                                      &image_pyramid_level, &gridn,
+                                     &adaptive_level,
                                      NULL))
         goto done;
 
@@ -261,6 +264,7 @@ static PyObject* find_chessboard(PyObject* NPY_UNUSED(self),
 
                                             gridn,
                                             image_pyramid_level,
+                                            adaptive_level,
                                             &add_points) )
     {
         // This is allowed to fail. We possibly found no chessboard. This is
@@ -280,6 +284,20 @@ static PyObject* find_chessboard(PyObject* NPY_UNUSED(self),
     return result;
 }
 
+static PyObject* level_policy_stats(PyObject* NPY_UNUSED(self),
+                                    PyObject* NPY_UNUSED(args))
+{
+    int    start_level, found_level, Nsearches;
+    double hit_rate;
+    level_policy_stats_C(&start_level, &found_level, &hit_rate, &Nsearches);
+
+    return Py_BuildValue("{s:i,s:i,s:d,s:i}",
+                         "start_level", start_level,
+                         "found_level", found_level,
+                         "hit_rate",    hit_rate,
+                         "Nsearches",   Nsearches);
+}
+
 static const char py_ChESS_response_5_docstring[] =
 #include "ChESS_response_5.docstring.h"
     ;
@@ -289,11 +307,15 @@ static const char find_chessboard_corners_docstring[] =
 static const char find_chessboard_docstring[] =
 #include "find_chessboard.docstring.h"
     ;
+static const char level_policy_stats_docstring[] =
+#include "level_policy_stats.docstring.h"
+    ;
 static PyMethodDef methods[] =
     {
      PYMETHODDEF_ENTRY(py_,ChESS_response_5,        METH_VARARGS),
      PYMETHODDEF_ENTRY(,   find_chessboard_corners, METH_VARARGS | METH_KEYWORDS),
      PYMETHODDEF_ENTRY(,   find_chessboard,         METH_VARARGS | METH_KEYWORDS),
+     PYMETHODDEF_ENTRY(,   level_policy_stats,      METH_NOARGS),
      {}
     };
 
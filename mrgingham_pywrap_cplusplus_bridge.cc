@@ -50,6 +50,10 @@ bool find_chessboard_corners_from_image_array_C( // in
                        1. / (double)FIND_GRID_SCALE);
 }
 
+// The history used by the adaptive_level searches. Python calls us with the
+// GIL held, so one is enough
+static mrgingham::level_policy_t level_policy;
+
 extern "C"
 bool find_chessboard_from_image_array_C( // in
                                         int Nrows, int Ncols,
@@ -63,6 +67,8 @@ bool find_chessboard_from_image_array_C( // in
                                         // good scaling level. Try this first
                                         int image_pyramid_level,
 
+                                        bool adaptive_level,
+
                                         bool (*add_points)(double* xy, int N) )
 {
     cv::Mat cvimage(Nrows, Ncols, CV_8UC1,
@@ -70,12 +76,18 @@ bool find_chessboard_from_image_array_C( // in
 
     std::vector<mrgingham::PointDouble> out_points;
 
+    mrgingham::search_options_t search;
+    if(adaptive_level)
+        search.level_policy = &level_policy;
+
     signed char* refinement_level = NULL;
     bool result =
         (find_chessboard_from_image_array( out_points,
                                            &refinement_level,
                                            gridn,
                                            cvimage,
+                                           mrgingham::preprocess_options_t(),
+                                           search,
                                            image_pyramid_level ) >= 0);
     free(refinement_level);
     if( !result ) return false;
@@ -85,3 +97,16 @@ bool find_chessboard_from_image_array_C( // in
     return
         (*add_points)( &out_points[0].x, (int)out_points.size() );
 }
+
+extern "C"
+void level_policy_stats_C( // out
+                          int*    start_level,
+                          int*    found_level,
+                          double* hit_rate,
+                          int*    Nsearches )
+{
+    *start_level = level_policy.start_level;
+    *found_level = level_policy.found_level;
+    *hit_rate    = mrgingham::level_policy_hit_rate(&level_policy);
+    *Nsearches   = level_policy.Nsearches;
+}
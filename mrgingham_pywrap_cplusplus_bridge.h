@@ -29,7 +29,21 @@ bool find_chessboard_from_image_array_C( // in
                                         // good scaling level. Try this first
                                         int image_pyramid_level,
 
+                                        // With image_pyramid_level < 0: search
+                                        // the levels starting with the one
+                                        // where the previous calls found the
+                                        // board
+                                        bool adaptive_level,
+
                                         bool (*add_points)(double* xy, int N) );
+
+// Reports on the adaptive_level searches done by
+// find_chessboard_from_image_array_C()
+void level_policy_stats_C( // out
+                          int*    start_level,
+                          int*    found_level,
+                          double* hit_rate,
+                          int*    Nsearches );
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "server_protocol.hh"
+
+namespace mrgingham
+{
+
+bool server_read_all( int fd, void* buf, size_t len )
+{
+    size_t Nread = 0;
+    while(Nread < len)
+    {
+        ssize_t n = read(fd, &((uint8_t*)buf)[Nread], len - Nread);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        Nread += n;
+    }
+    return true;
+}
+
+bool server_write_all( int fd, const void* buf, size_t len )
+{
+    size_t Nwritten = 0;
+    while(Nwritten < len)
+    {
+        // MSG_NOSIGNAL: if the other side went away, I want an error, not a
+        // SIGPIPE
+        ssize_t n = send(fd, &((const uint8_t*)buf)[Nwritten], len - Nwritten,
+                         MSG_NOSIGNAL);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n <= 0)
+            return false;
+        Nwritten += n;
+    }
+    return true;
+}
+
+int server_connect( const char* socket_path )
+{
+    struct sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if( strlen(socket_path) >= sizeof(addr.sun_path) )
+    {
+        fprintf(stderr, "Socket path '%s' is too long\n", socket_path);
+        return -1;
+    }
+    strcpy(addr.sun_path, socket_path);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0)
+    {
+        fprintf(stderr, "Couldn't create socket: %s\n", strerror(errno));
+        return -1;
+    }
+    if( connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 )
+    {
+        fprintf(stderr, "Couldn't connect to '%s': %s\n", socket_path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// The wire protocol of the mrgingham server (mrgingham --server SOCKET) and its
+// client (mrgingham-client). The server listens on a Unix domain socket. A
+// client connects, and sends any number of requests over the connection. Each
+// request gets one reply, in order. All the fields are in the native byte order:
+// this is a local socket, so both sides run on the same machine.
+//
+// A request is a server_request_t followed by payload_size bytes of payload.
+// The payload is
+//
+// - SERVER_SOURCE_PATH:    the path to an image on disk, readable by the
+//                          server. Not '\0'-terminated
+// - SERVER_SOURCE_ENCODED: the contents of an image file (.jpg, .png, ...)
+// - SERVER_SOURCE_RAW:     width*height bytes of 8-bit grayscale pixels, with
+//                          no padding between rows
+//
+// A reply is a server_reply_t followed by N server_reply_point_t. status is
+// the pyramid level where the board was found (>= 0), SERVER_STATUS_NOTFOUND or
+// SERVER_STATUS_BADIMAGE. If the request itself is malformed, the server closes
+// the connection
+
+namespace mrgingham
+{
+
+#define SERVER_REQUEST_MAGIC "MRQ1"
+#define SERVER_REPLY_MAGIC   "MRR1"
+
+// The largest payload the server accepts
+#define SERVER_MAX_PAYLOAD_SIZE (1ULL << 30)
+
+// The largest gridn the server accepts. The blur radius and the pyramid level
+// are clamped to these
+#define SERVER_MAX_GRIDN         100
+#define SERVER_MAX_BLUR_RADIUS   100
+#define SERVER_MAX_PYRAMID_LEVEL 10
+
+enum server_source_t
+{
+    SERVER_SOURCE_PATH    = 0,
+    SERVER_SOURCE_ENCODED = 1,
+    SERVER_SOURCE_RAW     = 2
+};
+
+// The flags default to the mrgingham defaults: CLAHE and refinement on
+#define SERVER_FLAG_NOCLAHE  (1U << 0)
+#define SERVER_FLAG_NOREFINE (1U << 1)
+#define SERVER_FLAG_BLOBS    (1U << 2)
+
+#define SERVER_STATUS_NOTFOUND -1
+#define SERVER_STATUS_BADIMAGE -2
+
+// All the structures are explicitly padded, so that the layout doesn't depend
+// on the compiler
+struct server_request_t
+{
+    char     magic[4];
+    uint32_t source;            // server_source_t
+    int32_t  gridn;
+    int32_t  image_pyramid_level;
+    int32_t  blur_radius;
+    uint32_t flags;             // SERVER_FLAG_...
+    uint32_t width, height;     // SERVER_SOURCE_RAW only
+    uint64_t payload_size;
+};
+
+struct server_reply_t
+{
+    char     magic[4];
+    int32_t  status;
+    int32_t  N;
+    uint32_t reserved;
+};
+
+struct server_reply_point_t
+{
+    double   x, y;
+    int32_t  level;
+    uint32_t reserved;
+};
+
+// Blocking read/write of exactly len bytes. Return false on error or if the
+// other side closed the connection
+bool server_read_all ( int fd, void*       buf, size_t len );
+bool server_write_all( int fd, const void* buf, size_t len );
+
+// Connects to the server listening on socket_path. Returns the fd, or <0 on
+// error
+int server_connect( const char* socket_path );
+
+}
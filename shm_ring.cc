@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "shm_ring.hh"
+
+namespace mrgingham
+{
+
+// The slots are cache-line aligned
+static uint64_t align64(uint64_t x)
+{
+    return (x + 63) & ~(uint64_t)63;
+}
+
+static uint64_t frames_offset(void)
+{
+    return align64(sizeof(shm_ring_header_t));
+}
+
+// Copies the layout of the ring from its header
+static void set_layout(shm_ring_t* ring, const shm_ring_header_t* header)
+{
+    ring->Nslots           = header->Nslots;
+    ring->max_width        = header->max_width;
+    ring->max_height       = header->max_height;
+    ring->gridn            = header->gridn;
+    ring->frame_slot_size  = header->frame_slot_size;
+    ring->result_slot_size = header->result_slot_size;
+    ring->results_offset   = frames_offset() + (uint64_t)header->Nslots * header->frame_slot_size;
+}
+
+bool shm_ring_create( shm_ring_t* ring, const char* name,
+                      uint32_t Nslots,
+                      uint32_t max_width, uint32_t max_height,
+                      uint32_t gridn )
+{
+    shm_ring_header_t header = {};
+    memcpy(header.magic, SHM_RING_MAGIC, 8);
+    header.Nslots           = Nslots;
+    header.max_width        = max_width;
+    header.max_height       = max_height;
+    header.gridn            = gridn;
+    header.frame_slot_size  = align64(sizeof(shm_frame_header_t) +
+                                      (uint64_t)max_width*max_height);
+    header.result_slot_size = align64(sizeof(shm_result_header_t) +
+                                      (uint64_t)gridn*gridn*sizeof(shm_result_point_t));
+
+    set_layout(ring, &header);
+    const uint64_t size = ring->results_offset + Nslots*header.result_slot_size;
+
+    // Only this user can get at the frames
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(fd < 0)
+    {
+        fprintf(stderr, "Couldn't create shared memory '%s': %s\n", name, strerror(errno));
+        return false;
+    }
+    if( ftruncate(fd, size) != 0 )
+    {
+        fprintf(stderr, "Couldn't size shared memory '%s': %s\n", name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return false;
+    }
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED)
+    {
+        fprintf(stderr, "Couldn't mmap shared memory '%s': %s\n", name, strerror(errno));
+        shm_unlink(name);
+        return false;
+    }
+
+    // ftruncate() zeroed everything, so no slot is published yet. I write the
+    // magic last: the detector checks it when attaching
+    ring->header = (shm_ring_header_t*)p;
+    ring->size   = size;
+    memcpy(ring->header, &header, sizeof(header));
+    memset(ring->header->magic, 0, 8);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(ring->header->magic, SHM_RING_MAGIC, 8);
+    return true;
+}
+
+bool shm_ring_attach( shm_ring_t* ring, const char* name )
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if(fd < 0)
+    {
+        fprintf(stderr, "Couldn't open shared memory '%s': %s\n", name, strerror(errno));
+        return false;
+    }
+
+    struct stat sb;
+    if( fstat(fd, &sb) != 0 || sb.st_size < (off_t)sizeof(shm_ring_header_t) )
+    {
+        fprintf(stderr, "Shared memory '%s' is too small to be a frame ring\n", name);
+        close(fd);
+        return false;
+    }
+    void* p = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(p == MAP_FAILED)
+    {
+        fprintf(stderr, "Couldn't mmap shared memory '%s': %s\n", name, strerror(errno));
+        return false;
+    }
+
+    // I validate a snapshot of the header, and use only that snapshot from
+    // now on. The slot sizes are checked before anything is multiplied by
+    // them, so nothing overflows
+    shm_ring_header_t header;
+    memcpy(&header, p, sizeof(header));
+    const uint64_t size = sb.st_size;
+    if( 0 != memcmp(header.magic, SHM_RING_MAGIC, 8) ||
+        header.Nslots == 0 ||
+        header.frame_slot_size  % 64 != 0 || header.frame_slot_size  > size ||
+        header.result_slot_size % 64 != 0 || header.result_slot_size > size ||
+        header.frame_slot_size  < sizeof(shm_frame_header_t) ||
+        header.result_slot_size < sizeof(shm_result_header_t) ||
+        (uint64_t)header.gridn*header.gridn >
+          (header.result_slot_size - sizeof(shm_result_header_t)) / sizeof(shm_result_point_t) ||
+        size < frames_offset() ||
+        header.Nslots > (size - frames_offset()) / (header.frame_slot_size + header.result_slot_size) )
+    {
+        fprintf(stderr, "Shared memory '%s' isn't a valid frame ring\n", name);
+        munmap(p, sb.st_size);
+        return false;
+    }
+
+    ring->header = (shm_ring_header_t*)p;
+    ring->size   = sb.st_size;
+    set_layout(ring, &header);
+    return true;
+}
+
+void shm_ring_detach( shm_ring_t* ring )
+{
+    munmap(ring->header, ring->size);
+    ring->header = NULL;
+}
+
+shm_frame_header_t* shm_ring_frame( const shm_ring_t* ring, uint64_t sequence )
+{
+    return (shm_frame_header_t*)
+        &((uint8_t*)ring->header)[frames_offset() +
+                                  (sequence % ring->Nslots) * ring->frame_slot_size];
+}
+
+shm_result_header_t* shm_ring_result( const shm_ring_t* ring, uint64_t sequence )
+{
+    return (shm_result_header_t*)
+        &((uint8_t*)ring->header)[ring->results_offset +
+                                  (sequence % ring->Nslots) * ring->result_slot_size];
+}
+
+// I spin briefly, then yield, then sleep. Frames arrive at camera rates, so
+// sleeping for a bit costs nothing, while spinning would eat a core per thread
+void shm_ring_backoff( int* Nwaits )
+{
+    (*Nwaits)++;
+    if(*Nwaits < 100)
+        return;
+    if(*Nwaits < 200)
+    {
+        sched_yield();
+        return;
+    }
+    struct timespec t = {0, 200000};
+    nanosleep(&t, NULL);
+}
+
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// A ring of raw 8-bit grayscale frames in POSIX shared memory, with a parallel
+// ring of detection results. Used by "mrgingham --shm NAME" to process frames
+// that a capture process already holds in memory, without writing them to disk
+// or encoding them.
+//
+// The producer (the capture process) creates the ring. It writes frame number
+// "sequence" into slot sequence % Nslots, and publishes it by storing
+// sequence+1 into the slot's frame header. The detector workers claim frame
+// numbers from a shared counter, process each frame, write the corners into the
+// matching result slot, and publish them by storing sequence+1 into the result
+// header. The producer may reuse a slot once the result for its previous frame
+// has been published, so it should read that result before reusing the slot.
+// When the producer is done, it sets "closed", and the detector exits once all
+// the published frames are processed.
+//
+// There are no locks: every field is written by one side only, and the
+// publishing stores/loads are release/acquire atomics. Any number of detector
+// threads (and processes) may consume from the same ring
+
+namespace mrgingham
+{
+
+#define SHM_RING_MAGIC "MRGRING1"
+
+struct shm_ring_header_t
+{
+    char     magic[8];
+    uint32_t Nslots;
+    uint32_t max_width, max_height;
+    // The result slots hold gridn*gridn points
+    uint32_t gridn;
+    uint64_t frame_slot_size;
+    uint64_t result_slot_size;
+
+    // Written by the producer
+    alignas(64) uint64_t Nframes_published;
+    uint32_t closed;
+
+    // Shared by the consumers: the next frame number to claim
+    alignas(64) uint64_t next_claim;
+};
+
+struct shm_frame_header_t
+{
+    // sequence+1 of the frame in this slot. 0 if the slot was never written
+    uint64_t published;
+    uint32_t width, height;
+    // bytes between successive rows; >= width
+    uint32_t stride;
+    uint32_t reserved;
+    // The pixels follow, at offset sizeof(shm_frame_header_t)
+};
+
+struct shm_result_point_t
+{
+    double   x, y;
+    int32_t  level;
+    uint32_t reserved;
+};
+
+struct shm_result_header_t
+{
+    // sequence+1 of the frame whose result is in this slot. 0 if none yet
+    uint64_t published;
+    // The pyramid level where the board was found (>= 0), or <0 if it wasn't
+    int32_t  status;
+    int32_t  N;
+    // N shm_result_point_t follow
+};
+
+struct shm_ring_t
+{
+    shm_ring_header_t* header;
+    size_t             size;
+
+    // The layout of the ring. I copy it out of the header when creating or
+    // attaching, and validate it then. The other side can write to the
+    // shared header at any time, so it's never read again
+    uint32_t Nslots;
+    uint32_t max_width, max_height;
+    uint32_t gridn;
+    uint64_t frame_slot_size;
+    uint64_t result_slot_size;
+    uint64_t results_offset;
+};
+
+// Creates a new ring (the producer side). Fails if one with this name exists
+bool shm_ring_create( shm_ring_t* ring, const char* name,
+                      uint32_t Nslots,
+                      uint32_t max_width, uint32_t max_height,
+                      uint32_t gridn );
+// Attaches to an existing ring (the detector side)
+bool shm_ring_attach( shm_ring_t* ring, const char* name );
+void shm_ring_detach( shm_ring_t* ring );
+
+shm_frame_header_t*  shm_ring_frame ( const shm_ring_t* ring, uint64_t sequence );
+shm_result_header_t* shm_ring_result( const shm_ring_t* ring, uint64_t sequence );
+
+static inline uint8_t* shm_frame_pixels( shm_frame_header_t* frame )
+{
+    return (uint8_t*)&frame[1];
+}
+static inline shm_result_point_t* shm_result_points( shm_result_header_t* result )
+{
+    return (shm_result_point_t*)&result[1];
+}
+
+// The publishing primitives. The payload must be completely written before
+// publishing
+static inline void shm_publish( uint64_t* published, uint64_t sequence )
+{
+    __atomic_store_n(published, sequence+1, __ATOMIC_RELEASE);
+}
+static inline bool shm_is_published( uint64_t* published, uint64_t sequence )
+{
+    return __atomic_load_n(published, __ATOMIC_ACQUIRE) == sequence+1;
+}
+
+// Sleep used by both sides while polling for the other side
+void shm_ring_backoff( int* Nwaits );
+
+}
@@ -0,0 +1,350 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/wait.h>
+
+#include "tar_reader.hh"
+
+extern char** environ;
+
+namespace mrgingham
+{
+
+#define TAR_BLOCK 512
+
+// The ustar header. All the numeric fields are ASCII octal
+struct tar_header_t
+{
+    char name    [100];
+    char mode    [8];
+    char uid     [8];
+    char gid     [8];
+    char size    [12];
+    char mtime   [12];
+    char chksum  [8];
+    char typeflag;
+    char linkname[100];
+    char magic   [6];
+    char version [2];
+    char uname   [32];
+    char gname   [32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix  [155];
+    char pad     [12];
+};
+
+// Starts "argv0 -dc" reading from fd, and returns the read end of its stdout
+static FILE* spawn_decompressor( pid_t* pid, const char* argv0, int fd )
+{
+    int pipefd[2];
+    if(pipe(pipefd) != 0)
+        return NULL;
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2 (&actions, fd,        0);
+    posix_spawn_file_actions_adddup2 (&actions, pipefd[1], 1);
+    posix_spawn_file_actions_addclose(&actions, pipefd[0]);
+
+    char* argv[] = { (char*)argv0, (char*)"-dc", NULL };
+    int result = posix_spawnp(pid, argv0, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(pipefd[1]);
+
+    if(result != 0)
+    {
+        fprintf(stderr, "Couldn't run '%s' to decompress the archive: %s\n",
+                argv0, strerror(result));
+        close(pipefd[0]);
+        return NULL;
+    }
+    return fdopen(pipefd[0], "rb");
+}
+
+bool tar_open( tar_reader_t* tar, const char* path )
+{
+    tar->path             = path;
+    tar->fp               = NULL;
+    tar->pid_decompressor = 0;
+    tar->remaining        = 0;
+    tar->padding          = 0;
+
+    if(0 == strcmp(path, "-"))
+    {
+        tar->fp = stdin;
+        return true;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0)
+    {
+        fprintf(stderr, "Couldn't open archive '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+
+    uint8_t magic[6] = {};
+    ssize_t Nmagic = read(fd, magic, sizeof(magic));
+    lseek(fd, 0, SEEK_SET);
+
+    const char* decompressor = NULL;
+    if     (Nmagic >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+        decompressor = "gzip";
+    else if(Nmagic >= 4 && 0 == memcmp(magic, "\x28\xb5\x2f\xfd", 4))
+        decompressor = "zstd";
+    else if(Nmagic >= 6 && 0 == memcmp(magic, "\xfd" "7zXZ\x00", 6))
+        decompressor = "xz";
+    else if(Nmagic >= 3 && 0 == memcmp(magic, "BZh", 3))
+        decompressor = "bzip2";
+
+    if(decompressor == NULL)
+        tar->fp = fdopen(fd, "rb");
+    else
+    {
+        tar->fp = spawn_decompressor(&tar->pid_decompressor, decompressor, fd);
+        close(fd);
+    }
+
+    if(tar->fp == NULL)
+    {
+        fprintf(stderr, "Couldn't read archive '%s'\n", path);
+        if(decompressor == NULL)
+            close(fd);
+        return false;
+    }
+    return true;
+}
+
+bool tar_close( tar_reader_t* tar )
+{
+    bool result = (tar->fp != NULL) && !ferror(tar->fp);
+
+    if(tar->fp != NULL && tar->fp != stdin)
+        fclose(tar->fp);
+    tar->fp = NULL;
+
+    if(tar->pid_decompressor > 0)
+    {
+        int status = 0;
+        pid_t pid;
+        do
+        {
+            pid = waitpid(tar->pid_decompressor, &status, 0);
+        } while(pid < 0 && errno == EINTR);
+
+        if(pid != tar->pid_decompressor)
+        {
+            fprintf(stderr, "Couldn't wait for the decompressor of '%s': %s\n",
+                    tar->path, strerror(errno));
+            result = false;
+        }
+        else if( !WIFEXITED(status) || WEXITSTATUS(status) != 0 )
+        {
+            // I may have stopped reading early (at the end-of-archive marker),
+            // and the decompressor then dies of SIGPIPE. That's fine
+            if( !(WIFSIGNALED(status) && WTERMSIG(status) == SIGPIPE) )
+            {
+                fprintf(stderr, "Decompressing '%s' failed\n", tar->path);
+                result = false;
+            }
+        }
+        tar->pid_decompressor = 0;
+    }
+    return result;
+}
+
+static bool read_exactly( tar_reader_t* tar, void* buf, size_t len )
+{
+    return len == 0 || 1 == fread(buf, len, 1, tar->fp);
+}
+
+// Reads and throws away len bytes. The archive may be a pipe, so I can't seek
+static bool discard( tar_reader_t* tar, uint64_t len )
+{
+    char buf[65536];
+    while(len > 0)
+    {
+        size_t n = len < sizeof(buf) ? len : sizeof(buf);
+        if(!read_exactly(tar, buf, n))
+            return false;
+        len -= n;
+    }
+    return true;
+}
+
+// Numeric fields are octal, or, for large values, base-256 with the high bit of
+// the first byte set
+static uint64_t parse_number( const char* field, int len )
+{
+    uint64_t x = 0;
+    if( (uint8_t)field[0] & 0x80 )
+    {
+        x = (uint8_t)field[0] & 0x7f;
+        for(int i=1; i<len; i++)
+            x = (x << 8) | (uint8_t)field[i];
+        return x;
+    }
+    for(int i=0; i<len && field[i] != '\0' && field[i] != ' '; i++)
+        if(field[i] >= '0' && field[i] <= '7')
+            x = x*8 + (field[i] - '0');
+    return x;
+}
+
+static bool checksum_ok( const tar_header_t* header )
+{
+    // The checksum is computed with the checksum field itself set to spaces
+    const uint8_t* bytes = (const uint8_t*)header;
+    uint64_t sum = 0;
+    for(int i=0; i<TAR_BLOCK; i++)
+        sum += (i >= (int)offsetof(tar_header_t, chksum) &&
+                i <  (int)(offsetof(tar_header_t, chksum) + sizeof(header->chksum))) ?
+            ' ' : bytes[i];
+    return sum == parse_number(header->chksum, sizeof(header->chksum));
+}
+
+// A pax extended header is a sequence of "LENGTH key=value\n" records. I only
+// care about "path"
+static bool pax_path( std::string* path, const std::vector<uint8_t>& data )
+{
+    bool found = false;
+    size_t i = 0;
+    while(i < data.size())
+    {
+        size_t len = 0, j = i;
+        while(j < data.size() && data[j] >= '0' && data[j] <= '9')
+            len = len*10 + (data[j++] - '0');
+        if(len == 0 || i + len > data.size() || j >= data.size() || data[j] != ' ')
+            break;
+        const char* record     = (const char*)&data[j+1];
+        size_t      record_len = i + len - (j+1);
+        if(record_len > 5 && 0 == strncmp(record, "path=", 5))
+        {
+            // record_len includes the trailing '\n'
+            path->assign(&record[5], record_len - 6);
+            found = true;
+        }
+        i += len;
+    }
+    return found;
+}
+
+int tar_next( tar_reader_t* tar, std::string* name, uint64_t* size )
+{
+    // Whatever the caller didn't consume
+    if(!tar_skip(tar))
+        return -1;
+
+    // GNU long names and pax paths apply to the following member
+    std::string          name_override;
+    std::vector<uint8_t> extended;
+
+    while(true)
+    {
+        tar_header_t header;
+        static_assert(sizeof(header) == TAR_BLOCK, "tar header must be one block");
+
+        if(!read_exactly(tar, &header, sizeof(header)))
+        {
+            // A missing end-of-archive marker is common enough: I accept it
+            if(feof(tar->fp))
+                return 0;
+            fprintf(stderr, "Error reading archive '%s'\n", tar->path);
+            return -1;
+        }
+
+        // The end of the archive is marked by zero blocks
+        if(header.name[0] == '\0' && header.chksum[0] == '\0')
+            return 0;
+
+        if(!checksum_ok(&header))
+        {
+            fprintf(stderr, "Archive '%s' is corrupt, or isn't a tar archive\n", tar->path);
+            return -1;
+        }
+
+        const uint64_t member_size = parse_number(header.size, sizeof(header.size));
+        tar->remaining = member_size;
+        tar->padding   = (TAR_BLOCK - member_size % TAR_BLOCK) % TAR_BLOCK;
+
+        switch(header.typeflag)
+        {
+        case '0': case '\0': case '7':
+            // A regular file
+            if(!name_override.empty())
+                *name = name_override;
+            else
+            {
+                name->clear();
+                if( 0 == strncmp(header.magic, "ustar", 5) && header.prefix[0] != '\0' )
+                {
+                    name->assign(header.prefix, strnlen(header.prefix, sizeof(header.prefix)));
+                    name->push_back('/');
+                }
+                name->append(header.name, strnlen(header.name, sizeof(header.name)));
+            }
+            *size = member_size;
+            return 1;
+
+        case 'L':
+            // GNU long name: the data is the name of the next member
+            if(!tar_read(tar, &extended))
+                return -1;
+            name_override.assign((const char*)extended.data(),
+                                 strnlen((const char*)extended.data(), extended.size()));
+            break;
+
+        case 'x':
+            // pax extended header for the next member
+            if(!tar_read(tar, &extended))
+                return -1;
+            pax_path(&name_override, extended);
+            break;
+
+        default:
+            // Directories, links, pax global headers, ...
+            if(!tar_skip(tar))
+                return -1;
+            name_override.clear();
+            break;
+        }
+    }
+}
+
+bool tar_read( tar_reader_t* tar, std::vector<uint8_t>* data )
+{
+    // The size comes from the archive. I don't trust it to allocate
+    if(tar->remaining > TAR_MAX_MEMBER_SIZE)
+    {
+        fprintf(stderr, "Archive '%s' has a member of %llu bytes; the most I read is %llu\n",
+                tar->path, (unsigned long long)tar->remaining,
+                (unsigned long long)TAR_MAX_MEMBER_SIZE);
+        return false;
+    }
+    data->resize(tar->remaining);
+    if(!read_exactly(tar, data->data(), tar->remaining))
+    {
+        fprintf(stderr, "Archive '%s' is truncated\n", tar->path);
+        return false;
+    }
+    tar->remaining = 0;
+    return tar_skip(tar);
+}
+
+bool tar_skip( tar_reader_t* tar )
+{
+    if(!discard(tar, tar->remaining + tar->padding))
+    {
+        fprintf(stderr, "Archive '%s' is truncated\n", tar->path);
+        return false;
+    }
+    tar->remaining = 0;
+    tar->padding   = 0;
+    return true;
+}
+
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+// A sequential reader of tar archives, used by the mrgingham tool to process
+// images straight out of an archive, without extracting it. The archive is
+// read front-to-back, so it may come from a pipe. Compressed archives (gzip,
+// zstd, xz, bzip2) are detected by their magic bytes, and decompressed by
+// piping them through the corresponding commandline tool. The ustar, GNU
+// (long names) and pax (path records) formats are supported. Only the regular
+// files are reported; everything else is skipped
+
+
+namespace mrgingham
+{
+
+struct tar_reader_t
+{
+    const char* path;
+    FILE*       fp;
+
+    // The decompressor child process, or 0 if the archive isn't compressed
+    pid_t       pid_decompressor;
+
+    // Bytes of the current member not yet consumed, and the padding after them
+    uint64_t    remaining;
+    uint64_t    padding;
+};
+
+// Opens the archive at path. "-" means stdin; compressed archives are only
+// detected when reading from a file
+bool tar_open( tar_reader_t* tar, const char* path );
+
+// Returns false if reading the archive failed, or the decompressor failed
+bool tar_close( tar_reader_t* tar );
+
+// Advances to the next regular-file member. Returns 1 if one was found: its
+// path is in *name, and its size in *size. Its data can then be read with
+// tar_read(); if it isn't, the next tar_next() skips it. Returns 0 at the end
+// of the archive and -1 on error
+int tar_next( tar_reader_t* tar, std::string* name, uint64_t* size );
+
+// The largest member tar_read() reads into memory
+#define TAR_MAX_MEMBER_SIZE (1ULL << 30)
+
+// Reads the current member into *data. Fails if it's larger than
+// TAR_MAX_MEMBER_SIZE
+bool tar_read( tar_reader_t* tar, std::vector<uint8_t>* data );
+bool tar_skip( tar_reader_t* tar );
+
+}
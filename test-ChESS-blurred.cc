@@ -0,0 +1,160 @@
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+
+#include "ChESS.h"
+
+// Checks that the fused blur+ChESS kernel (mrgingham_ChESS_response_5_blurred())
+// and mrgingham_box_blurred_pixel() produce exactly what cv::blur() followed by
+// mrgingham_ChESS_response_5() produces. Each blur radius is checked on each
+// given image, or on a random image if none are given. Any differences are
+// reported on stderr, and the exit status is nonzero
+
+static bool check(const cv::Mat& image, const char* name, int blur_radius)
+{
+    const int w = image.cols;
+    const int h = image.rows;
+
+    cv::Mat blurred;
+    cv::blur(image, blurred, cv::Size(1 + 2*blur_radius, 1 + 2*blur_radius));
+
+    int Ndiffer_pixel = 0;
+    for(int y=0; y<h; y++)
+        for(int x=0; x<w; x++)
+            if(blurred.ptr(y)[x] !=
+               mrgingham_box_blurred_pixel(image.data, w, h, (int)image.step[0],
+                                           x, y, blur_radius))
+                Ndiffer_pixel++;
+
+    int16_t* response_ref   = (int16_t*)calloc((size_t)w*h, sizeof(int16_t));
+    int16_t* response_fused = (int16_t*)calloc((size_t)w*h, sizeof(int16_t));
+    if(response_ref == NULL || response_fused == NULL)
+    {
+        fprintf(stderr, "Couldn't allocate the responses\n");
+        free(response_ref);
+        free(response_fused);
+        return false;
+    }
+
+    mrgingham_ChESS_response_5(response_ref, blurred.data, w, h, (int)blurred.step[0]);
+    if(!mrgingham_ChESS_response_5_blurred(response_fused, image.data, w, h, (int)image.step[0],
+                                           blur_radius, NULL))
+    {
+        fprintf(stderr, "mrgingham_ChESS_response_5_blurred() failed\n");
+        free(response_ref);
+        free(response_fused);
+        return false;
+    }
+
+    int Ndiffer_response = 0;
+    for(int i=0; i<w*h; i++)
+        if(response_ref[i] != response_fused[i])
+            Ndiffer_response++;
+
+    free(response_ref);
+    free(response_fused);
+
+    if(Ndiffer_pixel != 0 || Ndiffer_response != 0)
+    {
+        fprintf(stderr, "%s, blur radius %d: %d blurred pixels and %d response pixels differ from cv::blur()\n",
+                name, blur_radius, Ndiffer_pixel, Ndiffer_response);
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* usage =
+        "Usage: %s [--radius-max N] [image image ...]\n"
+        "\n"
+        "  For each blur radius in 1..N (MRGINGHAM_CHESS_BLUR_RADIUS_MAX by default),\n"
+        "  checks the fused blur+ChESS kernel against cv::blur() followed by the plain\n"
+        "  ChESS kernel. Each given image is checked. If none are given, a random\n"
+        "  image is. Any differences are reported, and the exit status is nonzero\n"
+        "\n";
+
+    struct option opts[] = {
+        { "radius-max", required_argument, NULL, 'r' },
+        { "help",       no_argument,       NULL, 'h' },
+        {}
+    };
+
+    int radius_max = MRGINGHAM_CHESS_BLUR_RADIUS_MAX;
+
+    int opt;
+    do
+    {
+        // "h" means -h does something
+        opt = getopt_long(argc, argv, "h", opts, NULL);
+        switch(opt)
+        {
+        case -1:
+            break;
+
+        case 'h':
+            printf(usage, argv[0]);
+            return 0;
+
+        case 'r':
+            radius_max = atoi(optarg);
+            break;
+
+        case '?':
+            fprintf(stderr, "Unknown option\n");
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    } while( opt != -1 );
+
+    if( radius_max < 1 || radius_max > MRGINGHAM_CHESS_BLUR_RADIUS_MAX )
+    {
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
+    bool ok = true;
+
+    if(optind == argc)
+    {
+        // OpenCV's rounding differs from round(sum/n) only for some sums, and
+        // for small radii only at high intensities. So the random image is
+        // noise on top of a horizontal ramp across the whole intensity range:
+        // the window sums then cover the full range too
+        cv::Mat image(123, 157, CV_8U);
+        srand48(0);
+        for(int y=0; y<image.rows; y++)
+            for(int x=0; x<image.cols; x++)
+            {
+                int v = -20 + 295*x/(image.cols-1) + (int)(lrand48() % 41) - 20;
+                image.ptr(y)[x] = (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+            }
+
+        for(int r=1; r<=radius_max; r++)
+            if(!check(image, "random image", r))
+                ok = false;
+    }
+
+    for(int i=optind; i<argc; i++)
+    {
+        cv::Mat image = cv::imread(argv[i], cv::IMREAD_IGNORE_ORIENTATION | cv::IMREAD_GRAYSCALE);
+        if(image.data == NULL)
+        {
+            fprintf(stderr, "Couldn't open image '%s'\n", argv[i]);
+            ok = false;
+            continue;
+        }
+
+        for(int r=1; r<=radius_max; r++)
+            if(!check(image, argv[i], r))
+                ok = false;
+    }
+
+    if(!ok)
+        return 1;
+    fprintf(stderr, "The fused blur matches cv::blur() for blur radii 1..%d\n", radius_max);
+    return 0;
+}
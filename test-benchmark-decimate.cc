@@ -0,0 +1,146 @@
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <getopt.h>
+
+#include "decimate.hh"
+#include "test-benchmark.hh"
+
+using namespace mrgingham;
+
+// Compares the downsampling used for the image pyramid (decimate()) with the
+// cv::resize(INTER_LINEAR) call it replaced. For each image and each pyramid
+// level I report the time each one takes, and how many pixels differ, and by
+// how much. The summary goes to stderr
+
+int main(int argc, char* argv[])
+{
+    const char* usage =
+        "Usage: %s [--levels N] [--repeat N] image image ...\n"
+        "\n"
+        "  Downsamples each image to each of pyramid levels 1..N (3 by default)\n"
+        "  with cv::resize() and with the decimator mrgingham uses. Writes a vnlog\n"
+        "  with the timings (in ms, the best of --repeat runs, 10 by default), the\n"
+        "  number of pixels that differ and the largest difference. A summary is\n"
+        "  written to stderr\n"
+        "\n";
+
+    struct option opts[] = {
+        { "levels",  required_argument, NULL, 'l' },
+        { "repeat",  required_argument, NULL, 'r' },
+        { "help",    no_argument,       NULL, 'h' },
+        {}
+    };
+
+    int Nlevels = 3;
+    int Nrepeat = 10;
+
+    int opt;
+    do
+    {
+        // "h" means -h does something
+        opt = getopt_long(argc, argv, "h", opts, NULL);
+        switch(opt)
+        {
+        case -1:
+            break;
+
+        case 'h':
+            printf(usage, argv[0]);
+            return 0;
+
+        case 'l':
+            Nlevels = atoi(optarg);
+            break;
+
+        case 'r':
+            Nrepeat = atoi(optarg);
+            break;
+
+        case '?':
+            fprintf(stderr, "Unknown option\n");
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    } while( opt != -1 );
+
+    if( optind > argc-1 || Nlevels < 1 || Nlevels > 10 || Nrepeat <= 0 )
+    {
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
+    int    Nimages = 0, Ndiffer_total = 0, diff_max_total = 0;
+    double t_resize_total = 0, t_decimate_total = 0;
+
+    printf("# filename level t_resize t_decimate Ndiffer diff_max\n");
+    for(int i=optind; i<argc; i++)
+    {
+        cv::Mat image = cv::imread(argv[i], cv::IMREAD_IGNORE_ORIENTATION | cv::IMREAD_GRAYSCALE);
+        if(image.data == NULL)
+        {
+            fprintf(stderr, "Couldn't open image '%s'\n", argv[i]);
+            continue;
+        }
+        Nimages++;
+
+        for(int level=1; level<=Nlevels; level++)
+        {
+            double  scale = 1.0 / ((double)(1 << level));
+            cv::Mat resized, decimated;
+            int     w, h;
+            decimate_size(&w, &h, image.cols, image.rows, level);
+            decimated.create(h, w, CV_8U);
+
+            double t_resize = 1e30, t_decimate = 1e30;
+            for(int irepeat=0; irepeat<Nrepeat; irepeat++)
+            {
+                double t0 = now_ms();
+                cv::resize( image, resized, cv::Size(), scale, scale, cv::INTER_LINEAR );
+                double t1 = now_ms();
+                decimate( decimated.data, (int)decimated.step[0],
+                          image.data, image.cols, image.rows, (int)image.step[0],
+                          level );
+                double t2 = now_ms();
+
+                if(t1-t0 < t_resize)   t_resize   = t1-t0;
+                if(t2-t1 < t_decimate) t_decimate = t2-t1;
+            }
+
+            if(resized.cols != w || resized.rows != h)
+            {
+                fprintf(stderr, "%s level %d: cv::resize() produced a %dx%d image, but I expected %dx%d\n",
+                        argv[i], level, resized.cols, resized.rows, w, h);
+                return 1;
+            }
+
+            int Ndiffer = 0, diff_max = 0;
+            for(int y=0; y<h; y++)
+                for(int x=0; x<w; x++)
+                {
+                    int diff = abs((int)resized.ptr(y)[x] - (int)decimated.ptr(y)[x]);
+                    if(diff != 0)        Ndiffer++;
+                    if(diff > diff_max)  diff_max = diff;
+                }
+
+            printf("%s %d %.3f %.3f %d %d\n", argv[i], level, t_resize, t_decimate, Ndiffer, diff_max);
+
+            t_resize_total   += t_resize;
+            t_decimate_total += t_decimate;
+            Ndiffer_total    += Ndiffer;
+            if(diff_max > diff_max_total) diff_max_total = diff_max;
+        }
+    }
+
+    if(Nimages == 0)
+        return 1;
+    fprintf(stderr,
+            "%d images, levels 1..%d. cv::resize(): %.3fms/image. decimate(): %.3fms/image (%.2fx). "
+            "%d pixels differ, by at most %d\n",
+            Nimages, Nlevels,
+            t_resize_total/Nimages, t_decimate_total/Nimages,
+            t_decimate_total > 0 ? t_resize_total/t_decimate_total : 0.,
+            Ndiffer_total, diff_max_total);
+    return 0;
+}
@@ -0,0 +1,304 @@
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <getopt.h>
+#include "mrgingham.hh"
+#include "test-benchmark.hh"
+
+using namespace mrgingham;
+
+// Evaluates the board-presence prefilter (chessboard_presence_score()). I run
+// the full search on each of the given images, and on some synthetic images
+// that have no board, and compute the presence score of each. An image has a
+// board if the full search finds it. For each of a set of thresholds I then
+// report how many of the boards the prefilter would have rejected (the false
+// negatives), how many of the images without a board it would have rejected,
+// and the time per image with and without the prefilter. The summary goes to
+// stderr
+
+// A cluttered scene without a chessboard: a shaded background with rotated
+// rectangles and lines of random gray levels over it. Every other image also
+// has a grid of thin lines, like floor tiles: their crossings look a bit like
+// chessboard corners
+static void make_negative(cv::Mat& image, int W, int H, int i, double noise)
+{
+    std::vector<double> scene((size_t)W*H);
+
+    const double g0 = uniform(60, 200);
+    const double gx = uniform(-60, 60) / W;
+    const double gy = uniform(-60, 60) / H;
+    for(int y=0; y<H; y++)
+        for(int x=0; x<W; x++)
+            scene[x + y*W] = g0 + gx*x + gy*y;
+
+    const int Nshapes = 20 + (int)(drand48()*40);
+    for(int k=0; k<Nshapes; k++)
+    {
+        // A rectangle: a long thin one is a line
+        const bool   line  = drand48() < 0.4;
+        const double cx    = uniform(0, W);
+        const double cy    = uniform(0, H);
+        const double a     = uniform(10, W/6.);
+        const double b     = line ? uniform(1, 4) : uniform(10, H/6.);
+        const double th    = uniform(-M_PI, M_PI);
+        const double c     = cos(th), s = sin(th);
+        const double gray  = uniform(0, 255);
+        const double r     = sqrt(a*a + b*b);
+        for(int y=std::max(0,(int)(cy-r)); y<std::min(H,(int)(cy+r)+1); y++)
+            for(int x=std::max(0,(int)(cx-r)); x<std::min(W,(int)(cx+r)+1); x++)
+            {
+                const double u =  c*(x-cx) + s*(y-cy);
+                const double v = -s*(x-cx) + c*(y-cy);
+                if(fabs(u) <= a && fabs(v) <= b)
+                    scene[x + y*W] = gray;
+            }
+    }
+
+    if(i % 2)
+    {
+        const int    spacing = 20 + (int)(drand48()*60);
+        const double gray    = uniform(0, 255);
+        for(int y=0; y<H; y++)
+            for(int x=0; x<W; x++)
+                if(x % spacing < 2 || y % spacing < 2)
+                    scene[x + y*W] = gray;
+    }
+
+    image.create(H, W, CV_8U);
+    for(int y=0; y<H; y++)
+    {
+        uint8_t* row = image.ptr(y);
+        for(int x=0; x<W; x++)
+        {
+            double I = scene[x + y*W] + noise*gaussian();
+            row[x] = (uint8_t)(I < 0. ? 0. : I > 255. ? 255. : I + 0.5);
+        }
+    }
+}
+
+struct result_t
+{
+    bool   found;
+    double score;
+    double t_search, t_score;
+};
+
+int main(int argc, char* argv[])
+{
+    const char* usage =
+        "Usage: %s [--negatives N] [--width W] [--height H] [--noise sigma] [--seed S]\n"
+        "          [--noclahe] [--blur radius] [--gridn N] [--prefilter-level l] [--repeat N]\n"
+        "          [image image ...]\n"
+        "\n"
+        "  Runs the full chessboard search on each image, with no prefilter, and\n"
+        "  computes the board-presence score of each. The given images are followed\n"
+        "  by --negatives synthetic images without a board (20 by default) of WxH\n"
+        "  pixels (1920x1080 by default), with noise of standard deviation --noise\n"
+        "  (2 by default). Writes a vnlog with, for each image, whether the search\n"
+        "  found the board, the presence score, and the time (in ms, the best of\n"
+        "  --repeat runs, 3 by default) of the search and of the score. A summary\n"
+        "  for a set of prefilter thresholds is written to stderr: how many boards\n"
+        "  and how many of the images without a board would be rejected, and the\n"
+        "  time per image. --noclahe, --blur and --gridn have the same meaning as in\n"
+        "  the mrgingham tool. --prefilter-level is the level of the thumbnail; it's\n"
+        "  picked from the image size by default\n"
+        "\n";
+
+    struct option opts[] = {
+        { "negatives",       required_argument, NULL, 'n' },
+        { "width",           required_argument, NULL, 'W' },
+        { "height",          required_argument, NULL, 'H' },
+        { "noise",           required_argument, NULL, 's' },
+        { "seed",            required_argument, NULL, 'S' },
+        { "noclahe",         no_argument,       NULL, 'C' },
+        { "blur",            required_argument, NULL, 'b' },
+        { "gridn",           required_argument, NULL, 'N' },
+        { "prefilter-level", required_argument, NULL, 'l' },
+        { "repeat",          required_argument, NULL, 'r' },
+        { "help",            no_argument,       NULL, 'h' },
+        {}
+    };
+
+    int    Nnegatives  = 20;
+    int    W           = 1920;
+    int    H           = 1080;
+    double noise       = 2.0;
+    long   seed        = 0;
+    bool   doclahe     = true;
+    int    blur_radius = 1;
+    int    gridn       = 10;
+    int    Nrepeat     = 3;
+
+    // The thumbnail level of the prefilter. <0 to pick it from the image size
+    int    prefilter_level = -1;
+
+    int opt;
+    do
+    {
+        // "h" means -h does something
+        opt = getopt_long(argc, argv, "h", opts, NULL);
+        switch(opt)
+        {
+        case -1:
+            break;
+
+        case 'h':
+            printf(usage, argv[0]);
+            return 0;
+
+        case 'n':
+            Nnegatives = atoi(optarg);
+            break;
+
+        case 'W':
+            W = atoi(optarg);
+            break;
+
+        case 'H':
+            H = atoi(optarg);
+            break;
+
+        case 's':
+            noise = atof(optarg);
+            break;
+
+        case 'S':
+            seed = atol(optarg);
+            break;
+
+        case 'C':
+            doclahe = false;
+            break;
+
+        case 'b':
+            blur_radius = atoi(optarg);
+            break;
+
+        case 'N':
+            gridn = atoi(optarg);
+            break;
+
+        case 'l':
+            prefilter_level = atoi(optarg);
+            break;
+
+        case 'r':
+            Nrepeat = atoi(optarg);
+            break;
+
+        case '?':
+            fprintf(stderr, "Unknown option\n");
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    } while( opt != -1 );
+
+    if( Nnegatives < 0 || W < 64 || H < 64 || gridn < 2 || noise < 0 || Nrepeat <= 0 ||
+        (optind == argc && Nnegatives == 0) )
+    {
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
+    srand48(seed);
+
+    cv::Ptr<cv::CLAHE> clahe = cv::createCLAHE();
+    clahe->setClipLimit(8);
+
+    std::vector<result_t> results;
+
+    printf("# image found score t_search t_score\n");
+    const int Nfiles = argc - optind;
+    for(int i=0; i<Nfiles + Nnegatives; i++)
+    {
+        cv::Mat image;
+        char    name[32];
+        const char* filename;
+        if(i < Nfiles)
+        {
+            filename = argv[optind + i];
+            image    = cv::imread(filename, cv::IMREAD_IGNORE_ORIENTATION | cv::IMREAD_GRAYSCALE);
+            if(image.data == NULL)
+            {
+                fprintf(stderr, "Couldn't open image '%s'\n", filename);
+                continue;
+            }
+        }
+        else
+        {
+            sprintf(name, "negative-%d", i - Nfiles);
+            filename = name;
+            make_negative(image, W, H, i - Nfiles, noise);
+        }
+
+        // The same preprocessing as the mrgingham tool. Both the search and
+        // the prefilter get the preprocessed image, so I don't time it
+        if( doclahe )
+        {
+            cv::equalizeHist(image, image);
+            clahe->apply(image, image);
+        }
+        if( blur_radius > 0 )
+            cv::blur( image, image,
+                      cv::Size(1 + 2*blur_radius,
+                               1 + 2*blur_radius));
+
+        result_t r = { false, 0., 1e30, 1e30 };
+        for(int irepeat=0; irepeat<Nrepeat; irepeat++)
+        {
+            // The search appends to points
+            std::vector<PointDouble> points;
+
+            double t0 = now_ms();
+            r.found = find_chessboard_from_image_array(points, NULL, gridn, image) >= 0;
+            double t1 = now_ms();
+            r.score = chessboard_presence_score(image, gridn, NULL, prefilter_level);
+            double t2 = now_ms();
+
+            if(t1-t0 < r.t_search) r.t_search = t1-t0;
+            if(t2-t1 < r.t_score ) r.t_score  = t2-t1;
+        }
+        printf("%s %d %.3f %.2f %.2f\n", filename, (int)r.found, r.score, r.t_search, r.t_score);
+        results.push_back(r);
+    }
+
+    if(results.empty())
+        return 1;
+
+    int Nboards = 0;
+    for(const result_t& r : results)
+        if(r.found) Nboards++;
+    const int Nempty = (int)results.size() - Nboards;
+
+    double t_none = 0;
+    for(const result_t& r : results)
+        t_none += r.t_search;
+    fprintf(stderr, "%d images, %d with a board. No prefilter: %.2fms/image\n",
+            (int)results.size(), Nboards, t_none / results.size());
+
+    const double thresholds[] = { 0.05, 0.1, 0.2, 0.3, 0.5, 0.7 };
+    for(double threshold : thresholds)
+    {
+        int    Nboards_rejected = 0, Nempty_rejected = 0;
+        double t = 0;
+        for(const result_t& r : results)
+        {
+            const bool rejected = r.score < threshold;
+            t += r.t_score + (rejected ? 0. : r.t_search);
+            if(rejected)
+            {
+                if(r.found) Nboards_rejected++;
+                else        Nempty_rejected++;
+            }
+        }
+        fprintf(stderr, "--prefilter %.2f: rejects %d/%d boards, %d/%d images without a board. %.2fms/image (%.2fx)\n",
+                threshold,
+                Nboards_rejected, Nboards,
+                Nempty_rejected,  Nempty,
+                t / results.size(),
+                t > 0 ? t_none / t : 0.);
+    }
+    return 0;
+}
@@ -0,0 +1,208 @@
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <getopt.h>
+#include "mrgingham.hh"
+#include "test-benchmark.hh"
+
+using namespace mrgingham;
+
+// Compares the two ways of preprocessing the images: CLAHE and blur on the
+// full-resolution image (what the mrgingham tool does by default), and CLAHE
+// and blur on each pyramid level (--pyramid-preprocess). For each image I
+// report the time each one takes, and whether they found the board. The
+// summary goes to stderr
+
+static int detect_fullres(std::vector<PointDouble>& points_out,
+                          signed char** refinement_level,
+                          const cv::Mat& image_input,
+                          cv::Ptr<cv::CLAHE>& clahe,
+                          const preprocess_options_t& preprocess,
+                          int gridn, int image_pyramid_level)
+{
+    cv::Mat image = image_input.clone();
+    if( preprocess.doclahe )
+    {
+        cv::equalizeHist(image, image);
+        clahe->apply(image, image);
+    }
+    if( preprocess.blur_radius > 0 )
+        cv::blur( image, image,
+                  cv::Size(1 + 2*preprocess.blur_radius,
+                           1 + 2*preprocess.blur_radius));
+    return find_chessboard_from_image_array(points_out, refinement_level,
+                                            gridn, image, image_pyramid_level);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* usage =
+        "Usage: %s [--noclahe] [--blur radius] [--level l] [--no-refine] [--gridn N] [--repeat N] image image ...\n"
+        "\n"
+        "  Runs the chessboard detection on each image twice: preprocessing the\n"
+        "  full-resolution image, and preprocessing each pyramid level. Writes a\n"
+        "  vnlog with the timings (in ms, the best of --repeat runs) and the results\n"
+        "  of each, and the largest distance between the corners found by the two.\n"
+        "  A summary is written to stderr. The options have the same meaning as in\n"
+        "  the mrgingham tool\n"
+        "\n";
+
+    struct option opts[] = {
+        { "noclahe",   no_argument,       NULL, 'C' },
+        { "blur",      required_argument, NULL, 'b' },
+        { "level",     required_argument, NULL, 'l' },
+        { "no-refine", no_argument,       NULL, 'R' },
+        { "gridn",     required_argument, NULL, 'N' },
+        { "repeat",    required_argument, NULL, 'r' },
+        { "help",      no_argument,       NULL, 'h' },
+        {}
+    };
+
+    preprocess_options_t preprocess;
+    preprocess.doclahe     = true;
+    preprocess.blur_radius = 1;
+    int  image_pyramid_level = -1;
+    bool do_refine           = true;
+    int  gridn               = 10;
+    int  Nrepeat             = 3;
+
+    int opt;
+    do
+    {
+        // "h" means -h does something
+        opt = getopt_long(argc, argv, "h", opts, NULL);
+        switch(opt)
+        {
+        case -1:
+            break;
+
+        case 'h':
+            printf(usage, argv[0]);
+            return 0;
+
+        case 'C':
+            preprocess.doclahe = false;
+            break;
+
+        case 'b':
+            preprocess.blur_radius = atoi(optarg);
+            break;
+
+        case 'l':
+            image_pyramid_level = atoi(optarg);
+            break;
+
+        case 'R':
+            do_refine = false;
+            break;
+
+        case 'N':
+            gridn = atoi(optarg);
+            break;
+
+        case 'r':
+            Nrepeat = atoi(optarg);
+            break;
+
+        case '?':
+            fprintf(stderr, "Unknown option\n");
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    } while( opt != -1 );
+
+    if( optind > argc-1 || gridn < 2 || Nrepeat <= 0 )
+    {
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
+    cv::Ptr<cv::CLAHE> clahe = cv::createCLAHE();
+    clahe->setClipLimit(8);
+
+    signed char* refinement_level = NULL;
+
+    int    Nimages = 0, Nfound_fullres = 0, Nfound_pyramid = 0, Ndisagree = 0;
+    double t_fullres_total = 0, t_pyramid_total = 0;
+
+    printf("# filename t_fullres t_pyramid level_fullres level_pyramid max_distance\n");
+    for(int i=optind; i<argc; i++)
+    {
+        cv::Mat image = cv::imread(argv[i], cv::IMREAD_IGNORE_ORIENTATION | cv::IMREAD_GRAYSCALE);
+        if(image.data == NULL)
+        {
+            fprintf(stderr, "Couldn't open image '%s'\n", argv[i]);
+            continue;
+        }
+
+        std::vector<PointDouble> points_fullres, points_pyramid;
+        int    level_fullres = -1, level_pyramid = -1;
+        double t_fullres = 1e30, t_pyramid = 1e30;
+        for(int irepeat=0; irepeat<Nrepeat; irepeat++)
+        {
+            // The detection appends to the points
+            points_fullres.clear();
+            points_pyramid.clear();
+
+            double t0 = now_ms();
+            level_fullres =
+                detect_fullres(points_fullres,
+                               do_refine ? &refinement_level : NULL,
+                               image, clahe, preprocess,
+                               gridn, image_pyramid_level);
+            double t1 = now_ms();
+            level_pyramid =
+                find_chessboard_from_image_array(points_pyramid,
+                                                 do_refine ? &refinement_level : NULL,
+                                                 gridn, image, preprocess,
+                                                 search_options_t(),
+                                                 image_pyramid_level);
+            double t2 = now_ms();
+
+            if(t1-t0 < t_fullres) t_fullres = t1-t0;
+            if(t2-t1 < t_pyramid) t_pyramid = t2-t1;
+        }
+
+        printf("%s %.2f %.2f", argv[i], t_fullres, t_pyramid);
+        printf(level_fullres >= 0 ? " %d" : " -", level_fullres);
+        printf(level_pyramid >= 0 ? " %d" : " -", level_pyramid);
+        if(level_fullres >= 0 && level_pyramid >= 0)
+        {
+            // Both return the corners in the same order
+            double d2_max = 0;
+            for(int j=0; j<(int)points_fullres.size(); j++)
+            {
+                double dx = points_fullres[j].x - points_pyramid[j].x;
+                double dy = points_fullres[j].y - points_pyramid[j].y;
+                if(dx*dx + dy*dy > d2_max) d2_max = dx*dx + dy*dy;
+            }
+            printf(" %.3f\n", sqrt(d2_max));
+        }
+        else
+            printf(" -\n");
+
+        Nimages++;
+        t_fullres_total += t_fullres;
+        t_pyramid_total += t_pyramid;
+        if(level_fullres >= 0)                   Nfound_fullres++;
+        if(level_pyramid >= 0)                   Nfound_pyramid++;
+        if((level_fullres >= 0) != (level_pyramid >= 0)) Ndisagree++;
+    }
+
+    free(refinement_level);
+
+    if(Nimages == 0)
+        return 1;
+    fprintf(stderr,
+            "%d images. Full-resolution preprocessing: found %d, %.1fms/image. "
+            "Per-level preprocessing: found %d, %.1fms/image (%.2fx). "
+            "%d images found by only one of the two\n",
+            Nimages,
+            Nfound_fullres, t_fullres_total/Nimages,
+            Nfound_pyramid, t_pyramid_total/Nimages,
+            t_pyramid_total > 0 ? t_fullres_total/t_pyramid_total : 0.,
+            Ndisagree);
+    return 0;
+}
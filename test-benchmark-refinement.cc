@@ -0,0 +1,324 @@
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <getopt.h>
+#include "mrgingham.hh"
+#include "test-benchmark.hh"
+
+using namespace mrgingham;
+
+// Compares the ways of refining the detected corners (refinement_mode_t) on
+// synthetic chessboards, where the true corner positions are known. Each board
+// is rendered with a random pose and perspective, antialiased, with some
+// gaussian noise. For each board and each refinement mode I report the time
+// the detection takes, and the RMS and worst errors of the corners. The summary
+// goes to stderr
+
+// Maps board coordinates (in squares) to image pixels
+struct homography_t
+{
+    double h[9];
+};
+
+static void map_point(double* x, double* y, const homography_t* H, double u, double v)
+{
+    const double* h = H->h;
+    double z = h[6]*u + h[7]*v + h[8];
+    *x = (h[0]*u + h[1]*v + h[2]) / z;
+    *y = (h[3]*u + h[4]*v + h[5]) / z;
+}
+
+// 3x3 inverse, by cofactors
+static void invert(homography_t* Hinv, const homography_t* H)
+{
+    const double* m = H->h;
+    double*       r = Hinv->h;
+    r[0] =   m[4]*m[8] - m[5]*m[7];
+    r[1] = -(m[1]*m[8] - m[2]*m[7]);
+    r[2] =   m[1]*m[5] - m[2]*m[4];
+    r[3] = -(m[3]*m[8] - m[5]*m[6]);
+    r[4] =   m[0]*m[8] - m[2]*m[6];
+    r[5] = -(m[0]*m[5] - m[2]*m[3]);
+    r[6] =   m[3]*m[7] - m[4]*m[6];
+    r[7] = -(m[0]*m[7] - m[1]*m[6]);
+    r[8] =   m[0]*m[4] - m[1]*m[3];
+    double det = m[0]*r[0] + m[1]*r[3] + m[2]*r[6];
+    for(int i=0; i<9; i++) r[i] /= det;
+}
+
+// A board of (gridn+1)x(gridn+1) squares, with its inner corners at integer
+// coordinates 1..gridn, surrounded by a white border. The pose is random, and
+// the board covers roughly half the image
+static void make_board(cv::Mat& image, std::vector<PointDouble>& corners,
+                       int W, int H, int gridn, double noise)
+{
+    const double Nsquares = (double)(gridn+1);
+    const double size     = uniform(0.35, 0.6) * (double)(W < H ? W : H);
+    const double angle    = uniform(-M_PI, M_PI);
+    const double cx       = uniform(0.4, 0.6) * W;
+    const double cy       = uniform(0.4, 0.6) * H;
+    const double k        = size / Nsquares;
+
+    // Similarity, centered on the board, followed by a mild perspective about
+    // the center of the board
+    homography_t Hboard = {{ k*cos(angle), -k*sin(angle), 0,
+                             k*sin(angle),  k*cos(angle), 0,
+                             0,             0,            1 }};
+    Hboard.h[2] = cx - (Hboard.h[0] + Hboard.h[1]) * Nsquares/2.;
+    Hboard.h[5] = cy - (Hboard.h[3] + Hboard.h[4]) * Nsquares/2.;
+    const double px = uniform(-0.2, 0.2) / size;
+    const double py = uniform(-0.2, 0.2) / size;
+    homography_t Hpersp = {{ 1 + cx*px, cx*py,     -cx*(px*cx + py*cy),
+                             cy*px,     1 + cy*py, -cy*(px*cx + py*cy),
+                             px,        py,        1 - (px*cx + py*cy) }};
+    homography_t Hmap;
+    for(int i=0; i<3; i++)
+        for(int j=0; j<3; j++)
+        {
+            Hmap.h[i*3+j] = 0;
+            for(int l=0; l<3; l++)
+                Hmap.h[i*3+j] += Hpersp.h[i*3+l] * Hboard.h[l*3+j];
+        }
+    homography_t Hinv;
+    invert(&Hinv, &Hmap);
+
+    corners.clear();
+    for(int j=1; j<=gridn; j++)
+        for(int i=1; i<=gridn; i++)
+        {
+            PointDouble p;
+            map_point(&p.x, &p.y, &Hmap, (double)i, (double)j);
+            corners.push_back(p);
+        }
+
+    // Pixel (x,y) covers [x-0.5,x+0.5]. I supersample each one 4x4
+    const int Nss = 4;
+    image.create(H, W, CV_8U);
+    for(int y=0; y<H; y++)
+    {
+        uint8_t* row = image.ptr(y);
+        for(int x=0; x<W; x++)
+        {
+            double sum = 0;
+            for(int sy=0; sy<Nss; sy++)
+                for(int sx=0; sx<Nss; sx++)
+                {
+                    double u, v;
+                    map_point(&u, &v, &Hinv,
+                              x - 0.5 + (sx + 0.5)/Nss,
+                              y - 0.5 + (sy + 0.5)/Nss);
+                    bool dark =
+                        u >= 0 && u < Nsquares && v >= 0 && v < Nsquares &&
+                        ((int)floor(u) + (int)floor(v)) % 2 == 1;
+                    sum += dark ? 40. : 210.;
+                }
+            double I = sum / (Nss*Nss) + noise*gaussian();
+            row[x] = (uint8_t)(I < 0. ? 0. : I > 255. ? 255. : I + 0.5);
+        }
+    }
+}
+
+// The corners come back in some order that depends on the pose, so I match
+// each to its nearest true corner
+static void corner_errors(double* rms, double* worst,
+                          const std::vector<PointDouble>& found,
+                          const std::vector<PointDouble>& truth)
+{
+    double sum = 0;
+    *worst = 0;
+    for(const PointDouble& p : found)
+    {
+        double d2_min = 1e30;
+        for(const PointDouble& q : truth)
+        {
+            double dx = p.x - q.x, dy = p.y - q.y;
+            if(dx*dx + dy*dy < d2_min) d2_min = dx*dx + dy*dy;
+        }
+        sum += d2_min;
+        if(d2_min > *worst) *worst = d2_min;
+    }
+    *rms   = sqrt(sum / found.size());
+    *worst = sqrt(*worst);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* usage =
+        "Usage: %s [--count N] [--width W] [--height H] [--gridn N] [--noise sigma] [--blur radius] [--seed S] [--repeat N]\n"
+        "\n"
+        "  Renders --count synthetic chessboards (20 by default) of WxH pixels\n"
+        "  (1920x1080 by default) with known corners, and detects them with each\n"
+        "  refinement mode: pyramid, saddle and saddle-fullres. Writes a vnlog with\n"
+        "  the detection time (in ms, the best of --repeat runs, 3 by default), the\n"
+        "  level of the detection and the RMS and worst corner errors, in pixels.\n"
+        "  --noise is the standard deviation of the pixel noise (2 by default).\n"
+        "  Like the mrgingham tool, I blur the image before the detection; --blur\n"
+        "  has the same meaning as there.\n"
+        "  A summary is written to stderr\n"
+        "\n";
+
+    struct option opts[] = {
+        { "count",   required_argument, NULL, 'n' },
+        { "width",   required_argument, NULL, 'W' },
+        { "height",  required_argument, NULL, 'H' },
+        { "gridn",   required_argument, NULL, 'N' },
+        { "noise",   required_argument, NULL, 's' },
+        { "blur",    required_argument, NULL, 'b' },
+        { "seed",    required_argument, NULL, 'S' },
+        { "repeat",  required_argument, NULL, 'r' },
+        { "help",    no_argument,       NULL, 'h' },
+        {}
+    };
+
+    int    Nboards = 20;
+    int    W       = 1920;
+    int    H       = 1080;
+    int    gridn   = 10;
+    double noise   = 2.0;
+    int    blur_radius = 1;
+    long   seed    = 0;
+    int    Nrepeat = 3;
+
+    int opt;
+    do
+    {
+        // "h" means -h does something
+        opt = getopt_long(argc, argv, "h", opts, NULL);
+        switch(opt)
+        {
+        case -1:
+            break;
+
+        case 'h':
+            printf(usage, argv[0]);
+            return 0;
+
+        case 'n':
+            Nboards = atoi(optarg);
+            break;
+
+        case 'W':
+            W = atoi(optarg);
+            break;
+
+        case 'H':
+            H = atoi(optarg);
+            break;
+
+        case 'N':
+            gridn = atoi(optarg);
+            break;
+
+        case 's':
+            noise = atof(optarg);
+            break;
+
+        case 'b':
+            blur_radius = atoi(optarg);
+            break;
+
+        case 'S':
+            seed = atol(optarg);
+            break;
+
+        case 'r':
+            Nrepeat = atoi(optarg);
+            break;
+
+        case '?':
+            fprintf(stderr, "Unknown option\n");
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    } while( opt != -1 );
+
+    if( optind != argc || Nboards <= 0 || W < 64 || H < 64 || gridn < 2 ||
+        noise < 0 || Nrepeat <= 0 )
+    {
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
+    srand48(seed);
+
+    const refinement_mode_t modes[] = { REFINEMENT_PYRAMID,
+                                        REFINEMENT_SADDLE,
+                                        REFINEMENT_SADDLE_FULLRES };
+    const char* mode_names[] = { "pyramid", "saddle", "saddle-fullres" };
+    const int Nmodes = (int)(sizeof(modes)/sizeof(modes[0]));
+
+    int    Nfound  [Nmodes] = {};
+    double t_total [Nmodes] = {};
+    double sum_rms2[Nmodes] = {};
+    double worst   [Nmodes] = {};
+
+    signed char* refinement_level = NULL;
+
+    printf("# board mode t level rms_error worst_error\n");
+    for(int iboard=0; iboard<Nboards; iboard++)
+    {
+        cv::Mat                  image;
+        std::vector<PointDouble> truth;
+        make_board(image, truth, W, H, gridn, noise);
+        if( blur_radius > 0 )
+            cv::blur( image, image,
+                      cv::Size(1 + 2*blur_radius,
+                               1 + 2*blur_radius));
+
+        for(int imode=0; imode<Nmodes; imode++)
+        {
+            search_options_t search;
+            search.refinement = modes[imode];
+
+            std::vector<PointDouble> points;
+            int    level = -1;
+            double t     = 1e30;
+            for(int irepeat=0; irepeat<Nrepeat; irepeat++)
+            {
+                // The detection appends to points
+                points.clear();
+
+                double t0 = now_ms();
+                level = find_chessboard_from_image_array(points, &refinement_level,
+                                                         gridn, image,
+                                                         preprocess_options_t(), search);
+                double t1 = now_ms();
+                if(t1-t0 < t) t = t1-t0;
+            }
+
+            if(level < 0)
+            {
+                printf("%d %s %.2f - - -\n", iboard, mode_names[imode], t);
+                continue;
+            }
+
+            double rms, worst_board;
+            corner_errors(&rms, &worst_board, points, truth);
+            printf("%d %s %.2f %d %.4f %.4f\n", iboard, mode_names[imode], t, level, rms, worst_board);
+
+            Nfound  [imode]++;
+            t_total [imode] += t;
+            sum_rms2[imode] += rms*rms;
+            if(worst_board > worst[imode]) worst[imode] = worst_board;
+        }
+    }
+
+    free(refinement_level);
+
+    for(int imode=0; imode<Nmodes; imode++)
+    {
+        if(Nfound[imode] == 0)
+        {
+            fprintf(stderr, "%-15s: found 0/%d boards\n", mode_names[imode], Nboards);
+            continue;
+        }
+        fprintf(stderr, "%-15s: found %d/%d boards. %.1fms/board. RMS error %.3f pixels; worst %.3f pixels\n",
+                mode_names[imode], Nfound[imode], Nboards,
+                t_total[imode] / Nfound[imode],
+                sqrt(sum_rms2[imode] / Nfound[imode]),
+                worst[imode]);
+    }
+    return 0;
+}
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+
+// Helpers shared by the test-benchmark-... tools
+
+// A monotonic clock, in milliseconds
+static inline double now_ms(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (double)t.tv_sec * 1e3 + (double)t.tv_nsec / 1e6;
+}
+
+// Uniform in [a,b). Seed with srand48()
+static inline double uniform(double a, double b)
+{
+    return a + (b-a)*drand48();
+}
+
+// Zero-mean, unit-variance gaussian. Seed with srand48()
+static inline double gaussian(void)
+{
+    // Box-Muller
+    double u1 = drand48(), u2 = drand48();
+    if(u1 < 1e-300) u1 = 1e-300;
+    return sqrt(-2.*log(u1)) * cos(2.*M_PI*u2);
+}
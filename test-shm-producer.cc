@@ -0,0 +1,167 @@
+#include <opencv2/imgproc/imgproc.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <getopt.h>
+#include <sys/mman.h>
+#include <vector>
+
+#include "shm_ring.hh"
+
+using namespace mrgingham;
+
+// A stand-in for a capture process. Creates a shared-memory frame ring, and
+// publishes the given images into it as raw frames, to be processed by
+// "mrgingham --shm NAME". The results are read back out of the result ring,
+// and written to stdout in the same vnlog format as the mrgingham tool
+
+static void print_result(shm_result_header_t* result, const char* filename)
+{
+    if(result->status < 0)
+    {
+        printf("%s - - -\n", filename);
+        return;
+    }
+    shm_result_point_t* points = shm_result_points(result);
+    for(int i=0; i<result->N; i++)
+        printf("%s %f %f %d\n", filename, points[i].x, points[i].y, points[i].level);
+}
+
+int main(int argc, char* argv[])
+{
+    const char* usage =
+        "Usage: %s --name NAME [--slots N] [--repeat N] [--gridn N] image image ...\n"
+        "\n"
+        "  Creates the POSIX shared-memory frame ring NAME (a name such as\n"
+        "  '/mrgingham'), and publishes the given images into it. Start\n"
+        "  'mrgingham --shm NAME' to process the frames. The ring has --slots slots\n"
+        "  (8 by default). The images are published --repeat times (once by default).\n"
+        "  --gridn must match the --gridn given to mrgingham; it defaults to 10\n"
+        "\n";
+
+    struct option opts[] = {
+        { "name",    required_argument, NULL, 'n' },
+        { "slots",   required_argument, NULL, 's' },
+        { "repeat",  required_argument, NULL, 'r' },
+        { "gridn",   required_argument, NULL, 'N' },
+        { "help",    no_argument,       NULL, 'h' },
+        {}
+    };
+
+    const char* name   = NULL;
+    int         Nslots = 8;
+    int         Nrepeat = 1;
+    int         gridn  = 10;
+
+    int opt;
+    do
+    {
+        // "h" means -h does something
+        opt = getopt_long(argc, argv, "h", opts, NULL);
+        switch(opt)
+        {
+        case -1:
+            break;
+
+        case 'h':
+            printf(usage, argv[0]);
+            return 0;
+
+        case 'n':
+            name = optarg;
+            break;
+
+        case 's':
+            Nslots = atoi(optarg);
+            break;
+
+        case 'r':
+            Nrepeat = atoi(optarg);
+            break;
+
+        case 'N':
+            gridn = atoi(optarg);
+            break;
+
+        case '?':
+            fprintf(stderr, "Unknown option\n");
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    } while( opt != -1 );
+
+    if( name == NULL || optind > argc-1 || Nslots <= 0 || Nrepeat <= 0 || gridn < 2 )
+    {
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+
+    std::vector<cv::Mat>     images;
+    std::vector<const char*> filenames;
+    int max_width = 0, max_height = 0;
+    for(int i=optind; i<argc; i++)
+    {
+        cv::Mat image = cv::imread(argv[i], cv::IMREAD_IGNORE_ORIENTATION | cv::IMREAD_GRAYSCALE);
+        if(image.data == NULL)
+        {
+            fprintf(stderr, "Couldn't open image '%s'\n", argv[i]);
+            return 1;
+        }
+        images.push_back(image);
+        filenames.push_back(argv[i]);
+        if(image.cols > max_width)  max_width  = image.cols;
+        if(image.rows > max_height) max_height = image.rows;
+    }
+
+    shm_ring_t ring;
+    if(!shm_ring_create(&ring, name, Nslots, max_width, max_height, gridn))
+        return 1;
+    fprintf(stderr, "Created ring '%s'. Waiting for 'mrgingham --shm %s' to process the frames\n",
+            name, name);
+
+    printf("# filename x y level\n");
+
+    const uint64_t Nframes = (uint64_t)images.size() * Nrepeat;
+    for(uint64_t sequence=0; sequence<Nframes; sequence++)
+    {
+        // Before reusing a slot I wait for the result of its previous frame
+        if(sequence >= (uint64_t)Nslots)
+        {
+            shm_result_header_t* result = shm_ring_result(&ring, sequence - Nslots);
+            int Nwaits = 0;
+            while(!shm_is_published(&result->published, sequence - Nslots))
+                shm_ring_backoff(&Nwaits);
+            print_result(result, filenames[(sequence - Nslots) % images.size()]);
+        }
+
+        const cv::Mat&      image = images[sequence % images.size()];
+        shm_frame_header_t* frame = shm_ring_frame(&ring, sequence);
+        frame->width  = image.cols;
+        frame->height = image.rows;
+        frame->stride = max_width;
+        for(int y=0; y<image.rows; y++)
+            memcpy(&shm_frame_pixels(frame)[y*frame->stride], image.ptr(y), image.cols);
+
+        shm_publish(&frame->published, sequence);
+        __atomic_store_n(&ring.header->Nframes_published, sequence+1, __ATOMIC_RELEASE);
+    }
+
+    __atomic_store_n(&ring.header->closed, 1, __ATOMIC_RELEASE);
+
+    // The remaining results
+    for(uint64_t sequence = (Nframes > (uint64_t)Nslots) ? Nframes - Nslots : 0;
+        sequence < Nframes;
+        sequence++)
+    {
+        shm_result_header_t* result = shm_ring_result(&ring, sequence);
+        int Nwaits = 0;
+        while(!shm_is_published(&result->published, sequence))
+            shm_ring_backoff(&Nwaits);
+        print_result(result, filenames[sequence % images.size()]);
+    }
+
+    shm_ring_detach(&ring);
+    shm_unlink(name);
+    return 0;
+}